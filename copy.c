@@ -0,0 +1,461 @@
+/*
+ * @file: copy.c
+ *
+ * Host to image copies, pipelined through a ring of aligned buffers
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vfs.h"
+#include "copy.h"
+
+/*
+ * Buffers handed from a filling side to a draining side.  Slots head and
+ * on belong to the filler, tail up to head to the drainer.
+ */
+typedef struct copy_ring_s {
+    char                *data[COPY_BUFFERS];
+    int                 len[COPY_BUFFERS];
+    unsigned int        head;           /* Buffers filled */
+    unsigned int        tail;           /* Buffers drained */
+    int                 done;           /* Filler has nothing more */
+    int                 failed;         /* Either side gave up */
+    int                 fd;             /* Host file of the host side */
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+} copy_ring_t;
+
+int ring_init(copy_ring_t *ring, int fd) {
+    memset(ring, 0, sizeof(copy_ring_t));
+    for (int i = 0; i < COPY_BUFFERS; i++) {
+        if (posix_memalign((void**)&(ring->data[i]), COPY_ALIGN, COPY_BUFFER_SIZE) != 0) {
+            while (i-- > 0) free(ring->data[i]);
+            return -1;
+        }
+    }
+    ring->fd = fd;
+    pthread_mutex_init(&(ring->lock), NULL);
+    pthread_cond_init(&(ring->cond), NULL);
+    return 0;
+}
+
+void ring_free(copy_ring_t *ring) {
+    for (int i = 0; i < COPY_BUFFERS; i++) free(ring->data[i]);
+    pthread_mutex_destroy(&(ring->lock));
+    pthread_cond_destroy(&(ring->cond));
+}
+
+/*
+ * Wait for an empty buffer to fill
+ *
+ * @return  Index of the buffer, or -1 if the drainer gave up
+ */
+int ring_claim(copy_ring_t *ring) {
+    pthread_mutex_lock(&(ring->lock));
+    while (!ring->failed && ring->head - ring->tail == COPY_BUFFERS) pthread_cond_wait(&(ring->cond), &(ring->lock));
+    int slot = ring->failed ? -1 : (int)(ring->head % COPY_BUFFERS);
+    pthread_mutex_unlock(&(ring->lock));
+    return slot;
+}
+
+/*
+ * Hand the claimed buffer to the drainer, len <= 0 ends the stream
+ * and a negative len marks it failed
+ */
+void ring_publish(copy_ring_t *ring, int len) {
+    pthread_mutex_lock(&(ring->lock));
+    if (len > 0) {
+        ring->len[ring->head % COPY_BUFFERS] = len;
+        ring->head++;
+    } else {
+        ring->done = 1;
+        if (len < 0) ring->failed = 1;
+    }
+    pthread_cond_broadcast(&(ring->cond));
+    pthread_mutex_unlock(&(ring->lock));
+}
+
+/*
+ * Wait for a filled buffer to drain
+ *
+ * @return  Index of the buffer, or -1 once the stream has ended
+ */
+int ring_take(copy_ring_t *ring) {
+    pthread_mutex_lock(&(ring->lock));
+    while (!ring->failed && !ring->done && ring->head == ring->tail) pthread_cond_wait(&(ring->cond), &(ring->lock));
+    int slot = (ring->failed || ring->head == ring->tail) ? -1 : (int)(ring->tail % COPY_BUFFERS);
+    pthread_mutex_unlock(&(ring->lock));
+    return slot;
+}
+
+/*
+ * Give the taken buffer back to the filler, or give up on the stream
+ */
+void ring_release(copy_ring_t *ring, int failed) {
+    pthread_mutex_lock(&(ring->lock));
+    if (failed) ring->failed = 1;
+    else ring->tail++;
+    pthread_cond_broadcast(&(ring->cond));
+    pthread_mutex_unlock(&(ring->lock));
+}
+
+/*
+ * Host side of copy_in: fill whole buffers from the host file
+ */
+void *host_reader(void *arg) {
+    copy_ring_t *ring = arg;
+    int slot;
+
+    while ((slot = ring_claim(ring)) != -1) {
+        int len = 0;
+        while (len < COPY_BUFFER_SIZE) {
+            ssize_t nr = read(ring->fd, ring->data[slot] + len, COPY_BUFFER_SIZE - len);
+            if (nr < 0) { perror("read"); len = -1; break; }
+            if (nr == 0) break;
+            len += nr;
+        }
+        if (len > 0) ring_publish(ring, len);
+        if (len < COPY_BUFFER_SIZE) { ring_publish(ring, (len < 0) ? -1 : 0); break; }
+    }
+    return NULL;
+}
+
+/*
+ * Host side of copy_out: drain buffers into the host file
+ */
+void *host_writer(void *arg) {
+    copy_ring_t *ring = arg;
+    int slot;
+
+    while ((slot = ring_take(ring)) != -1) {
+        int failed = 0;
+        for (int off = 0; off < ring->len[slot]; ) {
+            ssize_t nw = write(ring->fd, ring->data[slot] + off, ring->len[slot] - off);
+            if (nw <= 0) { perror("write"); failed = 1; break; }
+            off += nw;
+        }
+        ring_release(ring, failed);
+    }
+    return NULL;
+}
+
+long long copy_in(const char *host, const char *image) {
+    int fd = open(host, O_RDONLY);
+    if (fd == -1) { perror(host); return -1; }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        fprintf(stderr, "%s: Not a regular file under 4GB\n", host);
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* Replace the old file, then create the new one with its clusters already in place */
+    int file = fileopen(image, BEGIN);
+    if (file != -1) {
+        fileclose(file);
+        deletefile((char*)image);
+    }
+    unsigned int size = st.st_size;
+    int created = 0;
+    if (size > 0) {
+        created = (filecreate_batch(&image, &size, 1) == 1);
+    } else if ((file = filecreate(image)) != -1) {
+        fileclose(file);
+        created = 1;
+    }
+    file = created ? fileopen(image, BEGIN) : -1;
+    if (file == -1) {
+        fprintf(stderr, "%s: Could not create\n", image);
+        close(fd);
+        return -1;
+    }
+
+    copy_ring_t ring;
+    if (ring_init(&ring, fd) == -1) { fileclose(file); close(fd); return -1; }
+    pthread_t reader;
+    pthread_create(&reader, NULL, host_reader, &ring);
+
+    long long total = 0;
+    int slot;
+    while ((slot = ring_take(&ring)) != -1) {
+        int nw = filewrite(file, ring.data[slot], ring.len[slot]);
+        if (nw > 0) total += nw;
+        ring_release(&ring, nw != ring.len[slot]);
+    }
+    pthread_join(reader, NULL);
+    int failed = ring.failed;
+    ring_free(&ring);
+    close(fd);
+
+    /* The host file may have shrunk since it was measured, and a failed copy keeps only what was written */
+    if (total < size) filetruncate(file, total);
+    fileclose(file);
+
+    if (failed) { fprintf(stderr, "%s: Copy failed after %lld bytes\n", image, total); return -1; }
+    return total;
+}
+
+long long copy_out(const char *image, const char *host) {
+    int file = fileopen(image, BEGIN);
+    if (file == -1) { fprintf(stderr, "%s: No Such File or Directory\n", image); return -1; }
+
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) { perror(host); fileclose(file); return -1; }
+
+    copy_ring_t ring;
+    if (ring_init(&ring, fd) == -1) { fileclose(file); close(fd); return -1; }
+    pthread_t writer;
+    pthread_create(&writer, NULL, host_writer, &ring);
+
+    long long total = 0;
+    int slot;
+    while ((slot = ring_claim(&ring)) != -1) {
+        int nr = fileread(file, ring.data[slot], COPY_BUFFER_SIZE);
+        if (nr > 0) total += nr;
+        ring_publish(&ring, nr);
+        if (nr <= 0) break;
+    }
+    if (slot == -1) ring_publish(&ring, 0);
+    pthread_join(writer, NULL);
+    int failed = ring.failed;
+    ring_free(&ring);
+    fileclose(file);
+
+    if (close(fd) == -1) failed = 1;
+    if (failed) { fprintf(stderr, "%s: Copy failed after %lld bytes\n", host, total); return -1; }
+    return total;
+}
+
+/*********** Tree Copies ***************/
+
+/* A file of a tree copy, created, opened and reserved before any worker sees it */
+typedef struct copy_job_s {
+    char            *host;
+    char            *image;
+    unsigned int    size;
+    int             dir;            /* Index of the directory it goes in */
+    int             file;           /* Open until its data is in, -1 if never created */
+    fs_extent_t     *extents;
+    int             n_extents;
+    long long       copied;         /* Bytes written by the worker that took it */
+} copy_job_t;
+
+/* Jobs of one worker, it takes the newest and the others steal the oldest */
+typedef struct copy_queue_s {
+    copy_job_t      **jobs;
+    int             head;
+    int             tail;
+    pthread_mutex_t lock;
+} copy_queue_t;
+
+/* State of a tree copy, nftw gives no way to pass it along */
+static struct {
+    size_t          host_len;       /* Length of the host root without trailing slashes */
+    const char      *image;
+    char            **dirs;         /* Image paths of the directories, parents first */
+    int             n_dirs;
+    int             *level_dir;     /* Directory being walked at each depth */
+    int             n_levels;
+    copy_job_t      *jobs;
+    int             n_jobs;
+    copy_queue_t    *queues;
+    int             n_threads;
+} tree;
+
+int tree_scan(const char *fpath, const struct stat *st, int type, struct FTW *ftw) {
+    const char *rel = fpath + tree.host_len;
+    char *to = malloc(strlen(tree.image) + strlen(rel) + 1);
+    sprintf(to, "%s%s", tree.image, rel);
+    
+    if (type == FTW_D) {
+        if ((tree.n_dirs & (tree.n_dirs - 1)) == 0) tree.dirs = realloc(tree.dirs, (tree.n_dirs ? tree.n_dirs * 2 : 1) * sizeof(char*));
+        if (ftw->level >= tree.n_levels) {
+            tree.n_levels = ftw->level + 16;
+            tree.level_dir = realloc(tree.level_dir, tree.n_levels * sizeof(int));
+        }
+        tree.level_dir[ftw->level] = tree.n_dirs;
+        tree.dirs[tree.n_dirs++] = to;
+    } else if (type == FTW_F && S_ISREG(st->st_mode) && ftw->level > 0) {
+        if (st->st_size > UINT32_MAX) {
+            fprintf(stderr, "%s: Not a regular file under 4GB\n", fpath);
+            free(to);
+            return 0;
+        }
+        if ((tree.n_jobs & (tree.n_jobs - 1)) == 0) tree.jobs = realloc(tree.jobs, (tree.n_jobs ? tree.n_jobs * 2 : 1) * sizeof(copy_job_t));
+        copy_job_t *job = &(tree.jobs[tree.n_jobs++]);
+        memset(job, 0, sizeof(copy_job_t));
+        job->host = strdup(fpath);
+        job->image = to;
+        job->size = st->st_size;
+        job->dir = tree.level_dir[ftw->level - 1];
+        job->file = -1;
+    } else {
+        free(to);
+    }
+    return 0;
+}
+
+int compare_job_dir(const void *a, const void *b) {
+    return ((const copy_job_t*)a)->dir - ((const copy_job_t*)b)->dir;
+}
+
+void push_job(int id, copy_job_t *job) {
+    copy_queue_t *q = &(tree.queues[id]);
+    if ((q->tail & (q->tail - 1)) == 0) q->jobs = realloc(q->jobs, (q->tail ? q->tail * 2 : 1) * sizeof(copy_job_t*));
+    q->jobs[q->tail++] = job;
+}
+
+/* Newest job from our own queue, else the oldest from someone else's */
+copy_job_t *take_job(int id) {
+    for (int i = 0; i < tree.n_threads; i++) {
+        copy_queue_t *q = &(tree.queues[(id + i) % tree.n_threads]);
+        copy_job_t *job = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) job = (i == 0) ? q->jobs[--q->tail] : q->jobs[q->head++];
+        pthread_mutex_unlock(&q->lock);
+        if (job != NULL) return job;
+    }
+    return NULL;
+}
+
+/*
+ * Worker of a tree copy: read each host file and write it straight into
+ * the runs reserved for it.  No two jobs share a cluster, so workers never
+ * need to coordinate beyond taking jobs.
+ */
+void *tree_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    char *buff = NULL;
+    if (posix_memalign((void**)&buff, COPY_ALIGN, COPY_BUFFER_SIZE) != 0) { return NULL; }
+    
+    copy_job_t *job;
+    while ((job = take_job(id)) != NULL) {
+        int fd = open(job->host, O_RDONLY);
+        if (fd == -1) { perror(job->host); continue; }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        
+        int more = 1;
+        for (int e = 0; e < job->n_extents && more; e++) {
+            fs_extent_t *ext = &(job->extents[e]);
+            for (unsigned int done = 0; done < ext->length && more; ) {
+                int want = (ext->length - done < COPY_BUFFER_SIZE) ? ext->length - done : COPY_BUFFER_SIZE;
+                int len = 0;
+                while (len < want) {
+                    ssize_t nr = read(fd, buff + len, want - len);
+                    if (nr < 0) perror(job->host);
+                    if (nr <= 0) break;
+                    len += nr;
+                }
+                if (len > 0 && filewrite_extent(job->file, ext, done, buff, len) != len) len = 0;
+                job->copied += len;
+                done += len;
+                more = (len == want);
+            }
+        }
+        close(fd);
+    }
+    free(buff);
+    return NULL;
+}
+
+int copy_tree_in(const char *host, const char *image, int threads, long long *bytes) {
+    memset(&tree, 0, sizeof(tree));
+    tree.host_len = strlen(host);
+    while (tree.host_len > 1 && host[tree.host_len - 1] == '/') tree.host_len--;
+    tree.image = image;
+    tree.n_threads = (threads > 0) ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (tree.n_threads < 1) tree.n_threads = 1;
+    if (tree.n_threads > COPY_MAX_THREADS) tree.n_threads = COPY_MAX_THREADS;
+    
+    if (nftw(host, tree_scan, 16, FTW_PHYS) == -1) { perror(host); return -1; }
+    
+    /* Make every directory, parents first.  One that was already there may hold files to replace */
+    char *fresh = calloc(tree.n_dirs + 1, sizeof(char));
+    for (int d = 0; d < tree.n_dirs; d++) fresh[d] = (makedir(tree.dirs[d]) == 0);
+    
+    /*
+     * Then create each directory's files with one batch and reserve their
+     * clusters for the workers.  Each file's entry only claims its clusters
+     * once the file is closed, after the data is in.
+     */
+    tree.queues = calloc(tree.n_threads, sizeof(copy_queue_t));
+    for (int t = 0; t < tree.n_threads; t++) pthread_mutex_init(&(tree.queues[t].lock), NULL);
+    qsort(tree.jobs, tree.n_jobs, sizeof(copy_job_t), compare_job_dir);
+    
+    const char **names = malloc((tree.n_jobs + 1) * sizeof(char*));
+    int queued = 0;
+    for (int i = 0, j; i < tree.n_jobs; i = j) {
+        int n = 0;
+        for (j = i; j < tree.n_jobs && tree.jobs[j].dir == tree.jobs[i].dir; j++) {
+            copy_job_t *job = &(tree.jobs[j]);
+            if (!fresh[job->dir]) {
+                int file = fileopen(job->image, BEGIN);
+                if (file != -1) {
+                    fileclose(file);
+                    deletefile(job->image);
+                }
+            }
+            names[n++] = job->image;
+        }
+        
+        /* A batch may stop short anywhere, so each name is looked for rather than counted */
+        filecreate_batch(names, NULL, n);
+        for (int k = i; k < j; k++) {
+            copy_job_t *job = &(tree.jobs[k]);
+            job->file = fileopen(job->image, BEGIN);
+            if (job->file == -1) { fprintf(stderr, "%s: Could not create\n", job->image); continue; }
+            
+            job->n_extents = filereserve(job->file, job->size, &(job->extents));
+            if (job->n_extents > 0) push_job(queued++ % tree.n_threads, job);
+        }
+    }
+    free(names);
+    
+    int n_workers = (queued < tree.n_threads) ? queued : tree.n_threads;
+    pthread_t workers[COPY_MAX_THREADS];
+    for (int t = 0; t < n_workers; t++) pthread_create(&workers[t], NULL, tree_worker, (void*)(intptr_t)t);
+    for (int t = 0; t < n_workers; t++) pthread_join(workers[t], NULL);
+    
+    /* Closing writes each file home.  One that came up short keeps what was copied, so it does not end in stale clusters */
+    int copied = 0;
+    for (int i = 0; i < tree.n_jobs; i++) {
+        copy_job_t *job = &(tree.jobs[i]);
+        if (job->file == -1) {
+            /* Never created, already reported */
+        } else if (job->copied == job->size) {
+            copied++;
+            *bytes += job->copied;
+        } else {
+            fprintf(stderr, "%s: Copy failed after %lld bytes\n", job->image, job->copied);
+            filetruncate(job->file, job->copied);
+        }
+        if (job->file != -1) fileclose(job->file);
+        free(job->host);
+        free(job->image);
+        free(job->extents);
+    }
+    
+    for (int t = 0; t < tree.n_threads; t++) {
+        pthread_mutex_destroy(&(tree.queues[t].lock));
+        free(tree.queues[t].jobs);
+    }
+    for (int d = 0; d < tree.n_dirs; d++) free(tree.dirs[d]);
+    free(tree.queues);
+    free(tree.dirs);
+    free(tree.level_dir);
+    free(tree.jobs);
+    free(fresh);
+    return copied;
+}
@@ -0,0 +1,61 @@
+/*
+ * @file: copy.h
+ *
+ * Streaming copies between host files and files on a mounted image.
+ * Host I/O runs on its own thread so it overlaps with the engine. The
+ * engine is called from the calling thread, except in copy_tree_in, whose
+ * workers call filewrite_extent from up to COPY_MAX_THREADS threads;
+ * fat32_writeextent is the one engine call that may run on many threads.
+ */
+
+#ifndef COPY_XINU_HEADER
+#define COPY_XINU_HEADER
+
+/* Bytes moved per engine call, and how many buffers can be in flight */
+#define COPY_BUFFER_SIZE    (1024 * 1024)
+#define COPY_BUFFERS        4
+#define COPY_ALIGN          4096
+
+/*
+ * Copy a host file onto the image, replacing any file already there.
+ * The file's clusters are preallocated from the host size, so they are
+ * contiguous whenever the volume has a long enough free run.
+ *
+ * @param   host        Host file to read
+ * @param   image       Path on the image to write
+ *
+ * @return  -1 for Error, else the number of bytes copied
+ */
+long long copy_in(const char *host, const char *image);
+
+/*
+ * Copy a file on the image out to a host file, replacing it
+ *
+ * @param   image       Path on the image to read
+ * @param   host        Host file to write
+ *
+ * @return  -1 for Error, else the number of bytes copied
+ */
+long long copy_out(const char *image, const char *host);
+
+/* Most workers a tree copy runs */
+#define COPY_MAX_THREADS    64
+
+/*
+ * Copy a host directory tree onto the image, replacing files already
+ * there.  Directories are made and each one's files are created and
+ * preallocated with a single batch on the calling thread, then worker
+ * threads read the host files and write their data straight into the
+ * clusters mapped for them.  Anything but plain files and directories
+ * is skipped.
+ *
+ * @param   host        Host directory to read
+ * @param   image       Directory on the image to create and fill
+ * @param   threads     Workers to run, 0 for one per online CPU
+ * @param   bytes       Increased by the number of bytes copied
+ *
+ * @return  -1 for Error, else the number of files copied
+ */
+int copy_tree_in(const char *host, const char *image, int threads, long long *bytes);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * @file: defrag.c
+ *
+ * Offline defragmenter for FAT32 file systems
+ */
+
+#include "vfs.h"
+
+/*
+ * Fragmentation score: the share of steps from one cluster of a file to
+ * the next that jump somewhere else on the volume.  0 means every file
+ * is a single extent.
+ */
+double frag_score(defrag_stats_t *stats) {
+    if (stats->clusters <= stats->files) return 0.0;
+    return 100.0 * (stats->extents - stats->files) / (stats->clusters - stats->files);
+}
+
+void print_stats(const char *label, defrag_stats_t *stats) {
+    printf("%s: %u of %u files fragmented, %u extents over %u clusters, score %.2f%%\n",
+           label, stats->fragmented, stats->files, stats->extents, stats->clusters, frag_score(stats));
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("usage: defrag device\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    mount_fs(argv[1], "/");
+    
+    defrag_stats_t before, after;
+    int moved = defrag_fs("/", &before, &after);
+    if (moved < 0) {
+        printf("defrag: %s: Not Mounted\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    
+    print_stats("Before", &before);
+    print_stats("After", &after);
+    printf("%d files moved\n", moved);
+    
+    unmount_fs("/");
+    return EXIT_SUCCESS;
+}
@@ -6,14 +6,27 @@
  * Provide common functions for FAT32 filesystems
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
 
 #include "fat32.h"
+#include "trace.h"
 
 /* Extern Definitions */
 uint8_t DskTableFAT16_NumEntries = 8;
@@ -31,7 +44,41 @@ DskSiztoSecPerClus_t DskTableFAT32[] = {
 
 fat_t fat_table[MOUNT_LIMIT];
 
-fat_file_t fat_file_table[FILE_LIMIT];
+/* Engine state of each open file, indexed like filetable */
+handle_table_t fat_file_table = HANDLE_TABLE_INIT(fat_file_t);
+
+/*********** FAT Entry Codecs ***************/
+
+/* FAT12 packs two entries into three bytes, the odd one in the high twelve bits */
+static unsigned int fat12_get(const unsigned char *window, unsigned int index) {
+    const unsigned char *b = window + index + (index >> 1);
+    unsigned int pair = b[0] | (b[1] << 8);
+    return (index & 1) ? (pair >> 4) : (pair & 0x0FFF);
+}
+
+static void fat12_set(unsigned char *window, unsigned int index, unsigned int value) {
+    unsigned char *b = window + index + (index >> 1);
+    if (index & 1) {
+        b[0] = (b[0] & 0x0F) | ((value << 4) & 0xF0);
+        b[1] = (value >> 4) & 0xFF;
+    } else {
+        b[0] = value & 0xFF;
+        b[1] = (b[1] & 0xF0) | ((value >> 8) & 0x0F);
+    }
+}
+
+/* FAT16 and FAT32 entries are plain words, FAT32 keeps the top four bits it does not own */
+#define FAT_WORD_CODEC(bits, mask)                                                      \
+static unsigned int fat##bits##_get(const unsigned char *window, unsigned int index) {  \
+    return ((const uint##bits##_t*)window)[index] & (mask);                             \
+}                                                                                       \
+static void fat##bits##_set(unsigned char *window, unsigned int index, unsigned int value) { \
+    uint##bits##_t *ent = &(((uint##bits##_t*)window)[index]);                          \
+    *ent = (*ent & ~(uint##bits##_t)(mask)) | (value & (mask));                          \
+}
+
+FAT_WORD_CODEC(16, 0xFFFF)
+FAT_WORD_CODEC(32, 0x0FFFFFFF)
 
 // Store the cluster number of current directory
 int current_directory;          
@@ -57,10 +104,110 @@ inline static char to_upper(char c) {
  *
  * @return  Offset in bytes from SEEK_SET of this cluster
  */
-inline static int get_cluster_location(fat_t *fat, int cluster) {
-    return (fat->data_sect + (fat->bs->sectors_per_cluster * (cluster - 2))) * fat->bs->bytes_per_sector;
+inline static off_t get_cluster_location(fat_t *fat, unsigned int cluster) {
+    return ((off_t)fat->data_sect + ((off_t)fat->bs->sectors_per_cluster * (cluster - 2))) * fat->bs->bytes_per_sector;
+}
+
+/*
+ * First sector of the FAT window holding a cluster's entry
+ */
+inline static unsigned int get_fat_window(fat_t *fat, unsigned int cluster) {
+    return fat->bs->reserved_sector_count + ((cluster / fat->window_ents) * fat->codec->window);
 }
 
+/*
+ * Make buff hold the FAT window with a cluster's entry, reading it in
+ * unless it already does
+ *
+ * @param   sector      First sector of the window held in buff, or 0 if buff is empty
+ */
+inline static void fat_window_fetch(int device, fat_t *fat, unsigned int cluster, unsigned int *sector, unsigned char *buff) {
+    unsigned int fat_sector = get_fat_window(fat, cluster);
+    if (*sector != fat_sector) {
+        fat_dev_seek(fat, device, (off_t)fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
+        fat_dev_read(fat, device, buff, fat_window_bytes(fat));
+        fat->stats.fat_reads++;
+        fat->stats.cache_misses++;
+        *sector = fat_sector;
+    } else {
+        fat->stats.cache_hits++;
+    }
+}
+
+
+/*********** FAT Chain Loops ***************/
+
+/*
+ * The loops that touch FAT entries one after another, built once for each
+ * codec so its decode is inlined into them.  A mount reaches them through
+ * its codec, one indirect call per loop rather than per entry.
+ */
+#define FAT_CODEC_LOOPS(bits)                                                           \
+static unsigned int walk_chain_fat##bits(int device, fat_t *fat, unsigned int *cluster, unsigned int steps, \
+                                         unsigned int *sector, unsigned char *buff) {   \
+    unsigned int taken;                                                                 \
+    for (taken = 0; taken < steps; taken++) {                                           \
+        fat_window_fetch(device, fat, *cluster, sector, buff);                          \
+        unsigned int next = fat##bits##_get(buff, *cluster % fat->window_ents);         \
+        if (next < 2 || next >= fat->codec->bad) break;                                 \
+        *cluster = next;                                                                \
+    }                                                                                   \
+    return taken;                                                                       \
+}                                                                                       \
+static unsigned int run_chain_fat##bits(int device, fat_t *fat, unsigned int last, unsigned int max, \
+                                        unsigned int *next, unsigned int *sector, unsigned char *buff) { \
+    unsigned int more = 0;                                                              \
+    while (1) {                                                                         \
+        fat_window_fetch(device, fat, last, sector, buff);                              \
+        *next = fat##bits##_get(buff, last % fat->window_ents);                         \
+        if (more == max || *next != last + 1) return more;                              \
+        last = *next;                                                                   \
+        more++;                                                                         \
+    }                                                                                   \
+}                                                                                       \
+static unsigned int free_chain_fat##bits(int device, fat_t *fat, fat_batch_t *batch, unsigned int cluster, \
+                                         unsigned int *sector, unsigned char *buff) {   \
+    unsigned int freed = 0;                                                             \
+    while (cluster >= 2 && cluster < fat->codec->bad && freed < (unsigned int)fat->n_clusters) { \
+        fat_window_fetch(device, fat, cluster, sector, buff);                           \
+        unsigned int next = fat##bits##_get(buff, cluster % fat->window_ents);          \
+        fat_batch_add(fat, batch, cluster, 0x0);                                        \
+        freed++;                                                                        \
+        cluster = next;                                                                 \
+    }                                                                                   \
+    return freed;                                                                       \
+}                                                                                       \
+static void apply_batch_fat##bits(fat_t *fat, unsigned char *window, const fat_batch_ent_t *ents, int n) { \
+    for (int i = 0; i < n; i++) fat##bits##_set(window, ents[i].cluster % fat->window_ents, ents[i].value); \
+}                                                                                       \
+static unsigned int scan_table_fat##bits(fat_t *fat, const unsigned char *chunk, unsigned int base, unsigned int n) { \
+    unsigned int n_free = 0;                                                            \
+    for (unsigned int i = (base < 2) ? 2 - base : 0; i < n; i++) {                      \
+        unsigned int cluster = base + i;                                                \
+        if (fat##bits##_get(chunk, i) == 0) {                                           \
+            n_free++;                                                                   \
+        } else {                                                                        \
+            fat->cluster_map[cluster >> 3] |= (1 << (cluster & 7));                     \
+            fat->info->last_alloc = cluster;                                            \
+        }                                                                               \
+    }                                                                                   \
+    return n_free;                                                                      \
+}
+
+FAT_CODEC_LOOPS(12)
+FAT_CODEC_LOOPS(16)
+FAT_CODEC_LOOPS(32)
+
+#define FAT_CODEC_FNS(bits) \
+    fat##bits##_get, fat##bits##_set, walk_chain_fat##bits, run_chain_fat##bits, free_chain_fat##bits, apply_batch_fat##bits, scan_table_fat##bits
+
+/* Indexed by FAT type.  Three FAT12 sectors hold a whole number of entries. */
+const fat_codec_t fat_codecs[] = {
+    {FAT16, 16, 1, 0xFFF7, 0xFFFF, FAT_CODEC_FNS(16)},
+    {FAT32, 32, 1, 0x0FFFFFF7, 0x0FFFFFFF, FAT_CODEC_FNS(32)},
+    {FAT12, 12, 3, 0xFF7, 0xFFF, FAT_CODEC_FNS(12)}
+};
+
 
 /*********** Local Functions ***************/
 
@@ -85,12 +232,13 @@ unsigned char lfn_checksum(const unsigned char *filename) {
  * Generates an 8.3 representation of a filename
  * 
  * @param   input       Filename to convert to 8.3
+ * @param   shortname   Buffer of at least 12 bytes to hold the result
  *
- * @return  The 8.3 representation of the filename
+ * @return  shortname, holding the 8.3 representation of the filename
  */
-char * gen_basis_name(char *input) {
+char *gen_basis_name(const char *input, char *shortname) {
     int len = strlen(input);
-    char *shortname = calloc(12, sizeof(char));
+    memset(shortname, 0, 12);
     int start;
     for (start = 0; start < len && (input[start] == 0x20 || input[start] == 0x2e); start++);
     
@@ -170,445 +318,2499 @@ fat_long_direntry_t build_long_entry(int order, char *input, unsigned char *shor
     if ((order & 0x40) == 0x40) {
         if (end_pos < 5) {
             long_ent.charset1[end_pos] = 0x0000;
-        } else if (end_pos < 12) {
+        } else if (end_pos < 11) {
             long_ent.charset2[end_pos - 5] = 0x0000;
         } else if (end_pos < 13) {
-            long_ent.charset3[end_pos - 12] = 0x0000;
+            long_ent.charset3[end_pos - 11] = 0x0000;
         }
     }
     
     return long_ent;
 }
 
-void update_fsinfo(const char *device_name, fat_fsinfo_t *info) {
-    int device = open(device_name, O_WRONLY);
-    lseek(device, 1000, SEEK_SET);
-    write(device, info, 8);
-    close(device);
+/*
+ * Device calls made by the engine, counted in the mount's stats so
+ * metadata and data traffic can be told apart.  On an O_DIRECT mount a
+ * request that is not aligned goes through a pooled buffer instead.
+ */
+int fat_dev_open(fat_t *fat, const char *device_name, int flags) {
+    fat->stats.dev_opens++;
+#ifdef O_DIRECT
+    if (fat->direct) {
+        /* Unaligned writes read around themselves, so write only opens need read access too */
+        if ((flags & O_ACCMODE) == O_WRONLY) flags = (flags & ~O_ACCMODE) | O_RDWR;
+        flags |= O_DIRECT;
+    }
+#endif
+    return open(device_name, flags);
 }
 
-/* 
- * Retrieves the value stored in the FAT table indicating
- * whether this cluster is available for use or not
- *
- * @param   device          Device to read from (i.e. /dev/sda1 or a file), already opened
- * @param   fat             FAT Information to use to compute cluster/sector location
- * @param   cluster         Cluster to index into the FAT Table to retrieve
- *
- * @return  Value stored in the FAT Table at cluster cluster.
+off_t fat_dev_seek(fat_t *fat, int device, off_t offset, int whence) {
+    fat->stats.dev_seeks++;
+    return lseek(device, offset, whence);
+}
+
+/*
+ * Read count bytes at the device position through pooled buffers, each
+ * pass covering the aligned blocks around what is still wanted
  */
-unsigned int read_fat_table(int device, fat_t* fat, int cluster) {
-    unsigned char FAT[fat->bs->bytes_per_sector];
-    unsigned int  fat_offset = cluster * 4;
-    unsigned int  fat_sector = fat->bs->reserved_sector_count + (fat_offset / fat->bs->bytes_per_sector);
-    unsigned int  ent_offset = fat_offset % fat->bs->bytes_per_sector;
+ssize_t fat_direct_read(fat_t *fat, int device, void *buff, size_t count) {
+    size_t a = fat->direct_align;
+    off_t pos = lseek(device, 0, SEEK_CUR);
+    unsigned char *bounce = fat_pool_get(fat);
+    ssize_t done = 0;
     
-    lseek(device, fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
-    read(device, FAT, fat->bs->bytes_per_sector);
-    unsigned int tbl_val = *(unsigned int*)&FAT[ent_offset] & 0x0FFFFFFF;
-    
-    return tbl_val;
+    while ((size_t)done < count) {
+        off_t at = pos + done;
+        size_t lead = at % a;
+        size_t n = count - done;
+        if (n > fat->pool_size - lead) n = fat->pool_size - lead;
+        size_t len = ((lead + n + a - 1) / a) * a;
+        
+        ssize_t rd = pread(device, bounce, len, at - lead);
+        if (rd < 0 && done == 0) done = -1;
+        if (rd <= (ssize_t)lead) break;
+        if (n > rd - lead) n = rd - lead;
+        memcpy((unsigned char*)buff + done, bounce + lead, n);
+        done += n;
+        if (rd < (ssize_t)len) break;
+    }
+    fat_pool_put(fat, bounce);
+    if (done > 0) lseek(device, pos + done, SEEK_SET);
+    return done;
 }
 
-/* 
- * Writes the value passed in to the FAT table
- *
- * @param   device          Device to read/write from (i.e. /dev/sda1 or a file), already opened
- * @param   fat             FAT Information to use to compute cluster/sector location
- * @param   cluster         Cluster of FAT to write to
- * @param   value           Value to write
- *
- * @return  Cluster written to
+/*
+ * Write count bytes at the device position through pooled buffers.  The
+ * blocks a pass only partly covers are read in first so their other
+ * bytes survive.
  */
-unsigned int write_fat_table(int device, fat_t* fat, unsigned int cluster, unsigned int value) {
-    unsigned char FAT[fat->bs->bytes_per_sector];
-    unsigned int  fat_offset = cluster * 4;
-    unsigned int  fat_sector = fat->bs->reserved_sector_count + (fat_offset / fat->bs->bytes_per_sector);
-    unsigned int  ent_offset = fat_offset % fat->bs->bytes_per_sector;
-    
-    /* Populate FAT */
-    lseek(device, fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
-    read(device, FAT, fat->bs->bytes_per_sector);
+ssize_t fat_direct_write(fat_t *fat, int device, const void *buff, size_t count) {
+    size_t a = fat->direct_align;
+    off_t pos = lseek(device, 0, SEEK_CUR);
+    unsigned char *bounce = fat_pool_get(fat);
+    ssize_t done = 0;
     
-    /* Crazy ass way of writing according to the MS FAT 1.03 Specification */
-    *((unsigned int*)&FAT[ent_offset]) = (*((unsigned int*)&FAT[ent_offset])) & 0xF0000000;
-    *((unsigned int*)&FAT[ent_offset]) = (*((unsigned int*)&FAT[ent_offset])) | (value & 0x0FFFFFFF);
+    while ((size_t)done < count) {
+        off_t at = pos + done;
+        size_t lead = at % a;
+        size_t n = count - done;
+        if (n > fat->pool_size - lead) n = fat->pool_size - lead;
+        size_t len = ((lead + n + a - 1) / a) * a;
+        
+        if (lead != 0) {
+            memset(bounce, 0, a);
+            pread(device, bounce, a, at - lead);
+        }
+        if ((lead + n) % a != 0 && (lead == 0 || len > a)) {
+            memset(bounce + len - a, 0, a);
+            pread(device, bounce + len - a, a, at - lead + len - a);
+        }
+        memcpy(bounce + lead, (const unsigned char*)buff + done, n);
+        
+        ssize_t wr = pwrite(device, bounce, len, at - lead);
+        if (wr < 0 && done == 0) done = -1;
+        if (wr <= (ssize_t)lead) break;
+        if (n > wr - lead) n = wr - lead;
+        done += n;
+        if (wr < (ssize_t)len) break;
+    }
+    fat_pool_put(fat, bounce);
+    if (done > 0) lseek(device, pos + done, SEEK_SET);
+    return done;
+}
 
-    
-    //printf("[FAT_WRITE]: Using cluster: [%d] at offset [%d] in sector [%d] at entry [%d]\n", cluster, fat_offset, fat_sector, ent_offset);
-    lseek(device, fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
-    write(device, FAT, fat->bs->bytes_per_sector);
-    
-    //printf("[FAT_WRITE]: Wrote Value: 0x%08X\n", *(unsigned int*)&FAT[ent_offset]);
-    return cluster;
+ssize_t fat_dev_read(fat_t *fat, int device, void *buff, size_t count) {
+    size_t a = fat->direct_align;
+    ssize_t rd;
+    if (fat->direct && (((uintptr_t)buff % a) != 0 || (count % a) != 0 || (lseek(device, 0, SEEK_CUR) % a) != 0)) {
+        rd = fat_direct_read(fat, device, buff, count);
+    } else {
+        rd = read(device, buff, count);
+    }
+    fat->stats.dev_reads++;
+    if (rd > 0) fat->stats.bytes_read += rd;
+    if (rd > 0 && fat->log.n_held > 0) fat_log_overlay(fat, lseek(device, 0, SEEK_CUR) - rd, buff, rd);
+    return rd;
 }
 
-unsigned char * process_long_entry(unsigned char *buff, int *offcount) {
-    fat_long_direntry_t *ent = (fat_long_direntry_t*)buff;
-    
+ssize_t fat_dev_write(fat_t *fat, int device, const void *buff, size_t count) {
+    size_t a = fat->direct_align;
+    ssize_t wr;
+    if (fat->direct && (((uintptr_t)buff % a) != 0 || (count % a) != 0 || (lseek(device, 0, SEEK_CUR) % a) != 0)) {
+        wr = fat_direct_write(fat, device, buff, count);
+    } else {
+        wr = write(device, buff, count);
+    }
+    fat->stats.dev_writes++;
+    if (wr > 0) fat->stats.bytes_written += wr;
+    __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
+    return wr;
+}
+
+/*
+ * Turn on O_DIRECT for a mount whose boot sector is loaded.  The
+ * alignment is the larger of the sector size and what the backend asks
+ * for.  A backend that refuses O_DIRECT, at open or on the first read,
+ * leaves the mount on buffered I/O.
+ */
+void fat_direct_setup(fat_t *fat, const char *device_name) {
+    size_t cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    fat->direct = 0;
     
-    int seq = 0;
-    if ((ent->order & 0x40) != 0x40) {
-        printf("[FAT32]: Not Start of Long Filename. Skipping\n");
-        return NULL;
+#ifdef O_DIRECT
+    int device = open(device_name, O_RDONLY | O_DIRECT);
+    struct stat st;
+    if (device < 0 || fstat(device, &st) < 0) {
+        fprintf(stderr, "[FAT32]: %s does not support O_DIRECT, using buffered I/O\n", device_name);
+        if (device >= 0) close(device);
+        return;
     }
     
-    seq = ent->order & 0x9F;
-    int num_char = seq * 13;
-    unsigned char *str = calloc(num_char, sizeof(char));    
-    num_char--;
+    size_t align = fat->bs->bytes_per_sector;
+    if (S_ISREG(st.st_mode) && (size_t)st.st_blksize > align) align = st.st_blksize;
+#ifdef BLKSSZGET
+    int block_size;
+    if (S_ISBLK(st.st_mode) && ioctl(device, BLKSSZGET, &block_size) == 0 && (size_t)block_size > align) align = block_size;
+#endif
+    fat->direct_align = align;
+    fat->pool_size = ((cluster_size * FAT_POOL_CLUSTERS + align - 1) / align) * align;
     
-    for (int i = seq; i > 0; i--) {   
-        fat_long_direntry_t *ent = (fat_long_direntry_t*)buff;
-        str[num_char--] = (char)(ent->charset3[1]);
-        str[num_char--] = (char)(ent->charset3[0]);
-        str[num_char--] = (char)(ent->charset2[5]);
-        str[num_char--] = (char)(ent->charset2[4]);
-        str[num_char--] = (char)(ent->charset2[3]);
-        str[num_char--] = (char)(ent->charset2[2]);
-        str[num_char--] = (char)(ent->charset2[1]);
-        str[num_char--] = (char)(ent->charset2[0]);
-        str[num_char--] = (char)(ent->charset1[4]);
-        str[num_char--] = (char)(ent->charset1[3]);
-        str[num_char--] = (char)(ent->charset1[2]);
-        str[num_char--] = (char)(ent->charset1[1]);
-        str[num_char--] = (char)(ent->charset1[0]);
-        
-        if (seq != 1) {
-            buff += 32; /* Increase Buffer by 32 to look at next entry */
+    unsigned char *probe = fat_pool_get(fat);
+    if (probe == NULL || pread(device, probe, align, 0) != (ssize_t)align) {
+        fprintf(stderr, "[FAT32]: %s does not support O_DIRECT, using buffered I/O\n", device_name);
+        free(probe);
+        close(device);
+        return;
+    }
+    fat_pool_put(fat, probe);
+    close(device);
+    fat->direct = 1;
+#else
+    (void)cluster_size;
+    fprintf(stderr, "[FAT32]: O_DIRECT is not available, using buffered I/O\n");
+#endif
+}
+
+/*
+ * Take a buffer from the pool, aligned to both the cluster size and what
+ * O_DIRECT needs.  The engine is single threaded, so the pool is too.
+ */
+unsigned char *fat_pool_get(fat_t *fat) {
+    if (fat->n_pool > 0) return fat->pool[--fat->n_pool];
+    
+    size_t align = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    if (align < fat->direct_align) align = fat->direct_align;
+    void *buff = NULL;
+    if (posix_memalign(&buff, align, fat->pool_size) != 0) { return NULL; }
+    return buff;
+}
+
+void fat_pool_put(fat_t *fat, unsigned char *buff) {
+    if (buff == NULL) { return; }
+    if ((fat->n_pool & (fat->n_pool - 1)) == 0) fat->pool = realloc(fat->pool, (fat->n_pool ? fat->n_pool * 2 : 1) * sizeof(unsigned char*));
+    fat->pool[fat->n_pool++] = buff;
+}
+
+void fat_pool_free(fat_t *fat) {
+    for (int i = 0; i < fat->n_pool; i++) free(fat->pool[i]);
+    free(fat->pool);
+    fat->pool = NULL;
+    fat->n_pool = 0;
+}
+
+static int fat_log_append(fat_t *fat, int partial);
+
+/*
+ * Flush everything written to the device since the last flush.  One
+ * fdatasync covers every write, whichever call or thread made it.
+ */
+void fat_flush(fat_t *fat) {
+    if (!fat->sync.up || !__atomic_exchange_n(&(fat->sync.dirty), 0, __ATOMIC_ACQ_REL)) return;
+    __atomic_store_n(&(fat->sync.data_dirty), 0, __ATOMIC_RELEASE);
+    fdatasync(fat->sync.fd);
+    __atomic_add_fetch(&(fat->stats.syncs), 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Commit with sync.lock held: flush the data and FAT behind the held back
+ * entries, write the entries, and flush once more when they must be
+ * durable rather than only visible to later reads
+ */
+static void fat_commit_locked(fat_t *fat, int durable) {
+    if (fat->log.up) {
+        /* Held writes are visible through the overlay, only durability needs them logged */
+        if (durable) fat_log_append(fat, 0);
+    } else if (fat->sync.n_pending > 0) {
+        fat_flush(fat);
+        for (int i = 0; i < fat->sync.n_pending; i++) {
+            pwrite(fat->sync.fd, &(fat->sync.pending[i].ent), 32, fat->sync.pending[i].offset);
         }
-        ++(*offcount);
+        fat->sync.n_pending = 0;
+        __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
     }
-    return str;
+    if (durable) fat_flush(fat);
 }
 
-dir_entry_t extract_dir_entry(dir_t *dir, int cluster_size, unsigned char *buff) {
-    dir_entry_t de;
-    unsigned char *filename = NULL;
-    for (int i = (dir->offset * 32); i < cluster_size / 4; i += 32) {
-        de.dir = 0;
-        unsigned char *b = buff + i;
+/*
+ * Commit a mount.  An entry only reaches the device once the clusters and
+ * FAT it points at are durable, so a crash can leave clusters unclaimed
+ * but never an entry claiming data that was not written.
+ *
+ * @param   durable     Zero when the entries only need to be visible to
+ *                      calls about to read the directories
+ */
+void fat_commit(fat_t *fat, int durable) {
+    if (!fat->sync.up) return;
+    pthread_mutex_lock(&(fat->sync.lock));
+    fat_commit_locked(fat, durable);
+    pthread_mutex_unlock(&(fat->sync.lock));
+}
 
-        if (b[0] == 0x00) { de.name = NULL; break; }
-        if (b[0] == 0xE5) { dir->offset++; continue; }    /* Skip Deleted Entry */
-        if (b[11] == 0x0F) {
-            int off = 0;
-            int *off_ref = &off;
-            filename = process_long_entry(b, off_ref);
-            dir->offset += off;
-            i += ((off - 1) * 32);
-        } else {
-            /* Regular Entry */        
-            switch (((fat_direntry_t*)b)->attributes) {
-                case 0x02:
-                case 0x08:
-                case 0x40:
-                    dir->offset++;
-                    continue;
-                case 0x10:
-                    de.dir = 1;
-                default:
-                    if (filename == NULL) { filename = ((fat_direntry_t*)b)->name; } 
-            }
-            dir->offset++;
-            de.name = b[0] == 0x2E ? (b[1] == 0x2E ? ".." : ".") : (char*)filename;
-            de.misc = b;
-            break;
+/*
+ * Write the 8.3 entry of an open file.  A mount with a sync policy holds
+ * it back for the next commit instead, and a later write of the same entry
+ * replaces it.  Only entries of files written since the last commit are
+ * held, so the list stays short.
+ */
+void fat_put_dirent(fat_t *fat, int device, off_t offset, fat_direntry_t *ent) {
+    if (!fat->sync.up || fat->sync.policy == 0 || fat->log.up) {
+        fat_meta_write(fat, device, offset, ent, 32);
+        return;
+    }
+    
+    pthread_mutex_lock(&(fat->sync.lock));
+    int i;
+    for (i = 0; i < fat->sync.n_pending && fat->sync.pending[i].offset != offset; i++);
+    if (i == fat->sync.n_pending) {
+        if (fat->sync.n_pending == fat->sync.cap_pending) {
+            fat->sync.cap_pending = fat->sync.cap_pending ? fat->sync.cap_pending * 2 : 16;
+            fat->sync.pending = realloc(fat->sync.pending, fat->sync.cap_pending * sizeof(fat_pending_t));
         }
-    }   
-    return de;
+        fat->sync.n_pending++;
+    }
+    fat->sync.pending[i].offset = offset;
+    fat->sync.pending[i].ent = *ent;
+    pthread_mutex_unlock(&(fat->sync.lock));
 }
 
-int find_dir_cluster(fat_t *fat, file_t *file) {
+/*
+ * Ordering point between two stages of a change, such as an entry going
+ * and the clusters it held being freed.  A mount with no sync policy
+ * leaves ordering to the host, one with an intent log needs none since
+ * each call's writes are replayed whole or not at all.
+ */
+static void fat_barrier(fat_t *fat) {
+    if (fat->sync.policy && !fat->log.up) fat_flush(fat);
+}
 
-    int current_cluster = current_directory;;
-    if(file->name[0] == '/') {
-        //printf("Starting from root\n");
-    } else {
-        //printf("Starting from current dir\n");
+/*
+ * Called as a call that changed metadata returns, a MOUNT_SYNC mount
+ * commits before the caller sees the result.  This is also where a call's
+ * held writes become whole enough to log, and where the log checkpoints.
+ */
+void fat_changed(fat_t *fat) {
+    if (fat->log.up) {
+        pthread_mutex_lock(&(fat->sync.lock));
+        fat->log.busy = 0;
+        pthread_mutex_unlock(&(fat->sync.lock));
     }
+    if (fat->sync.policy & MOUNT_SYNC) fat_commit(fat, 1);
     
-    /* Navigate to directory */
-    int flen = strlen(file->name);
-    char path[flen];
-    strncpy(path, file->name, flen);
-    char *lvl = strtok(path, "/");  
+    fat_log_t *l = &(fat->log);
+    if (l->up && (l->n_held >= FAT_LOG_MAX_HELD || l->held_bytes > l->size / 2 || l->head > l->size / 2 ||
+                  (unsigned int)l->n_freed > fat->info->num_free_clusters)) {
+        fat_log_checkpoint(fat);
+    }
+}
+
+/*
+ * Flusher of a MOUNT_SYNC_PERIODIC mount, committing every period_ms until
+ * the mount is torn down
+ */
+static void *fat_flusher(void *arg) {
+    fat_t *fat = arg;
     
-    /* Create DIR structure */
-    dir_t dir;    
-    for (int i = flen - 1; i >= 0; i--) {
-        if (file->name[i] == '/') {
-            if (i == 0) {
-                file->name++;
-                dir.path = "/";
-            } else if (i == flen-1) {
-                file->name[i] = '\0';
-                dir.path = "/";
-            } else {
-                dir.path = file->name;
-                file->name = &(file->name[i+1]);
-                dir.path[i] = '\0';
-            }
-        }
-    }   
-    dir.offset = 0;
-    dir.device = file->device;
-   
-    int device = open(mount_table[file->device]->device_name, O_RDONLY);
-    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
-      
-   
-    do {    
-        int fat_offset = get_cluster_location(fat, current_cluster);
-        
-        lseek(device, fat_offset, SEEK_SET);
-        unsigned char buff[cluster_size];
-        read(device, buff, cluster_size);
-        
-        dir_entry_t dirent;
-        
-        /* Keep going until the file is found */
-        while (1) {
-            dirent = extract_dir_entry(&dir, cluster_size, buff);
-            if (dirent.name == NULL || strcmp(dirent.name, lvl) == 0) { break; }
-        }
-        
-        if (dirent.name == NULL) {
-            printf("%s: File Not found\n", file->name);
-            break;
-        } else {
-            return fat_offset + (dir.offset * 32);
+    pthread_mutex_lock(&(fat->sync.lock));
+    while (!fat->sync.stop) {
+        struct timespec due;
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_sec += fat->sync.period_ms / 1000;
+        due.tv_nsec += (fat->sync.period_ms % 1000) * 1000000L;
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
         }
+        while (!fat->sync.stop && pthread_cond_timedwait(&(fat->sync.cond), &(fat->sync.lock), &due) != ETIMEDOUT);
+        if (!fat->sync.stop) fat_commit_locked(fat, 1);
+    }
+    pthread_mutex_unlock(&(fat->sync.lock));
+    return NULL;
+}
+
+/*
+ * Open the descriptor commits go through and start the flusher a
+ * periodic policy needs.  Called on the mount's slot in fat_table, the
+ * flusher keeps a pointer to it.
+ */
+void fat_sync_setup(fat_t *fat, const char *device_name, int policy, int period_ms) {
+    fat_sync_t *s = &(fat->sync);
+    memset(s, 0, sizeof(fat_sync_t));
+    s->fd = open(device_name, O_RDWR);
+    if (s->fd < 0) {
+        fprintf(stderr, "[FAT32]: %s cannot be flushed, leaving it to the host\n", device_name);
+        return;
+    }
+    s->policy = policy;
+    s->period_ms = (period_ms > 0) ? period_ms : FS_SYNC_PERIOD_MS;
+    pthread_mutex_init(&(s->lock), NULL);
+    pthread_cond_init(&(s->cond), NULL);
+    s->up = 1;
+    
+    if ((policy & MOUNT_SYNC_PERIODIC) && pthread_create(&(s->flusher), NULL, fat_flusher, fat) == 0) s->flusher_up = 1;
+}
+
+/*
+ * Stop the flusher and make everything the mount wrote durable
+ */
+void fat_sync_free(fat_t *fat) {
+    fat_sync_t *s = &(fat->sync);
+    if (!s->up) return;
     
-    } while ((current_cluster = read_fat_table(device, fat, current_cluster)) < 0x0FFFFFF7); 
+    if (s->flusher_up) {
+        pthread_mutex_lock(&(s->lock));
+        s->stop = 1;
+        pthread_cond_signal(&(s->cond));
+        pthread_mutex_unlock(&(s->lock));
+        pthread_join(s->flusher, NULL);
+    }
+    __atomic_store_n(&(s->dirty), 1, __ATOMIC_RELEASE);
+    fat_commit(fat, 1);
     
-    return 0;    
+    pthread_cond_destroy(&(s->cond));
+    pthread_mutex_destroy(&(s->lock));
+    close(s->fd);
+    free(s->pending);
+    memset(s, 0, sizeof(fat_sync_t));
+}
+
+/*
+ * CRC-32 of log records.  The table is filled top down, so once entry 1
+ * is set the rest already are.
+ */
+static uint32_t fat_log_crc(const unsigned char *buff, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (int i = 255; i >= 0; i--) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ buff[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
 }
 
-int fat32_read(int dev, int cluster, int offset, void *buffer, int count) {
+/* Add a held write for a range, its data is left for the caller to fill */
+static fat_held_t *fat_log_hold(fat_t *fat, off_t offset, size_t len) {
+    fat_log_t *l = &(fat->log);
+    if (l->n_held == l->cap_held) {
+        l->cap_held = l->cap_held ? l->cap_held * 2 : 64;
+        l->held = realloc(l->held, l->cap_held * sizeof(fat_held_t));
+    }
+    fat_held_t *h = &(l->held[l->n_held++]);
+    h->offset = offset;
+    h->length = len;
+    h->logged = 0;
+    h->data = malloc(len);
+    if (l->n_held == 1 || offset < l->lo) l->lo = offset;
+    if (l->n_held == 1 || offset + (off_t)len > l->hi) l->hi = offset + len;
+    l->held_bytes += len;
+    return h;
+}
 
-    fat_t fat = fat_table[dev];        
+/*
+ * Write metadata: FAT windows, directory slots and clusters.  On a mount
+ * with an intent log the write is held in memory instead, replacing the
+ * latest held write of the same range when that one is not logged yet.
+ */
+void fat_meta_write(fat_t *fat, int device, off_t offset, const void *buff, size_t len) {
+    if (!fat->log.up) {
+        fat_dev_seek(fat, device, offset, SEEK_SET);
+        fat_dev_write(fat, device, buff, len);
+        return;
+    }
     
-    int device = open(mount_table[dev]->device_name, O_RDONLY);
-    /* Read count bytes */
-    int fat_data_loc = get_cluster_location(&fat, cluster);    
-    lseek(device, fat_data_loc+offset, SEEK_SET);    
-    int nr = read(device, buffer, count);
-    if (nr < 0) perror("read");
-    close(device);
-    return nr;
+    pthread_mutex_lock(&(fat->sync.lock));
+    fat->log.busy = 1;
+    fat_held_t *h = NULL;
+    for (int i = fat->log.n_held - 1; i >= 0; i--) {
+        fat_held_t *c = &(fat->log.held[i]);
+        if (c->offset >= offset + (off_t)len || c->offset + (off_t)c->length <= offset) continue;
+        if (c->offset == offset && c->length == len && !c->logged) h = c;
+        break;
+    }
+    if (h == NULL) h = fat_log_hold(fat, offset, len);
+    memcpy(h->data, buff, len);
+    pthread_mutex_unlock(&(fat->sync.lock));
 }
 
-int find_free_cluster(char *dev, fat_t *fat, int cluster) {
-    int device = open(dev, O_RDONLY);
-    while (read_fat_table(device, fat, cluster) > 0x0) ++cluster;
-    close(device);
-    return cluster;
+/*
+ * Lay the held writes over bytes just read from the device.  Only the
+ * calling thread changes what is held, so it reads it without the lock.
+ */
+void fat_log_overlay(fat_t *fat, off_t offset, void *buff, size_t len) {
+    fat_log_t *l = &(fat->log);
+    if (offset >= l->hi || offset + (off_t)len <= l->lo) return;
+    
+    for (int i = 0; i < l->n_held; i++) {
+        fat_held_t *h = &(l->held[i]);
+        off_t from = (h->offset > offset) ? h->offset : offset;
+        off_t to = h->offset + h->length;
+        if (to > offset + (off_t)len) to = offset + len;
+        if (from < to) memcpy((unsigned char*)buff + (from - offset), h->data + (from - h->offset), to - from);
+    }
 }
 
 /*
- * Write a buffer to the device 
+ * Append every held write not logged yet as one record, so any number of
+ * calls share it and the flush after it.  Called with sync.lock held.
  *
- * @param dev       Name of the device to write to
- * @param fat       FAT table to reference
- * @param cluster   Cluster to start writing at
- * @param offset    Current offset in the cluster to write at
- * @param buffer    Data to write
- * @param count     Amount of data in buffer to write
+ * @param   partial     Log as many of them, in the order they were made,
+ *                      as fit in what is left of the log
  *
- * @return          The total amount of data written
- */ 
-int fat32_writedata(int file, int cluster, const void *buffer, int count) { 
-    // Get the FAT/File Information
-    file_t *fp = &(filetable[file]);
-    fat_file_t *f =  &(fat_file_table[file]);
-    fat_t *fat = &(fat_table[fp->device]);  
+ * @return  0 once everything held is logged, -1 if a call is part way
+ *          through its writes or some do not fit in the log
+ */
+static int fat_log_append(fat_t *fat, int partial) {
+    fat_log_t *l = &(fat->log);
+    if (l->busy) { return -1; }
     
-    //printf("Curr Clu: <<%d>>\n", cluster);
-    //int cluster_size = 5;
-    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
-    int clu_offset = fp->offset % cluster_size;    
-    int total_written = 0;
-    int device = open(mount_table[fp->device]->device_name, O_RDWR);
+    size_t bytes = 0;
+    int last = l->n_held;
+    for (int i = 0; i < l->n_held; i++) {
+        if (l->held[i].logged) continue;
+        size_t more = sizeof(fat_log_ent_t) + ((l->held[i].length + 7) & ~7);
+        if (partial && l->head + FAT_LOG_REC_BYTES(bytes + more) > l->size) { last = i; break; }
+        bytes += more;
+    }
+    if (bytes == 0) { return (last == l->n_held) ? 0 : -1; }
+    size_t total = FAT_LOG_REC_BYTES(bytes);
+    if (l->head + total > l->size) { return -1; }
     
-    // Seek to cluster to start at
-    for (int i = 0; i < (fp->offset / cluster_size); i++) {
-        cluster = read_fat_table(device, fat, cluster); 
-    }    
+    unsigned char *rec = calloc(total, sizeof(unsigned char));
+    size_t at = sizeof(fat_log_rec_t);
+    for (int i = 0; i < last; i++) {
+        fat_held_t *h = &(l->held[i]);
+        if (h->logged) continue;
+        fat_log_ent_t ent = {h->offset, h->length, 0};
+        memcpy(rec + at, &ent, sizeof(ent));
+        memcpy(rec + at + sizeof(ent), h->data, h->length);
+        at += sizeof(ent) + ((h->length + 7) & ~7);
+    }
+    fat_log_rec_t hdr = {FAT_LOG_REC_MAGIC, l->epoch, bytes, fat_log_crc(rec + sizeof(fat_log_rec_t), bytes)};
+    memcpy(rec, &hdr, sizeof(hdr));
     
-    while (count > 0) {
-        // Determine amount of data to write
-        int amt_to_write = (clu_offset + count) >= cluster_size ? count - (cluster_size - clu_offset) : count;
-            
-        // Seek to cluster
-        int loc = get_cluster_location(fat, cluster) + clu_offset;
+    /* File data goes down before the record that points at it */
+    fat_flush(fat);
+    pwrite(fat->sync.fd, rec, total, l->start + l->head);
+    free(rec);
+    
+    l->head += total;
+    for (int i = 0; i < last; i++) l->held[i].logged = 1;
+    __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(fat->stats.log_records), 1, __ATOMIC_RELAXED);
+    return (last == l->n_held) ? 0 : -1;
+}
 
-        //printf("Seeking  <<0x%08X>> [%d]\n", loc, cluster);
-        lseek(device, loc, SEEK_SET);
-        int amt_written = write(device, buffer, amt_to_write);    
-        if (amt_written < 0) { break; }
-        total_written += amt_written;
-        count -= amt_written;
+/* Held writes by device offset, then in the order they were made */
+static int compare_held(const void *a, const void *b) {
+    const fat_held_t *x = *(fat_held_t* const*)a, *y = *(fat_held_t* const*)b;
+    if (x->offset != y->offset) return (x->offset < y->offset) ? -1 : 1;
+    return (x < y) ? -1 : (x > y);
+}
 
-        if (loc + amt_written > f->eof_marker) f->eof_marker = loc + amt_written;
-        
-        if (count > 0) { 
-            int next_cluster = find_free_cluster(mount_table[fp->device]->device_name, fat, cluster+1);
-            write_fat_table(device, fat, cluster, next_cluster);
-            cluster = next_cluster;
-            clu_offset = 0;
+static int compare_held_order(const void *a, const void *b) {
+    const fat_held_t *x = *(fat_held_t* const*)a, *y = *(fat_held_t* const*)b;
+    return (x < y) ? -1 : (x > y);
+}
 
-        } else {
-            write_fat_table(device, fat, cluster, 0x0FFFFFFF);
+/*
+ * Write the first n held writes home.  Writes that touch or overlap are
+ * merged into one run, laid out in the order they were made so later ones
+ * win, and each run goes down with a single write.
+ */
+static void fat_log_apply(fat_t *fat, int fd, int n) {
+    fat_log_t *l = &(fat->log);
+    fat_held_t **order = malloc(n * sizeof(fat_held_t*));
+    for (int i = 0; i < n; i++) order[i] = &(l->held[i]);
+    qsort(order, n, sizeof(fat_held_t*), compare_held);
+    
+    for (int i = 0; i < n; ) {
+        off_t start = order[i]->offset, end = start + order[i]->length;
+        int j;
+        for (j = i + 1; j < n && order[j]->offset <= end; j++) {
+            if (order[j]->offset + (off_t)order[j]->length > end) end = order[j]->offset + order[j]->length;
         }
+        
+        qsort(order + i, j - i, sizeof(fat_held_t*), compare_held_order);
+        unsigned char *run = malloc(end - start);
+        for (int k = i; k < j; k++) memcpy(run + (order[k]->offset - start), order[k]->data, order[k]->length);
+        pwrite(fd, run, end - start, start);
+        free(run);
+        i = j;
     }
-    close(device);
+    free(order);
+}
+
+/* Drop the first n held writes, keeping the rest in order */
+static void fat_log_drop(fat_t *fat, int n) {
+    fat_log_t *l = &(fat->log);
+    for (int i = 0; i < n; i++) free(l->held[i].data);
+    l->n_held -= n;
+    memmove(l->held, l->held + n, l->n_held * sizeof(fat_held_t));
     
-    return total_written;
+    l->held_bytes = 0;
+    l->lo = 0;
+    l->hi = 0;
+    for (int i = 0; i < l->n_held; i++) {
+        fat_held_t *h = &(l->held[i]);
+        if (i == 0 || h->offset < l->lo) l->lo = h->offset;
+        if (i == 0 || h->offset + (off_t)h->length > l->hi) l->hi = h->offset + h->length;
+        l->held_bytes += h->length;
+    }
 }
 
-/*********** Exported Functions ***************/
+/*
+ * Start a new epoch with an empty log: the records written so far go
+ * stale once the new header is down
+ */
+static void fat_log_restart(fat_t *fat, int fd) {
+    fat_log_t *l = &(fat->log);
+    unsigned char buff[2 * FAT_LOG_ALIGN];
+    memset(buff, 0, sizeof(buff));
+    fat_log_header_t hdr = {FAT_LOG_MAGIC, ++(l->epoch)};
+    memcpy(buff, &hdr, sizeof(hdr));
+    pwrite(fd, buff, sizeof(buff), l->start);
+    fdatasync(fd);
+    __atomic_add_fetch(&(fat->stats.syncs), 1, __ATOMIC_RELAXED);
+    l->head = FAT_LOG_ALIGN;
+}
+
+/*
+ * Check the records of a log image, holding their writes on fat when it
+ * is given
+ *
+ * @return  Number of records whose checksum holds, up to the first that
+ *          does not
+ */
+static int fat_log_scan(fat_t *fat, const unsigned char *log, unsigned int size) {
+    const fat_log_header_t *hdr = (const fat_log_header_t*)log;
+    if (size < 2 * FAT_LOG_ALIGN || hdr->magic != FAT_LOG_MAGIC) { return 0; }
+    
+    int n = 0;
+    for (unsigned int at = FAT_LOG_ALIGN; at + sizeof(fat_log_rec_t) <= size; n++) {
+        const fat_log_rec_t *rec = (const fat_log_rec_t*)(log + at);
+        const unsigned char *body = log + at + sizeof(fat_log_rec_t);
+        if (rec->magic != FAT_LOG_REC_MAGIC || rec->epoch != hdr->epoch || rec->bytes > size - at - sizeof(fat_log_rec_t)) break;
+        if (fat_log_crc(body, rec->bytes) != rec->crc) break;
+        
+        for (unsigned int e = 0; fat != NULL && e + sizeof(fat_log_ent_t) <= rec->bytes; ) {
+            fat_log_ent_t ent;
+            memcpy(&ent, body + e, sizeof(ent));
+            fat_held_t *h = fat_log_hold(fat, ent.offset, ent.length);
+            memcpy(h->data, body + e + sizeof(ent), ent.length);
+            h->logged = 1;
+            e += sizeof(ent) + ((ent.length + 7) & ~7);
+        }
+        at += ((sizeof(fat_log_rec_t) + rec->bytes + FAT_LOG_ALIGN - 1) / FAT_LOG_ALIGN) * FAT_LOG_ALIGN;
+    }
+    return n;
+}
+
+/*
+ * Count the committed records of a log, for checkers that want to know
+ * whether the FAT and directories on the device are behind it
+ *
+ * @param   fd          Device, open for reading
+ * @param   start       Device offset of the log
+ * @param   size        Bytes in the log
+ *
+ * @return  Records a mount would replay
+ */
+int fat_log_pending(int fd, off_t start, unsigned int size) {
+    unsigned char *log = malloc(size);
+    int n = (log != NULL && pread(fd, log, size, start) == (ssize_t)size) ? fat_log_scan(NULL, log, size) : 0;
+    free(log);
+    return n;
+}
+
+/*
+ * Find the intent log of a volume and replay what it holds.  Run while
+ * mounting, before the allocation map is read from the FAT, whether or
+ * not the mount asks for a log.
+ *
+ * @param   device      Device, open for reading
+ */
+void fat_log_recover(fat_t *fat, int device, const char *device_name) {
+    fat_log_t *l = &(fat->log);
+    fat_dirhit_t hit;
+    if (!dir_lookup(device, fat, dirmap_get(device, fat, fat->root_cluster), FAT_LOG_NAME, &hit) || hit.dir) { return; }
+    
+    unsigned int first = (hit.ent.high_clu << 16) | hit.ent.low_clu;
+    if (first < 2 || hit.ent.size < 2 * FAT_LOG_ALIGN) { return; }
+    l->start = get_cluster_location(fat, first);
+    l->size = hit.ent.size;
+    
+    int fd = open(device_name, O_RDWR);
+    unsigned char *log = malloc(l->size);
+    if (fd >= 0 && log != NULL && pread(fd, log, l->size, l->start) == (ssize_t)l->size) {
+        int n = fat_log_scan(fat, log, l->size);
+        l->epoch = ((fat_log_header_t*)log)->epoch;
+        if (n > 0) {
+            fat_log_apply(fat, fd, fat->log.n_held);
+            fdatasync(fd);
+            fat_log_restart(fat, fd);
+            fprintf(stderr, "[FAT32]: Replayed %d intent log records on %s\n", n, device_name);
+            
+            /* The root may have changed under the map just made of it */
+            dirmap_free_all(fat);
+        }
+        fat_log_drop(fat, fat->log.n_held);
+    }
+    free(log);
+    if (fd >= 0) close(fd);
+}
+
+/*
+ * Make a volume's intent log: a contiguous hidden file in the root,
+ * 1/64th of the volume within FAT_LOG_MIN and FAT_LOG_MAX
+ *
+ * @return  0 on success, -1 if there is no room for it
+ */
+static int fat_log_create(fat_t *fat, const char *device_name) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned long long want = ((unsigned long long)fat->n_clusters * cluster_size) / 64;
+    if (want < FAT_LOG_MIN) want = FAT_LOG_MIN;
+    if (want > FAT_LOG_MAX) want = FAT_LOG_MAX;
+    if (want < FAT_LOG_LEAST(cluster_size)) want = FAT_LOG_LEAST(cluster_size);
+    unsigned int n = (want + cluster_size - 1) / cluster_size;
+    
+    unsigned int first = find_free_run(fat, n, 2);
+    if (first == 0) { return -1; }
+    
+    int device = fat_dev_open(fat, device_name, O_RDWR);
+    fat_batch_t batch = {NULL, 0, 0};
+    for (unsigned int i = 0; i < n; i++) fat_batch_add(fat, &batch, first + i, (i + 1 < n) ? first + i + 1 : fat->codec->eoc);
+    fat_batch_flush(device, fat, &batch);
+    
+    char name[] = FAT_LOG_NAME;
+    fat_direntry_t dirent;
+    init_direntry(&dirent, name, first, n * cluster_size);
+    dirent.attributes = 0x06;       /* Hidden and system */
+    if (dir_add_entry(device, fat, dirmap_get(device, fat, fat->root_cluster), name, &dirent) == -1) {
+        for (unsigned int i = 0; i < n; i++) fat_batch_add(fat, &batch, first + i, 0);
+        fat_batch_flush(device, fat, &batch);
+        close(device);
+        return -1;
+    }
+    close(device);
+    update_fsinfo(device_name, fat);
+    
+    fat->log.start = get_cluster_location(fat, first);
+    fat->log.size = n * cluster_size;
+    return 0;
+}
+
+/*
+ * Start holding a mount's metadata writes, making the log first if the
+ * volume has none.  Needs the descriptor fat_sync_setup opens.
+ */
+void fat_log_setup(fat_t *fat, const char *device_name) {
+    fat_log_t *l = &(fat->log);
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    if (!fat->sync.up || (l->size == 0 && fat_log_create(fat, device_name) != 0)) {
+        fprintf(stderr, "[FAT32]: No room for an intent log on %s, mounting without one\n", device_name);
+        return;
+    }
+    if (l->size < FAT_LOG_LEAST(cluster_size)) {
+        fprintf(stderr, "[FAT32]: Intent log on %s is too small for a cluster, mounting without one\n", device_name);
+        return;
+    }
+    
+    /* A new log starts from the clock, so old records left in its clusters never match */
+    fat_log_header_t hdr;
+    if (pread(fat->sync.fd, &hdr, sizeof(hdr), l->start) != sizeof(hdr) || hdr.magic != FAT_LOG_MAGIC) hdr.epoch = time(NULL);
+    l->epoch = hdr.epoch;
+    fat_log_restart(fat, fat->sync.fd);
+    l->up = 1;
+}
+
+/*
+ * Whether a directory entry is the log of a mount that is using it, which
+ * must not be opened, truncated or deleted from under the log
+ */
+static int fat_log_entry(fat_t *fat, const fat_direntry_t *ent) {
+    unsigned int first = (ent->high_clu << 16) | ent->low_clu;
+    return fat->log.up && first >= 2 && get_cluster_location(fat, first) == fat->log.start;
+}
+
+/*
+ * Checkpoint: log what is held, flush, write it home, flush, and start a
+ * new epoch.  Held writes too big for what is left of the log are logged
+ * a piece at a time in the order they were made, each piece home before
+ * the next is logged, so a crash part way leaves them part done as a
+ * mount without a log would, but nothing goes home without a record.
+ * Only run between calls, from the calling thread.
+ */
+void fat_log_checkpoint(fat_t *fat) {
+    fat_log_t *l = &(fat->log);
+    if (!l->up || (l->n_held == 0 && l->n_freed == 0)) return;
+    
+    pthread_mutex_lock(&(fat->sync.lock));
+    int left;
+    do {
+        left = fat_log_append(fat, 1);
+        int n;
+        for (n = 0; n < l->n_held && l->held[n].logged; n++);
+        if (n == 0 && left != 0) break;     /* Held back until a record can hold it */
+        
+        fat_flush(fat);
+        fat_log_apply(fat, fat->sync.fd, n);
+        __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
+        fat_flush(fat);
+        fat_log_restart(fat, fat->sync.fd);
+        fat_log_drop(fat, n);
+    } while (left != 0);
+    pthread_mutex_unlock(&(fat->sync.lock));
+    if (l->n_held > 0) return;
+    
+    /* Clusters freed since the last checkpoint can be handed out again now the frees are home */
+    for (int i = 0; i < l->n_freed; i++) {
+        unsigned int c = l->freed[i];
+        if (fat->cluster_map[c >> 3] & (1 << (c & 7))) {
+            fat->cluster_map[c >> 3] &= ~(1 << (c & 7));
+            fat->info->num_free_clusters++;
+        }
+    }
+    if (l->n_freed > 0) update_fsinfo(mount_table[fat - fat_table]->device_name, fat);
+    l->n_freed = 0;
+    fat->stats.checkpoints++;
+    
+    if (fat->discard & MOUNT_DISCARD) fat32_trim(fat - fat_table);
+}
+
+void fat_log_free(fat_t *fat) {
+    fat_log_drop(fat, fat->log.n_held);
+    free(fat->log.held);
+    free(fat->log.freed);
+    memset(&(fat->log), 0, sizeof(fat_log_t));
+}
+
+/*
+ * Take size bytes from an arena.  The memory stays valid until the arena
+ * is released to a mark taken before it.
+ */
+void *arena_alloc(fat_arena_t *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    fat_arena_block_t *b = arena->cur;
+    
+    /* Move on to the next kept block with room, or add one */
+    while (b == NULL || b->used + size > b->size) {
+        if (b != NULL && b->next != NULL) {
+            b = b->next;
+            b->used = 0;
+            continue;
+        }
+        size_t bytes = (size > FAT_ARENA_BLOCK) ? size : FAT_ARENA_BLOCK;
+        fat_arena_block_t *nb = malloc(sizeof(fat_arena_block_t) + bytes);
+        if (nb == NULL) { return NULL; }
+        nb->next = NULL;
+        nb->size = bytes;
+        nb->used = 0;
+        if (b == NULL) arena->first = nb;
+        else b->next = nb;
+        b = nb;
+    }
+    arena->cur = b;
+    
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+fat_arena_mark_t arena_mark(fat_arena_t *arena) {
+    fat_arena_mark_t mark;
+    mark.block = arena->cur;
+    mark.used = (arena->cur != NULL) ? arena->cur->used : 0;
+    return mark;
+}
+
+/*
+ * Give back everything taken from an arena since mark.  Blocks of the
+ * usual size are kept for reuse, oversized ones are freed so one large
+ * request does not stay resident.
+ */
+void arena_release(fat_arena_t *arena, fat_arena_mark_t mark) {
+    fat_arena_block_t **link = (mark.block != NULL) ? &(mark.block->next) : &(arena->first);
+    if (mark.block != NULL) mark.block->used = mark.used;
+    
+    while (*link != NULL) {
+        fat_arena_block_t *b = *link;
+        if (b->size > FAT_ARENA_BLOCK) {
+            *link = b->next;
+            free(b);
+        } else {
+            b->used = 0;
+            link = &(b->next);
+        }
+    }
+    arena->cur = (mark.block != NULL) ? mark.block : arena->first;
+}
+
+void arena_free(fat_arena_t *arena) {
+    while (arena->first != NULL) {
+        fat_arena_block_t *b = arena->first;
+        arena->first = b->next;
+        free(b);
+    }
+    arena->cur = NULL;
+}
+
+/*
+ * Write the free cluster count and last allocated cluster back to the
+ * FSInfo sector
+ */
+void update_fsinfo(const char *device_name, fat_t *fat) {
+    if (fat->fs_type != FAT32) return;      /* FAT12/16 have no FSInfo sector */
+    int device = fat_dev_open(fat, device_name, O_WRONLY);
+    int fsinfo_sector = ((fat_extBS_32_t*)fat->bs->extended_section)->fat_info;
+    fat_dev_seek(fat, device, ((off_t)fsinfo_sector * fat->bs->bytes_per_sector) + 488, SEEK_SET);
+    fat_dev_write(fat, device, fat->info, 8);
+    close(device);
+}
+
+/*
+ * Check the in-memory allocation map for a cluster
+ *
+ * @return  1 if the cluster is in use (or out of range), else 0
+ */
+int cluster_in_use(fat_t *fat, unsigned int cluster) {
+    if (cluster < 2 || cluster > (unsigned int)fat->n_clusters + 1) return 1;
+    return (fat->cluster_map[cluster >> 3] >> (cluster & 7)) & 1;
+}
+
+/*
+ * Record a cluster as used or free in the allocation map, keeping the
+ * FSInfo free count in step
+ */
+void mark_cluster(fat_t *fat, unsigned int cluster, int used) {
+    if (fat->cluster_map == NULL || cluster < 2 || cluster > (unsigned int)fat->n_clusters + 1) return;
+    
+    int was_used = (fat->cluster_map[cluster >> 3] >> (cluster & 7)) & 1;
+    if (used && !was_used) {
+        fat->cluster_map[cluster >> 3] |= (1 << (cluster & 7));
+        fat->info->num_free_clusters--;
+        fat->info->last_alloc = cluster;
+    } else if (!used && was_used) {
+        /* Under an intent log the free may not be home yet, so the cluster is not reused before the checkpoint */
+        if (fat->log.up) {
+            if (fat->log.n_freed == fat->log.cap_freed) {
+                fat->log.cap_freed = fat->log.cap_freed ? fat->log.cap_freed * 2 : 256;
+                fat->log.freed = realloc(fat->log.freed, fat->log.cap_freed * sizeof(unsigned int));
+            }
+            fat->log.freed[fat->log.n_freed++] = cluster;
+            return;
+        }
+        fat->cluster_map[cluster >> 3] &= ~(1 << (cluster & 7));
+        fat->info->num_free_clusters++;
+    }
+}
+
+/*
+ * Bytes in one window of the FAT, the unit every FAT read and write uses
+ */
+unsigned int fat_window_bytes(fat_t *fat) {
+    return fat->codec->window * fat->bs->bytes_per_sector;
+}
+
+/*
+ * Write a window of the FAT to every copy of the table.  The last FAT12
+ * window may run past the end of the table, that part is left alone.
+ *
+ * @param   device          Device to write to, opened read/write
+ * @param   fat             FAT Information of the mount
+ * @param   fat_sector      First sector of the window in the first FAT
+ * @param   buffer          Window contents
+ */
+void write_fat_sector(int device, fat_t *fat, unsigned int fat_sector, const void *buffer) {
+    unsigned int n = fat->bs->reserved_sector_count + fat->table_size - fat_sector;
+    if (n > fat->codec->window) n = fat->codec->window;
+    for (int i = 0; i < fat->bs->table_count; i++) {
+        fat_meta_write(fat, device, ((off_t)fat_sector + ((off_t)i * fat->table_size)) * fat->bs->bytes_per_sector, buffer, n * fat->bs->bytes_per_sector);
+        fat->stats.fat_writes++;
+    }
+}
+
+/* 
+ * Retrieves the value stored in the FAT table indicating
+ * whether this cluster is available for use or not
+ *
+ * @param   device          Device to read from (i.e. /dev/sda1 or a file), already opened
+ * @param   fat             FAT Information to use to compute cluster/sector location
+ * @param   cluster         Cluster to index into the FAT Table to retrieve
+ *
+ * @return  Value stored in the FAT Table at cluster cluster.
+ */
+unsigned int read_fat_table(int device, fat_t* fat, int cluster) {
+    TRACE_BEGIN(t);
+    unsigned int  window = fat_window_bytes(fat);
+    unsigned char FAT[window];
+    unsigned int  fat_sector = get_fat_window(fat, cluster);
+    
+    fat_dev_seek(fat, device, (off_t)fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
+    fat_dev_read(fat, device, FAT, window);
+    fat->stats.fat_reads++;
+    unsigned int tbl_val = fat->codec->get(FAT, cluster % fat->window_ents);
+    
+    TRACE_END(t, TRACE_READ_FAT, cluster, window);
+    return tbl_val;
+}
+
+/* 
+ * Writes the value passed in to the FAT table
+ *
+ * @param   device          Device to read/write from (i.e. /dev/sda1 or a file), already opened
+ * @param   fat             FAT Information to use to compute cluster/sector location
+ * @param   cluster         Cluster of FAT to write to
+ * @param   value           Value to write
+ *
+ * @return  Cluster written to
+ */
+unsigned int write_fat_table(int device, fat_t* fat, unsigned int cluster, unsigned int value) {
+    TRACE_BEGIN(t);
+    unsigned int  window = fat_window_bytes(fat);
+    unsigned char FAT[window];
+    unsigned int  fat_sector = get_fat_window(fat, cluster);
+    
+    /* Populate FAT */
+    fat_dev_seek(fat, device, (off_t)fat_sector * fat->bs->bytes_per_sector, SEEK_SET);
+    fat_dev_read(fat, device, FAT, window);
+    fat->stats.fat_reads++;
+    
+    /* The codec keeps any bits of the entry it does not own, as the MS FAT 1.03 Specification asks */
+    fat->codec->set(FAT, cluster % fat->window_ents, value);
+    
+    //printf("[FAT_WRITE]: Using cluster: [%d] in sector [%d]\n", cluster, fat_sector);
+    write_fat_sector(device, fat, fat_sector, FAT);
+    mark_cluster(fat, cluster, value != 0);
+    
+    TRACE_END(t, TRACE_WRITE_FAT, cluster, window * fat->bs->table_count);
+    return cluster;
+}
+
+/*
+ * Reads the long filename of an LFN run
+ *
+ * @param   buff        First entry of the run
+ * @param   offcount    Increased by the number of LFN entries read
+ * @param   name        Buffer to hold the name
+ * @param   size        Bytes in name, longer names are cut short
+ *
+ * @return  name, or NULL if buff is not the start of an LFN run
+ */
+char *process_long_entry(unsigned char *buff, int *offcount, char *name, int size) {
+    fat_long_direntry_t *ent = (fat_long_direntry_t*)buff;
+    
+    
+    int seq = 0;
+    if ((ent->order & 0x40) != 0x40) {
+        printf("[FAT32]: Not Start of Long Filename. Skipping\n");
+        return NULL;
+    }
+    
+    seq = ent->order & 0x1F;
+    int num_char = seq * 13;
+    char str[0x1F * 13 + 1];
+    str[num_char--] = '\0';
+    
+    for (int i = seq; i > 0; i--) {   
+        fat_long_direntry_t *ent = (fat_long_direntry_t*)buff;
+        str[num_char--] = (char)(ent->charset3[1]);
+        str[num_char--] = (char)(ent->charset3[0]);
+        str[num_char--] = (char)(ent->charset2[5]);
+        str[num_char--] = (char)(ent->charset2[4]);
+        str[num_char--] = (char)(ent->charset2[3]);
+        str[num_char--] = (char)(ent->charset2[2]);
+        str[num_char--] = (char)(ent->charset2[1]);
+        str[num_char--] = (char)(ent->charset2[0]);
+        str[num_char--] = (char)(ent->charset1[4]);
+        str[num_char--] = (char)(ent->charset1[3]);
+        str[num_char--] = (char)(ent->charset1[2]);
+        str[num_char--] = (char)(ent->charset1[1]);
+        str[num_char--] = (char)(ent->charset1[0]);
+        
+        if (seq != 1) {
+            buff += 32; /* Increase Buffer by 32 to look at next entry */
+        }
+        ++(*offcount);
+    }
+    strncpy(name, str, size - 1);
+    name[size - 1] = '\0';
+    return name;
+}
+
+/*
+ * Converts a raw 8.3 entry name into a printable NAME.EXT string
+ *
+ * @param   raw         11 byte name field of a directory entry
+ * @param   out         Buffer of at least 13 bytes to hold the result
+ */
+void format_short_name(const unsigned char *raw, char *out) {
+    int len = 0;
+    for (int i = 0; i < 8 && raw[i] != ' '; i++) out[len++] = raw[i];
+    if (raw[8] != ' ') {
+        out[len++] = '.';
+        for (int i = 8; i < 11 && raw[i] != ' '; i++) out[len++] = raw[i];
+    }
+    out[len] = '\0';
+}
+
+/*
+ * Reads the cluster at the given chain index of a directory into the scan buffer
+ *
+ * @param   scan        Scan to load the cluster into
+ * @param   index       Index of the cluster in the directory's chain
+ * @param   at          Cluster of the buffer to load it into, 0 for the first
+ */
+void dirscan_load(fat_dirscan_t *scan, int index, int at) {
+    int cluster_size = scan->fat->bs->bytes_per_sector * scan->fat->bs->sectors_per_cluster;
+    dirmap_read_cluster(scan->device, scan->fat, scan->map, index, scan->buff + (at * cluster_size));
+}
+
+/*
+ * Extract the next entry from the cluster held in the scan buffer
+ *
+ * @param   scan        Directory scan, its slot is advanced past the entry
+ * @param   hit         Filled in with the entry that was found
+ *
+ * @return  1 if an entry was found, 0 at the end of the directory, or
+ *          -1 if the end of the loaded cluster was reached first
+ */
+int extract_dir_entry(fat_dirscan_t *scan, fat_dirhit_t *hit) {
+    int cluster_size = scan->fat->bs->bytes_per_sector * scan->fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
+    int base = scan->loaded * spc;
+    
+    while (scan->slot < base + spc) {
+        unsigned char *b = scan->buff + ((scan->slot - base) * 32);
+        
+        if (b[0] == 0x00) { return 0; }
+        if (b[0] == 0xE5) { scan->slot++; continue; }    /* Skip Deleted Entry */
+        
+        hit->dir = 0;
+        hit->name[0] = '\0';
+        hit->first_slot = scan->slot;
+        
+        if (b[11] == 0x0F) {
+            int seq = b[0] & 0x1F;
+            if ((b[0] & 0x40) != 0x40 || seq == 0) { scan->slot++; continue; }  /* Orphaned LFN */
+            
+            /* The rest of the run and its 8.3 entry may live in the next clusters, pull them in as well */
+            int need = ((scan->slot - base) + seq) / spc + 1;
+            if (need > scan->n_loaded) {
+                if (scan->loaded + need > scan->map->n_chain) { return 0; }
+                for (int i = scan->n_loaded; i < need; i++) dirscan_load(scan, scan->loaded + i, i);
+                scan->n_loaded = need;
+            }
+            
+            int off = 0;
+            process_long_entry(b, &off, hit->name, sizeof(hit->name));
+            
+            scan->slot += off;
+            b += off * 32;
+            if (b[0] == 0x00) { return 0; }
+            if (b[0] == 0xE5 || b[11] == 0x0F) { continue; }
+        }
+        
+        /* Regular Entry */
+        switch (((fat_direntry_t*)b)->attributes) {
+            case 0x02:
+            case 0x08:
+            case 0x40:
+                scan->slot++;
+                continue;
+            case 0x10:
+                hit->dir = 1;
+            default:
+                break;
+        }
+        
+        if (b[0] == 0x2E) {
+            strcpy(hit->name, b[1] == 0x2E ? ".." : ".");
+        } else if (hit->name[0] == '\0') {
+            format_short_name(b, hit->name);
+        }
+        hit->ent = *(fat_direntry_t*)b;
+        hit->slot = scan->slot++;
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * Begin walking the entries of a directory
+ *
+ * @param   scan        Scan state to initialize
+ * @param   device      Device the directory lives on, already opened
+ * @param   fat         FAT Information of the mount
+ * @param   map         Directory map of the directory to walk
+ * @param   slot        Slot to start at, 0 for the start of the directory
+ */
+void dirscan_begin(fat_dirscan_t *scan, int device, fat_t *fat, fat_dirmap_t *map, int slot) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    scan->device = device;
+    scan->fat = fat;
+    scan->map = map;
+    scan->slot = slot;
+    scan->loaded = -1;
+    scan->n_loaded = 0;
+    scan->mark = arena_mark(&(fat->arena));
+    scan->buff = arena_alloc(&(fat->arena), DIRSCAN_CLUSTERS(cluster_size) * cluster_size);
+}
+
+/*
+ * Returns the next entry of a directory scan
+ *
+ * @return  1 if hit was filled in, 0 at the end of the directory
+ */
+int dirscan_next(fat_dirscan_t *scan, fat_dirhit_t *hit) {
+    int cluster_size = scan->fat->bs->bytes_per_sector * scan->fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
+    
+    while (1) {
+        int index = scan->slot / spc;
+        if (index >= scan->map->n_chain || scan->slot >= scan->map->end_slot) { return 0; }
+        
+        if (index != scan->loaded) {
+            int ahead = index - scan->loaded;
+            if (scan->loaded >= 0 && ahead > 0 && ahead < scan->n_loaded) {
+                scan->n_loaded -= ahead;
+                memmove(scan->buff, scan->buff + (ahead * cluster_size), scan->n_loaded * cluster_size);
+            } else {
+                dirscan_load(scan, index, 0);
+                scan->n_loaded = 1;
+            }
+            scan->loaded = index;
+        }
+        
+        TRACE_BEGIN(t);
+        int found = extract_dir_entry(scan, hit);
+        TRACE_END(t, TRACE_DIR_ENTRY, scan->map->chain[scan->loaded], (scan->slot - hit->first_slot) * 32);
+        if (found >= 0) { return found; }
+    }
+}
+
+void dirscan_end(fat_dirscan_t *scan) {
+    arena_release(&(scan->fat->arena), scan->mark);
+    scan->buff = NULL;
+}
+
+/*
+ * Look up a name in a directory
+ *
+ * @param   device      Device the directory lives on, already opened
+ * @param   fat         FAT Information of the mount
+ * @param   map         Directory map of the directory to search
+ * @param   name        Name to look for
+ * @param   hit         Filled in with the entry if it was found
+ *
+ * @return  1 if the name was found, else 0
+ */
+int dir_lookup(int device, fat_t *fat, fat_dirmap_t *map, const char *name, fat_dirhit_t *hit) {
+    fat_dirscan_t scan;
+    int found;
+    
+    dirscan_begin(&scan, device, fat, map, 0);
+    while ((found = dirscan_next(&scan, hit)) == 1 && strcmp(hit->name, name) != 0);
+    dirscan_end(&scan);
+    
+    return found;
+}
+
+/*
+ * Walk every component of a path but the last, starting at the current
+ * directory
+ *
+ * @param   device      Device to read from, already opened
+ * @param   fat         FAT Information of the mount
+ * @param   path        Path to resolve, modified in place
+ * @param   leaf        Set to the last component of path
+ *
+ * @return  First cluster of the directory holding leaf, or 0 if a
+ *          component along the way does not exist
+ */
+unsigned int find_dir_cluster(int device, fat_t *fat, char *path, char **leaf) {
+    unsigned int cluster = current_directory;
+    char *lvl = strtok(path, "/");  
+    *leaf = NULL;
+    
+    while (lvl != NULL) {
+        char *next = strtok(NULL, "/");
+        if (next == NULL) { *leaf = lvl; break; }
+        
+        fat_dirhit_t hit;
+        if (!dir_lookup(device, fat, dirmap_get(device, fat, cluster), lvl, &hit) || !hit.dir) { return 0; }
+        cluster = (hit.ent.high_clu << 16) | hit.ent.low_clu;
+        if (cluster == 0) cluster = fat->root_cluster;
+        lvl = next;
+    }
+    return (*leaf == NULL) ? 0 : cluster;
+}
+
+/*
+ * Read from a file's cluster chain
+ *
+ * @param   dev         Mount to read from
+ * @param   f           File to read, its position hint is used and updated
+ * @param   offset      Byte offset in the file to start at
+ * @param   buffer      Buffer to read into
+ * @param   count       Number of bytes to read
+ *
+ * @return  Number of bytes read
+ */
+int fat32_read(int dev, fat_file_t *f, uint32_t offset, void *buffer, int count) {
+
+    fat_t *fat = &(fat_table[dev]);        
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned char fat_buff[fat_window_bytes(fat)];
+    unsigned int fat_sector = 0;
+    unsigned int cluster = (f->dir_ent.high_clu << 16) | f->dir_ent.low_clu;
+    int index = offset / cluster_size, i = 0;
+    
+    int device = fat_dev_open(fat, mount_table[dev]->device_name, O_RDONLY);
+    
+    /* Walk the chain to the cluster holding offset, from where the last call left off unless that is past it */
+    if (f->pos_cluster >= 2 && f->pos_index <= index) {
+        cluster = f->pos_cluster;
+        i = f->pos_index;
+    }
+    if (cluster >= 2 && cluster < fat->codec->bad && i < index) {
+        if (fat->codec->walk(device, fat, &cluster, index - i, &fat_sector, fat_buff) < (unsigned int)(index - i)) cluster = 0;
+    }
+    
+    /* Read count bytes, a physically contiguous run of clusters at a time */
+    int clu_offset = offset % cluster_size;
+    int total = 0;
+    while (count > 0 && cluster >= 2 && cluster < fat->codec->bad) {
+        int run = cluster_size - clu_offset;
+        unsigned int next, more = (run < count) ? (count - run + cluster_size - 1) / cluster_size : 0;
+        more = fat->codec->run(device, fat, cluster, more, &next, &fat_sector, fat_buff);
+        unsigned int last = cluster + more;
+        run += more * cluster_size;
+        index += more;
+        
+        int amt = (run < count) ? run : count;
+        fat_dev_seek(fat, device, get_cluster_location(fat, cluster) + clu_offset, SEEK_SET);    
+        int nr = fat_dev_read(fat, device, buffer, amt);
+        if (nr > 0) fat->stats.data_read += nr;
+        if (nr < 0) perror("read");
+        if (nr <= 0) break;
+        
+        f->pos_cluster = last;
+        f->pos_index = index;
+        total += nr;
+        if (nr < amt) break;
+        
+        count -= nr;
+        buffer = (char*)buffer + nr;
+        cluster = next;
+        index++;
+        clu_offset = 0;
+    }
+    close(device);
+    return total;
+}
+
+/*
+ * Find the first free cluster at or after the given one, wrapping around
+ * to the start of the data region once
+ *
+ * @param   device          Device to read from, already opened
+ * @param   fat             FAT Information of the mount
+ * @param   cluster         Cluster to start looking at
+ *
+ * @return  A free cluster, or 0 if the volume is full
+ */
+unsigned int next_free_cluster(int device, fat_t *fat, unsigned int cluster) {
+    TRACE_BEGIN(t);
+    unsigned int last = fat->n_clusters + 1, found = 0;
+    if (cluster < 2 || cluster > last) cluster = 2;
+    
+    for (unsigned int n = 0; n < fat->n_clusters; n++) {
+        /* Step over whole bytes of used clusters at once */
+        if ((cluster & 7) == 0 && cluster + 7 <= last && fat->cluster_map[cluster >> 3] == 0xFF) {
+            n += 7;
+            cluster = (cluster + 8 > last) ? 2 : cluster + 8;
+            continue;
+        }
+        if (!cluster_in_use(fat, cluster)) { found = cluster; break; }
+        cluster = (cluster == last) ? 2 : cluster + 1;
+    }
+    TRACE_END(t, TRACE_ALLOC, found, 0);
+    return found;
+}
+
+/*
+ * Find a run of consecutive free clusters, starting the search at hint
+ * and wrapping around once
+ *
+ * @param   fat             FAT Information of the mount
+ * @param   count           Length of the run needed
+ * @param   hint            Cluster to start looking at
+ *
+ * @return  First cluster of the run, or 0 if there is no run that long
+ */
+unsigned int find_free_run(fat_t *fat, unsigned int count, unsigned int hint) {
+    unsigned int last = fat->n_clusters + 1;
+    if (count == 0 || count > (unsigned int)fat->n_clusters) return 0;
+    if (hint < 2 || hint > last) hint = 2;
+    
+    TRACE_BEGIN(t);
+    unsigned int start = hint, len = 0, found = 0;
+    for (unsigned int cluster = hint; ; ) {
+        if (cluster_in_use(fat, cluster)) {
+            len = 0;
+        } else {
+            if (len == 0) start = cluster;
+            if (++len == count) { found = start; break; }
+        }
+        
+        if (cluster == last) {
+            /* Runs do not wrap around the end of the volume */
+            cluster = 2;
+            len = 0;
+        } else {
+            cluster++;
+        }
+        if (cluster == hint) break;
+    }
+    TRACE_END(t, TRACE_ALLOC_RUN, found, count);
+    return found;
+}
+
+int find_free_cluster(char *dev, fat_t *fat, int cluster) {
+    int device = fat_dev_open(fat, dev, O_RDONLY);
+    cluster = next_free_cluster(device, fat, cluster);
+    close(device);
+    return cluster;
+}
+
+/*********** Batched FAT Updates ***************/
+
+/*
+ * Tell the backing store it no longer needs to hold the data of freed
+ * cluster runs.  Image files get the range punched out, block devices
+ * get a BLKDISCARD.  If the backend does not support it discarding is
+ * turned off for the mount.
+ *
+ * @param   device          Device to discard on, opened read/write
+ * @param   fat             FAT Information of the mount
+ * @param   runs            Freed runs, sorted and coalesced
+ * @param   count           Number of runs
+ */
+void fat_discard_runs(int device, fat_t *fat, fat_run_t *runs, int count) {
+#ifdef __linux__
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    struct stat st;
+    if (fstat(device, &st) < 0) { return; }
+    
+    for (int i = 0; i < count && fat->discard; i++) {
+        uint64_t range[2];
+        range[0] = (uint64_t)get_cluster_location(fat, runs[i].start);
+        range[1] = (uint64_t)runs[i].len * cluster_size;
+        
+        int rc = -1;
+        if (S_ISREG(st.st_mode)) {
+            rc = fallocate(device, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+        } else if (S_ISBLK(st.st_mode)) {
+            rc = ioctl(device, BLKDISCARD, range);
+        } else {
+            errno = EOPNOTSUPP;
+        }
+        
+        if (rc < 0 && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL)) {
+            fprintf(stderr, "[FAT32]: Device does not support discard, turning it off\n");
+            fat->discard = 0;
+        }
+    }
+#endif
+}
+
+/*
+ * Add a freed run to the mount's trim queue
+ */
+void queue_trim_run(fat_t *fat, fat_run_t run) {
+    if (fat->n_trim_runs == fat->cap_trim_runs) {
+        fat->cap_trim_runs = (fat->cap_trim_runs == 0) ? 64 : fat->cap_trim_runs * 2;
+        fat->trim_runs = realloc(fat->trim_runs, fat->cap_trim_runs * sizeof(fat_run_t));
+    }
+    fat->trim_runs[fat->n_trim_runs++] = run;
+}
+
+int compare_run(const void *a, const void *b) {
+    const fat_run_t *x = a, *y = b;
+    if (x->start != y->start) return (x->start < y->start) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Queue a FAT entry update.  The allocation map is updated right away so
+ * clusters handed out by the batch are not given out twice.
+ */
+void fat_batch_add(fat_t *fat, fat_batch_t *batch, unsigned int cluster, unsigned int value) {
+    if (batch->n_ents == batch->cap_ents) {
+        batch->cap_ents = (batch->cap_ents == 0) ? 64 : batch->cap_ents * 2;
+        batch->ents = realloc(batch->ents, batch->cap_ents * sizeof(fat_batch_ent_t));
+    }
+    batch->ents[batch->n_ents].cluster = cluster;
+    batch->ents[batch->n_ents].value = value;
+    batch->ents[batch->n_ents].seq = batch->n_ents;
+    batch->n_ents++;
+    mark_cluster(fat, cluster, value != 0);
+}
+
+int compare_batch_ent(const void *a, const void *b) {
+    const fat_batch_ent_t *x = a, *y = b;
+    if (x->cluster != y->cluster) return (x->cluster < y->cluster) ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+/*
+ * Apply every queued update, reading and writing each FAT window once
+ *
+ * @param   device          Device to write to, opened read/write
+ * @param   fat             FAT Information of the mount
+ * @param   batch           Updates to apply, emptied afterwards
+ *
+ * @return  Number of FAT windows written
+ */
+int fat_batch_flush(int device, fat_t *fat, fat_batch_t *batch) {
+    int bps = fat->bs->bytes_per_sector;
+    unsigned int window = fat_window_bytes(fat);
+    unsigned char FAT[window];
+    int sectors = 0;
+    
+    fat_run_t *freed = NULL;
+    int n_freed = 0, cap_freed = 0;
+    
+    qsort(batch->ents, batch->n_ents, sizeof(fat_batch_ent_t), compare_batch_ent);
+    
+    int i = 0;
+    while (i < batch->n_ents) {
+        unsigned int fat_sector = get_fat_window(fat, batch->ents[i].cluster);
+        fat_dev_seek(fat, device, (off_t)fat_sector * bps, SEEK_SET);
+        fat_dev_read(fat, device, FAT, window);
+        fat->stats.fat_reads++;
+        
+        int j;
+        for (j = i; j < batch->n_ents && get_fat_window(fat, batch->ents[j].cluster) == fat_sector; j++);
+        fat->codec->apply(fat, FAT, batch->ents + i, j - i);
+        
+        for (; i < j; i++) {
+            fat_batch_ent_t *e = &(batch->ents[i]);
+            
+            /* Clusters whose final value is free get discarded, coalesced into runs */
+            int last = (i + 1 == batch->n_ents) || (batch->ents[i + 1].cluster != e->cluster);
+            if (fat->discard && last && e->value == 0) {
+                if (n_freed > 0 && freed[n_freed - 1].start + freed[n_freed - 1].len == e->cluster) {
+                    freed[n_freed - 1].len++;
+                } else {
+                    if (n_freed == cap_freed) {
+                        cap_freed = (cap_freed == 0) ? 16 : cap_freed * 2;
+                        freed = realloc(freed, cap_freed * sizeof(fat_run_t));
+                    }
+                    freed[n_freed].start = e->cluster;
+                    freed[n_freed].len = 1;
+                    n_freed++;
+                }
+            }
+        }
+        
+        write_fat_sector(device, fat, fat_sector, FAT);
+        sectors++;
+    }
+    
+    /* Only discard once the FAT no longer points at the clusters */
+    if (n_freed > 0) {
+        if ((fat->discard & MOUNT_DISCARD_DEFERRED) || fat->log.up) {
+            /* Under an intent log the free is not home yet, the checkpoint trims instead */
+            for (int j = 0; j < n_freed; j++) queue_trim_run(fat, freed[j]);
+        } else {
+            fat_discard_runs(device, fat, freed, n_freed);
+        }
+    }
+    free(freed);
+    
+    free(batch->ents);
+    batch->ents = NULL;
+    batch->n_ents = 0;
+    batch->cap_ents = 0;
+    return sectors;
+}
+
+/*
+ * Allocate a cluster chain, contiguous when a long enough run is free,
+ * and queue its FAT entries
+ *
+ * @param   clusters    If not NULL, filled in with the count clusters in chain order
+ *
+ * @return  First cluster of the chain, or 0 if the volume is full
+ */
+unsigned int fat_batch_chain(int device, fat_t *fat, fat_batch_t *batch, unsigned int count, unsigned int *clusters) {
+    if (count == 0 || count > fat->info->num_free_clusters) return 0;
+    
+    unsigned int first = find_free_run(fat, count, fat->info->last_alloc + 1);
+    if (first != 0) {
+        for (unsigned int i = 0; i < count - 1; i++) fat_batch_add(fat, batch, first + i, first + i + 1);
+        fat_batch_add(fat, batch, first + count - 1, fat->codec->eoc);
+        for (unsigned int i = 0; clusters != NULL && i < count; i++) clusters[i] = first + i;
+        return first;
+    }
+    
+    /* Fragmented volume, take clusters one at a time */
+    unsigned int prev = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int cluster = next_free_cluster(device, fat, (prev == 0) ? fat->info->last_alloc + 1 : prev + 1);
+        fat_batch_add(fat, batch, cluster, fat->codec->eoc);
+        if (prev == 0) first = cluster; else fat_batch_add(fat, batch, prev, cluster);
+        if (clusters != NULL) clusters[i] = cluster;
+        prev = cluster;
+    }
+    return first;
+}
+
+/*
+ * Read a FAT entry through a one window cache, so walking a mostly
+ * contiguous chain costs one read per FAT window rather than per cluster
+ *
+ * @param   sector      First sector of the window held in buff, or 0 if buff is empty
+ * @param   buff        Buffer of fat_window_bytes
+ */
+unsigned int read_fat_cached(int device, fat_t *fat, unsigned int cluster, unsigned int *sector, unsigned char *buff) {
+    fat_window_fetch(device, fat, cluster, sector, buff);
+    return fat->codec->get(buff, cluster % fat->window_ents);
+}
+
+/*
+ * Cut a cluster chain down to its first keep clusters and queue the
+ * rest to be freed.  The chain is walked once.
+ *
+ * @param   device          Device to read from, already opened
+ * @param   fat             FAT Information of the mount
+ * @param   batch           Batch the FAT updates are queued on
+ * @param   first           First cluster of the chain, 0 if there is none
+ * @param   keep            Number of clusters to keep, 0 to free them all
+ *
+ * @return  Number of clusters freed
+ */
+unsigned int fat_truncate_chain(int device, fat_t *fat, fat_batch_t *batch, unsigned int first, unsigned int keep) {
+    unsigned char buff[fat_window_bytes(fat)];
+    unsigned int sector = 0;
+    unsigned int cluster = first;
+    
+    if (keep > 0 && cluster >= 2 && cluster < fat->codec->bad) {
+        if (fat->codec->walk(device, fat, &cluster, keep - 1, &sector, buff) < keep - 1) return 0;
+        unsigned int next = read_fat_cached(device, fat, cluster, &sector, buff);
+        if (next >= fat->codec->bad) return 0;   /* Already that short */
+        fat_batch_add(fat, batch, cluster, fat->codec->eoc);
+        cluster = next;
+    }
+    
+    return fat->codec->free_chain(device, fat, batch, cluster, &sector, buff);
+}
+
+/*********** Directory Maps ***************/
+
+/*
+ * Insert a run of free slots into a directory map, merging it with
+ * any neighbouring runs
+ */
+void dirmap_add_extent(fat_dirmap_t *map, int start, int len) {
+    /* Binary search for the first extent starting after this one */
+    int lo = 0, hi = map->n_extents;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->extents[mid].start < start) lo = mid + 1; else hi = mid;
+    }
+    
+    fat_slot_extent_t *prev = (lo > 0) ? &(map->extents[lo - 1]) : NULL;
+    fat_slot_extent_t *next = (lo < map->n_extents) ? &(map->extents[lo]) : NULL;
+    
+    if (prev != NULL && prev->start + prev->len == start) {
+        prev->len += len;
+        if (next != NULL && prev->start + prev->len == next->start) {
+            prev->len += next->len;
+            memmove(next, next + 1, (map->n_extents - lo - 1) * sizeof(fat_slot_extent_t));
+            map->n_extents--;
+        }
+        return;
+    }
+    if (next != NULL && start + len == next->start) {
+        next->start = start;
+        next->len += len;
+        return;
+    }
+    
+    if (map->n_extents == map->cap_extents) {
+        map->cap_extents = (map->cap_extents == 0) ? 16 : map->cap_extents * 2;
+        map->extents = realloc(map->extents, map->cap_extents * sizeof(fat_slot_extent_t));
+    }
+    memmove(&(map->extents[lo + 1]), &(map->extents[lo]), (map->n_extents - lo) * sizeof(fat_slot_extent_t));
+    map->extents[lo].start = start;
+    map->extents[lo].len = len;
+    map->n_extents++;
+}
+
+void dirmap_push_cluster(fat_dirmap_t *map, unsigned int cluster) {
+    if (map->n_chain == map->cap_chain) {
+        map->cap_chain = (map->cap_chain == 0) ? 8 : map->cap_chain * 2;
+        map->chain = realloc(map->chain, map->cap_chain * sizeof(unsigned int));
+    }
+    map->chain[map->n_chain++] = cluster;
+}
+
+/*
+ * Retrieve the map of a directory, building it with a single pass
+ * over the directory the first time it is asked for
+ *
+ * @param   device          Device the directory lives on, already opened
+ * @param   fat             FAT Information of the mount
+ * @param   first_cluster   First cluster of the directory
+ *
+ * @return  The directory map, owned by the mount
+ */
+fat_dirmap_t *dirmap_get(int device, fat_t *fat, unsigned int first_cluster) {
+    fat_dirmap_t *map;
+    for (map = fat->dirmaps; map != NULL; map = map->next) {
+        if (map->first_cluster == first_cluster) { fat->stats.cache_hits++; return map; }
+    }
+    fat->stats.cache_misses++;
+    
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
+    unsigned char buff[cluster_size];
+    
+    map = calloc(1, sizeof(fat_dirmap_t));
+    map->first_cluster = first_cluster;
+    map->fixed = (first_cluster == FAT_FIXED_ROOT && fat->root_cluster == FAT_FIXED_ROOT);
+    map->end_slot = -1;
+    
+    /* A fixed root has no FAT chain, its chain just counts the clusters its region spans */
+    int n_fixed = ((fat->bs->root_entry_count * 32) + cluster_size - 1) / cluster_size;
+    unsigned int cluster = map->fixed ? 0 : first_cluster;
+    while (!map->fixed || (int)cluster < n_fixed) {
+        dirmap_push_cluster(map, cluster);
+        if (map->end_slot == -1) {
+            dirmap_read_cluster(device, fat, map, map->n_chain - 1, buff);
+            for (int i = 0; i < spc; i++) {
+                int slot = (map->n_chain - 1) * spc + i;
+                if (buff[i * 32] == 0x00) { map->end_slot = slot; break; }
+                if (buff[i * 32] == 0xE5) dirmap_add_extent(map, slot, 1);
+            }
+        }
+        
+        if (map->fixed) { cluster++; continue; }
+        cluster = read_fat_table(device, fat, cluster);
+        if (cluster >= fat->codec->bad || cluster < 2 || map->n_chain > fat->n_clusters) break;
+    }
+    
+    if (map->end_slot == -1) map->end_slot = dirmap_slot_count(fat, map);
+    
+    map->next = fat->dirmaps;
+    fat->dirmaps = map;
+    return map;
+}
+
+/*
+ * Grow a directory by one cluster.  The new cluster is zeroed before it
+ * is linked onto the end of the chain so the dir is never left pointing
+ * at garbage.  When a batch is given the FAT updates are queued on it and
+ * the caller is responsible for writing the whole new cluster.
+ *
+ * @return  The cluster added, or -1 if the volume or the fixed root is full
+ */
+int dir_extend(int device, fat_t *fat, fat_dirmap_t *map, fat_batch_t *batch) {
+    if (map->fixed) { return -1; }      /* The FAT12/16 root cannot grow past its region */
+    
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned int tail = map->chain[map->n_chain - 1];
+    unsigned int cluster = next_free_cluster(device, fat, tail + 1);
+    if (cluster == 0) { return -1; }
+    
+    if (batch != NULL) {
+        fat_batch_add(fat, batch, cluster, fat->codec->eoc);
+        fat_batch_add(fat, batch, tail, cluster);
+    } else {
+        unsigned char *zero = calloc(cluster_size, sizeof(unsigned char));
+        fat_meta_write(fat, device, get_cluster_location(fat, cluster), zero, cluster_size);
+        free(zero);
+        
+        write_fat_table(device, fat, cluster, fat->codec->eoc);
+        write_fat_table(device, fat, tail, cluster);
+    }
+    
+    dirmap_push_cluster(map, cluster);
+    return cluster;
+}
+
+/*
+ * Reserve a run of consecutive slots in a directory.  Free runs left by
+ * deleted entries are reused first, then the space after the end marker,
+ * and finally the directory is extended.  A run never crosses a cluster
+ * boundary unless it is longer than a cluster.
+ *
+ * @param   device          Device the directory lives on, opened read/write
+ * @param   fat             FAT Information of the mount
+ * @param   map             Directory map to allocate from
+ * @param   count           Number of slots needed
+ * @param   batch           If not NULL, only slots skipped to stay inside a cluster
+ *                          are written to the device.  FAT updates are queued on
+ *                          the batch and the caller writes the touched clusters,
+ *                          marking any 0x00 slot below the end marker as deleted.
+ *
+ * @return  First slot of the run, or -1 if the volume is full
+ */
+int dirmap_alloc(int device, fat_t *fat, fat_dirmap_t *map, int count, fat_batch_t *batch) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
+    
+    for (int i = 0; i < map->n_extents; i++) {
+        fat_slot_extent_t *e = &(map->extents[i]);
+        int pos = e->start;
+        if (count <= spc && (pos % spc) + count > spc) pos = ((pos / spc) + 1) * spc;
+        if (pos + count > e->start + e->len) continue;
+        
+        int left = pos - e->start;
+        int right = (e->start + e->len) - (pos + count);
+        if (left > 0 && right > 0) {
+            e->len = left;
+            dirmap_add_extent(map, pos + count, right);
+        } else if (left > 0) {
+            e->len = left;
+        } else if (right > 0) {
+            e->start = pos + count;
+            e->len = right;
+        } else {
+            memmove(e, e + 1, (map->n_extents - i - 1) * sizeof(fat_slot_extent_t));
+            map->n_extents--;
+        }
+        return pos;
+    }
+    
+    /* Nothing reusable, take the space after the end marker */
+    int pos = map->end_slot;
+    if (count <= spc && (pos % spc) + count > spc) pos = ((pos / spc) + 1) * spc;
+    while (pos + count > dirmap_slot_count(fat, map)) {
+        if (dir_extend(device, fat, map, batch) < 0) return -1;
+    }
+    
+    /* Slots skipped to stay inside a cluster must not read as the end marker.
+     * They sit in a cluster a batch may never load, so they are written even then. */
+    if (pos > map->end_slot) {
+        int skipped = pos - map->end_slot;
+        unsigned char filler[skipped * 32];
+        memset(filler, 0, sizeof(filler));
+        for (int i = 0; i < skipped; i++) filler[i * 32] = 0xE5;
+        dir_write_slots(device, fat, map, map->end_slot, filler, skipped);
+        dirmap_add_extent(map, map->end_slot, skipped);
+    }
+    
+    map->end_slot = pos + count;
+    return pos;
+}
+
+/*
+ * Return a run of slots to a directory map once they are marked deleted
+ */
+void dirmap_release(fat_dirmap_t *map, int start, int count) {
+    dirmap_add_extent(map, start, count);
+}
+
+/*
+ * Compute the byte offset from SEEK_SET of the cluster at a chain index
+ * of a directory, which for a fixed root is counted from its region
+ */
+off_t dirmap_cluster_location(fat_t *fat, fat_dirmap_t *map, int index) {
+    if (map->fixed) {
+        return ((off_t)fat->root_sect + ((off_t)index * fat->bs->sectors_per_cluster)) * fat->bs->bytes_per_sector;
+    }
+    return get_cluster_location(fat, map->chain[index]);
+}
+
+/*
+ * Compute the byte offset from SEEK_SET of a directory slot
+ */
+off_t dirmap_slot_location(fat_t *fat, fat_dirmap_t *map, int slot) {
+    int spc = (fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster) / 32;
+    return dirmap_cluster_location(fat, map, slot / spc) + ((slot % spc) * 32);
+}
+
+/*
+ * Compute how many bytes of the cluster at a chain index belong to a
+ * directory.  Only the last cluster of a fixed root can fall short.
+ */
+int dirmap_cluster_bytes(fat_t *fat, fat_dirmap_t *map, int index) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    if (map->fixed) {
+        int left = (fat->bs->root_entry_count * 32) - (index * cluster_size);
+        if (left < cluster_size) return left;
+    }
+    return cluster_size;
+}
+
+/*
+ * Count the slots a directory holds without being extended
+ */
+int dirmap_slot_count(fat_t *fat, fat_dirmap_t *map) {
+    int spc = (fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster) / 32;
+    return map->fixed ? fat->bs->root_entry_count : map->n_chain * spc;
+}
+
+/*
+ * Read the cluster at a chain index of a directory into a cluster sized
+ * buffer.  What lies past the end of a fixed root reads as zeroes, so it
+ * ends the directory like any unused slot.
+ */
+void dirmap_read_cluster(int device, fat_t *fat, fat_dirmap_t *map, int index, unsigned char *buff) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int bytes = dirmap_cluster_bytes(fat, map, index);
+    fat_dev_seek(fat, device, dirmap_cluster_location(fat, map, index), SEEK_SET);
+    fat_dev_read(fat, device, buff, bytes);
+    memset(buff + bytes, 0, cluster_size - bytes);
+}
+
+/*
+ * Write consecutive slots to a directory, splitting the write at cluster
+ * boundaries
+ *
+ * @param   device          Device the directory lives on, opened read/write
+ * @param   fat             FAT Information of the mount
+ * @param   map             Directory map of the directory to write
+ * @param   slot            First slot to write
+ * @param   buffer          Slot data, 32 bytes per slot
+ * @param   count           Number of slots to write
+ */
+void dir_write_slots(int device, fat_t *fat, fat_dirmap_t *map, int slot, const void *buffer, int count) {
+    int spc = (fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster) / 32;
+    const unsigned char *b = buffer;
+    
+    while (count > 0) {
+        int n = spc - (slot % spc);
+        if (n > count) n = count;
+        fat_meta_write(fat, device, dirmap_slot_location(fat, map, slot), b, n * 32);
+        b += n * 32;
+        slot += n;
+        count -= n;
+    }
+}
+
+/*
+ * Number of slots a file needs: its LFN run plus the 8.3 entry
+ */
+int dir_entry_slots(const char *name) {
+    int namelen = strlen(name);
+    return (namelen / 13) + (namelen % 13 != 0 ? 1 : 0) + 1;
+}
+
+/*
+ * Fill in a plain file's 8.3 directory entry
+ *
+ * @param   dirent      Entry to fill in
+ * @param   name        Long name of the file, used to generate the 8.3 name
+ * @param   cluster     First cluster of the file, 0 if it has none
+ * @param   size        Size of the file in bytes
+ */
+void init_direntry(fat_direntry_t *dirent, char *name, unsigned int cluster, unsigned int size) {
+    char bname[12];
+    gen_basis_name(name, bname);
+    for (int i = 0; i < 11; i++) dirent->name[i] = bname[i];
+    
+    dirent->attributes = 0x00;
+    dirent->reserved_nt = 0x00;
+    dirent->time_milli = 0x00;
+    dirent->time = 0x0000;
+    dirent->date = 0x0000;
+    dirent->last_accessed = 0x0000;
+    dirent->high_clu = (cluster & 0xFFFF0000) >> 16;
+    dirent->mod_time = 0x0000;
+    dirent->mod_date = 0x0000;
+    dirent->low_clu = (cluster & 0x0000FFFF);
+    dirent->size = size;
+}
+
+/*
+ * Lay out a file's LFN run followed by its 8.3 entry
+ *
+ * @param   buff        Buffer of dir_entry_slots(name) * 32 bytes
+ *
+ * @return  Number of slots written into buff
+ */
+int build_dir_entries(char *name, fat_direntry_t *dirent, unsigned char *buff) {
+    int num_long = dir_entry_slots(name) - 1;
+    
+    /* Long entries are stored last first, followed by the 8.3 entry */
+    for (int i = 0; i < num_long; i++) {
+        int order = num_long - i;
+        order |= (i == 0) ? 0x40 : 0x00;
+        fat_long_direntry_t ld_entry = build_long_entry(order, name, dirent->name);
+        memcpy(buff + (i * 32), &ld_entry, 32);
+    }
+    memcpy(buff + (num_long * 32), dirent, 32);
+    return num_long + 1;
+}
+
+/*
+ * Add a new file to a directory, writing its LFN run and 8.3 entry
+ * together
+ *
+ * @return  Slot of the 8.3 entry, or -1 if the directory could not grow
+ */
+int dir_add_entry(int device, fat_t *fat, fat_dirmap_t *map, char *name, fat_direntry_t *dirent) {
+    int count = dir_entry_slots(name);
+    
+    int slot = dirmap_alloc(device, fat, map, count, NULL);
+    if (slot == -1) { return -1; }
+    
+    unsigned char buff[count * 32];
+    build_dir_entries(name, dirent, buff);
+    dir_write_slots(device, fat, map, slot, buff, count);
+    
+    return slot + count - 1;
+}
+
+void dirmap_free_all(fat_t *fat) {
+    fat_dirmap_t *map = fat->dirmaps;
+    while (map != NULL) {
+        fat_dirmap_t *next = map->next;
+        free(map->chain);
+        free(map->extents);
+        free(map);
+        map = next;
+    }
+    fat->dirmaps = NULL;
+}
+
+/*
+ * Write a buffer to the device 
+ *
+ * @param dev       Name of the device to write to
+ * @param fat       FAT table to reference
+ * @param cluster   Cluster to start writing at
+ * @param offset    Current offset in the cluster to write at
+ * @param buffer    Data to write
+ * @param count     Amount of data in buffer to write
+ *
+ * @return          The total amount of data written
+ */ 
+int fat32_writedata(int file, int cluster, const void *buffer, int count) { 
+    TRACE_BEGIN(t);
+    
+    // Get the FAT/File Information
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);  
+    
+    //printf("Curr Clu: <<%d>>\n", cluster);
+    //int cluster_size = 5;
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int clu_offset = fp->offset % cluster_size;    
+    int total_written = 0;
+    unsigned char fat_buff[fat_window_bytes(fat)];
+    unsigned int fat_sector = 0;
+    int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDWR);
+    
+    // Seek to cluster to start at, from where the last call left off unless that is past it,
+    // growing the chain if the offset is past its end
+    int index = fp->offset / cluster_size, i = 0;
+    if (f->pos_cluster >= 2 && f->pos_index <= index) {
+        cluster = f->pos_cluster;
+        i = f->pos_index;
+    }
+    unsigned int at = cluster;
+    if (i < index) i += fat->codec->walk(device, fat, &at, index - i, &fat_sector, fat_buff);
+    cluster = at;
+    for (; i < index; i++) {
+        unsigned int next_cluster = next_free_cluster(device, fat, cluster+1);
+        if (next_cluster == 0) { close(device); return 0; }
+        write_fat_table(device, fat, next_cluster, fat->codec->eoc);
+        write_fat_table(device, fat, cluster, next_cluster);
+        fat_sector = 0;
+        cluster = next_cluster;
+    }    
+    
+    while (count > 0) {
+        // Determine amount of data to write, taking in every following cluster of the
+        // chain that is also next on disk so a preallocated run goes out in one write
+        int amt_to_write = cluster_size - clu_offset;
+        unsigned int next_cluster, more = (amt_to_write < count) ? (count - amt_to_write + cluster_size - 1) / cluster_size : 0;
+        more = fat->codec->run(device, fat, cluster, more, &next_cluster, &fat_sector, fat_buff);
+        unsigned int last = cluster + more;
+        amt_to_write += more * cluster_size;
+        index += more;
+        if (amt_to_write > count) amt_to_write = count;
+            
+        // Seek to cluster
+        off_t loc = get_cluster_location(fat, cluster) + clu_offset;
+
+        fat_dev_seek(fat, device, loc, SEEK_SET);
+        int amt_written = fat_dev_write(fat, device, buffer, amt_to_write);    
+        if (amt_written > 0) fat->stats.data_written += amt_written;
+        if (amt_written < 0) { index = -1; break; }
+        total_written += amt_written;
+        buffer = (const char*)buffer + amt_written;
+        count -= amt_written;
+
+        if (loc + amt_written > f->eof_marker) f->eof_marker = loc + amt_written;
+        
+        cluster = last;
+        if (amt_written < amt_to_write) {
+            // A first cluster that took some data still gets its end of chain mark
+            if (amt_written > 0 && next_cluster == 0) write_fat_table(device, fat, cluster, fat->codec->eoc);
+            index = -1;
+            break;
+        }
+        
+        if (count > 0) { 
+            // Follow the existing (or preallocated) chain before growing it
+            if (next_cluster < 2 || next_cluster >= fat->codec->bad) {
+                next_cluster = next_free_cluster(device, fat, cluster+1);
+                if (next_cluster == 0) { break; }
+                write_fat_table(device, fat, next_cluster, fat->codec->eoc);
+                write_fat_table(device, fat, cluster, next_cluster);
+                fat_sector = 0;
+            }
+            cluster = next_cluster;
+            index++;
+            clu_offset = 0;
+
+        } else if (next_cluster == 0) {
+            write_fat_table(device, fat, cluster, fat->codec->eoc);
+        }
+    }
+    
+    // Remember where this left off, unless a failed write left that unclear
+    f->pos_cluster = (index < 0) ? 0 : cluster;
+    f->pos_index = (index < 0) ? 0 : index;
+    close(device);
+    
+    TRACE_END(t, TRACE_WRITE_DATA, cluster, total_written);
+    return total_written;
+}
+
+/*********** Defragmentation ***************/
+
+/*
+ * Gather every file on the volume with the cluster chain it uses.
+ * Directories are walked but left where they are.
+ *
+ * @param   root        First cluster of the root directory
+ * @param   count       Set to the number of files found
+ *
+ * @return  Array of files, to be released with defrag_free_files
+ */
+fat_defrag_file_t *defrag_collect(int device, fat_t *fat, unsigned int root, int *count) {
+    fat_defrag_file_t *files = NULL;
+    int n = 0, cap = 0;
+    unsigned int *dirs = malloc(16 * sizeof(unsigned int));
+    int n_dirs = 0, cap_dirs = 16;
+    unsigned char buff[fat_window_bytes(fat)];
+    unsigned int sector = 0;
+    
+    dirs[n_dirs++] = root;
+    while (n_dirs > 0) {
+        fat_dirmap_t *map = dirmap_get(device, fat, dirs[--n_dirs]);
+        fat_dirscan_t scan;
+        fat_dirhit_t hit;
+        
+        dirscan_begin(&scan, device, fat, map, 0);
+        while (dirscan_next(&scan, &hit) == 1) {
+            if (strcmp(hit.name, ".") == 0 || strcmp(hit.name, "..") == 0) continue;
+            unsigned int first = (hit.ent.high_clu << 16) | hit.ent.low_clu;
+            if (first < 2) continue;
+            
+            if (hit.ent.attributes & 0x10) {
+                if (n_dirs == cap_dirs) {
+                    cap_dirs *= 2;
+                    dirs = realloc(dirs, cap_dirs * sizeof(unsigned int));
+                }
+                dirs[n_dirs++] = first;
+                continue;
+            }
+            
+            if (n == cap) {
+                cap = (cap == 0) ? 64 : cap * 2;
+                files = realloc(files, cap * sizeof(fat_defrag_file_t));
+            }
+            fat_defrag_file_t *f = &(files[n++]);
+            f->dirent = dirmap_slot_location(fat, map, hit.slot);
+            f->chain = NULL;
+            f->n_chain = 0;
+            f->extents = 0;
+            f->target = 0;
+            
+            /* Bounded by the cluster count, so a looping chain cannot run forever */
+            unsigned int chain_cap = 0;
+            for (unsigned int c = first; c >= 2 && c < fat->codec->bad && f->n_chain < (unsigned int)fat->n_clusters; ) {
+                if (f->n_chain == chain_cap) {
+                    chain_cap = (chain_cap == 0) ? 16 : chain_cap * 2;
+                    f->chain = realloc(f->chain, chain_cap * sizeof(unsigned int));
+                }
+                if (f->n_chain == 0 || f->chain[f->n_chain - 1] + 1 != c) f->extents++;
+                f->chain[f->n_chain++] = c;
+                c = read_fat_cached(device, fat, c, &sector, buff);
+            }
+        }
+        dirscan_end(&scan);
+    }
+    
+    free(dirs);
+    *count = n;
+    return files;
+}
+
+void defrag_free_files(fat_defrag_file_t *files, int count) {
+    for (int i = 0; i < count; i++) free(files[i].chain);
+    free(files);
+}
+
+void defrag_measure(fat_defrag_file_t *files, int count, defrag_stats_t *stats) {
+    memset(stats, 0, sizeof(defrag_stats_t));
+    for (int i = 0; i < count; i++) {
+        if (files[i].n_chain == 0) continue;
+        stats->files++;
+        stats->extents += files[i].extents;
+        stats->clusters += files[i].n_chain;
+        if (files[i].extents > 1) stats->fragmented++;
+    }
+}
+
+/* Biggest files first, they need the longest free runs */
+int compare_defrag_file(const void *a, const void *b) {
+    const fat_defrag_file_t *x = a, *y = b;
+    if (x->n_chain != y->n_chain) return (x->n_chain > y->n_chain) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Copy a file's clusters into its planned extent, with one copy per
+ * contiguous run of the old chain, split into DEFRAG_CHUNK pieces
+ */
+void defrag_copy(int device, fat_t *fat, fat_defrag_file_t *f, unsigned char *buff) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    
+    for (unsigned int i = 0; i < f->n_chain; ) {
+        unsigned int len = 1;
+        while (i + len < f->n_chain && f->chain[i + len] == f->chain[i] + len) len++;
+        
+        off_t src = get_cluster_location(fat, f->chain[i]);
+        off_t dst = get_cluster_location(fat, f->target + i);
+        int left = len * cluster_size;
+        while (left > 0) {
+            int amt = left < DEFRAG_CHUNK ? left : DEFRAG_CHUNK;
+            fat_dev_seek(fat, device, src, SEEK_SET);
+            amt = fat_dev_read(fat, device, buff, amt);
+            if (amt <= 0) break;
+            fat_dev_seek(fat, device, dst, SEEK_SET);
+            fat_dev_write(fat, device, buff, amt);
+            src += amt;
+            dst += amt;
+            left -= amt;
+        }
+        i += len;
+    }
+}
+
+/*********** Exported Functions ***************/
 
 /*  This need to load the BootSector, 
  *  Check the Info Sector and Load the FAT Table 
  */
 int fat32_init(int dev) { //const char *device_name) {
     const char *device_name = mount_table[dev]->device_name;
-    int device = open(device_name, O_RDONLY);
+    fat_t fat;
+    memset(&(fat.stats), 0, sizeof(fs_stats_t));
+    memset(&(fat.sync), 0, sizeof(fat_sync_t));
+    memset(&(fat.log), 0, sizeof(fat_log_t));
+    fat.direct = 0;
+    fat.direct_align = 1;
+    fat.pool = NULL;
+    fat.n_pool = 0;
+    fat.pool_size = 0;
+    fat.arena.first = NULL;
+    fat.arena.cur = NULL;
+    fat_log_free(&(fat_table[dev]));
+    fat_sync_free(&(fat_table[dev]));
+    fat_pool_free(&(fat_table[dev]));
+    arena_free(&(fat_table[dev].arena));
+    int device = fat_dev_open(&fat, device_name, O_RDONLY);
     if (device < 0) { perror("fat32"); exit(EXIT_FAILURE); }
 
-    fat_t fat;
     fat_BS_t *bs = calloc(1, sizeof(fat_BS_t));
+    fat.dirmaps = NULL;
+    dirmap_free_all(&(fat_table[dev]));
+    free(fat_table[dev].cluster_map);
+    fat_table[dev].cluster_map = NULL;
+    free(fat_table[dev].trim_runs);
+    fat.trim_runs = NULL;
+    fat.n_trim_runs = 0;
+    fat.cap_trim_runs = 0;
+    fat.discard = mount_table[dev]->flags & (MOUNT_DISCARD | MOUNT_DISCARD_DEFERRED);
     fat.bs = bs;
     
-    int rd = read(device, fat.bs, 90);
+    int rd = fat_dev_read(&fat, device, fat.bs, 90);
     if (rd <= 0) {
         close(device);
         perror("fat32");
         return -1;
     }
     
-    lseek(device, 910, SEEK_CUR);
+    /* Work out the layout, the FAT type follows from the cluster count alone */
+    int root_dir_sectors = ((fat.bs->root_entry_count * 32) + (fat.bs->bytes_per_sector - 1)) / fat.bs->bytes_per_sector;    
+    int tblsize = (fat.bs->table_size_16 != 0) ? fat.bs->table_size_16 : ((fat_extBS_32_t*)fat.bs->extended_section)->table_size_32;    
+    
+    fat.data_sect = fat.bs->reserved_sector_count + (fat.bs->table_count * tblsize) + root_dir_sectors;
+    unsigned int n_sectors = ((fat.bs->total_sectors_16 != 0) ? fat.bs->total_sectors_16 : fat.bs->total_sectors_32) - fat.data_sect;
+    fat.n_clusters = n_sectors / fat.bs->sectors_per_cluster;
+    fat.fs_type = (fat.n_clusters < 4085) ? FAT12 : (fat.n_clusters < 65525) ? FAT16 : FAT32;
+    fat.codec = &(fat_codecs[fat.fs_type]);
+    fat.window_ents = (fat.codec->window * fat.bs->bytes_per_sector * 8) / fat.codec->bits;
+    fat.root_sect = fat.bs->reserved_sector_count + (fat.bs->table_count * tblsize);
+    fat.root_cluster = (fat.fs_type == FAT32) ? ((fat_extBS_32_t*)fat.bs->extended_section)->root_cluster : FAT_FIXED_ROOT;
+    
+    /* Only FAT32 keeps an FSInfo sector, the scan of the FAT below recounts it anyway */
     fat.info = calloc(1, sizeof(fat_fsinfo_t));
-    rd = read(device, fat.info, 8);
-    if (rd <= 0) {
-        close(device);
-        perror("fat32");
-        return -1;
+    if (fat.fs_type == FAT32) {
+        fat_dev_seek(&fat, device, 910, SEEK_CUR);
+        rd = fat_dev_read(&fat, device, fat.info, 8);
+        if (rd <= 0) {
+            close(device);
+            perror("fat32");
+            return -1;
+        }
     }
       
+    if (mount_table[dev]->flags & MOUNT_DIRECT) fat_direct_setup(&fat, device_name);
+    
+    printf("FAT Type: FAT%d\n", fat.codec->bits);
     printf("Free Clusters Count: %d\n", fat.info->num_free_clusters);
     printf("Last Allocd Cluster: 0x%08X\n", fat.info->last_alloc);
     printf("Sectors Per Cluster: %d\n", fat.bs->sectors_per_cluster);
     
-    /* Load the FAT Table after computing its position */
-    int root_dir_sectors = ((fat.bs->root_entry_count * 32) + (fat.bs->bytes_per_sector - 1)) / fat.bs->bytes_per_sector;    
-    int tblsize = (fat.bs->table_size_16 != 0) ? fat.bs->table_size_16 : ((fat_extBS_32_t*)fat.bs->extended_section)->table_size_32;    
-    
-    fat.data_sect = fat.bs->reserved_sector_count + (fat.bs->table_count * tblsize) + root_dir_sectors;
-    int n_sectors = ((fat.bs->total_sectors_16 != 0) ? fat.bs->total_sectors_16 : fat.bs->total_sectors_32) - fat.data_sect;
-    fat.n_clusters = n_sectors / fat.bs->sectors_per_cluster;
-    fat.fs_type = (fat.n_clusters < 65525) ? FAT16 : FAT32;
     int n_free = 0;
     
     printf("Size of FAT: %d\n", fat.n_clusters);
-    lseek(device, fat.bs->reserved_sector_count * fat.bs->bytes_per_sector, SEEK_SET);
-    for (int i = 0; i < fat.n_clusters; i++) {
-        /* Read each cluster and check if it is free or not */
-        int cluster = 0;
-        read(device, &cluster, 4);
-        if ((cluster & 0x0FFFFFFF) < 0x0FFFFFF7) ++n_free; else fat.info->last_alloc = i;
+    
+    /* Build the allocation map, reading the FAT a chunk of whole windows at a time */
+    fat.table_size = tblsize;
+    fat.cluster_map = calloc((fat.n_clusters + 2 + 7) / 8, sizeof(unsigned char));
+    fat_log_recover(&fat, device, device_name);
+    int chunk_windows = 64 / fat.codec->window;
+    int chunk_ents = chunk_windows * fat.window_ents;
+    int chunk_bytes = chunk_windows * fat_window_bytes(&fat);
+    unsigned char *chunk = malloc(chunk_bytes);
+    fat_dev_seek(&fat, device, fat.bs->reserved_sector_count * fat.bs->bytes_per_sector, SEEK_SET);
+    for (int base = 0; base < fat.n_clusters + 2; base += chunk_ents) {
+        int got = fat_dev_read(&fat, device, chunk, chunk_bytes);
+        int rd = (got < 0) ? 0 : (got / fat_window_bytes(&fat)) * fat.window_ents;
+        fat.stats.fat_reads += (got < 0) ? 0 : got / fat.bs->bytes_per_sector;
+        int ents = (base + rd < fat.n_clusters + 2) ? rd : fat.n_clusters + 2 - base;
+        n_free += fat.codec->scan(&fat, chunk, base, ents);
+        if (rd < chunk_ents) {
+            /* Short read, anything past the end of the device reads as free */
+            for (int cluster = base + rd; cluster < fat.n_clusters + 2; cluster++) if (cluster >= 2) ++n_free;
+            break;
+        }
     }
+    free(chunk);
     close(device);
     
     printf("Number of Free Clusters: %d\n", n_free);
     
     fat.info->num_free_clusters = n_free;
     
-    // Load the rood dir as the current directory
-    current_directory = fat.fs_type == FAT16 ? 
-    fat.bs->reserved_sector_count + (fat.bs->table_count * fat.bs->total_sectors_16) : 
-    ((fat_extBS_32_t*)fat.bs->extended_section)->root_cluster;    
+    // Load the rood dir as the current directory
+    current_directory = fat.root_cluster;
+    
+    fat_table[dev] = fat;
+    fat_sync_setup(&(fat_table[dev]), device_name, mount_table[dev]->flags & MOUNT_SYNC_MASK, mount_table[dev]->sync_ms);
+    if (mount_table[dev]->flags & MOUNT_LOG) fat_log_setup(&(fat_table[dev]), device_name);
+    update_fsinfo(device_name, &(fat_table[dev]));
+    
+    return 0;
+}
+
+int fat32_createfile(int pos, file_t *file) {
+    fat_direntry_t fat_dirent;
+    init_direntry(&fat_dirent, file->name, 0, 0);
+    
+    // Place the entries using the free slot map of the directory the path names
+    fat_t *fat = &(fat_table[file->device]);
+    fat_commit(fat, 0);
+    int device = fat_dev_open(fat, mount_table[file->device]->device_name, O_RDWR);   
+    char path[strlen(file->path) + 1];
+    strcpy(path, file->path);
+    char *leaf;
+    unsigned int dir_cluster = find_dir_cluster(device, fat, path, &leaf);
+    if (dir_cluster == 0) { close(device); return -1; }
+    
+    fat_dirmap_t *map = dirmap_get(device, fat, dir_cluster);
+    int slot = dir_add_entry(device, fat, map, file->name, &fat_dirent);
+    close(device);
+    
+    fat_changed(fat);
+    if (slot == -1) { return -1; }   // No more room for files!
+    
+    // The new file is left open, empty, as fat32_openfile would leave it
+    fat_file_t *f = handle_slot(&fat_file_table, pos);
+    if (f == NULL) { return -1; }
+    memset(f, 0, sizeof(fat_file_t));
+    f->dir_ent = fat_dirent;
+    f->offset = dirmap_slot_location(fat, map, slot);
+    file->size = 0;
     
-    update_fsinfo(device_name, fat.info);
+    return pos;
+}
 
-    fat_table[dev] = fat;
+typedef struct batch_place {
+    int     slot;       /* First slot of the entry run */
+    int     len;        /* Slots in the run */
+    int     off;        /* Slot offset of the run in the entry buffer */
+} batch_place_t;
+
+int compare_batch_place(const void *a, const void *b) {
+    return ((const batch_place_t*)a)->slot - ((const batch_place_t*)b)->slot;
+}
+
+/*
+ * Write a directory cluster assembled by a batch, first marking any
+ * 0x00 slot below the end marker as deleted so it does not end the dir
+ */
+void write_batch_cluster(int device, fat_t *fat, fat_dirmap_t *map, int index, unsigned char *buff) {
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
     
-    return 0;
+    for (int i = 0; i < spc && (index * spc) + i < map->end_slot; i++) {
+        if (buff[i * 32] == 0x00) buff[i * 32] = 0xE5;
+    }
+    fat_meta_write(fat, device, dirmap_cluster_location(fat, map, index), buff, dirmap_cluster_bytes(fat, map, index));
 }
 
-int fat32_createfile(int pos, file_t *file) {
-    fat_direntry_t fat_dirent;
+/*
+ * Create many files in one directory at once.  Every entry is laid out
+ * in memory first, then each directory cluster and each FAT sector
+ * touched is written exactly once.
+ *
+ * @param   files       Files to create, all on the same device and in the
+ *                      directory named by the path of the first
+ * @param   sizes       Bytes to preallocate for each file, or NULL for none
+ * @param   count       Number of files
+ *
+ * @return  Number of files created, which is less than count if the
+ *          volume filled up
+ */
+int fat32_createbatch(file_t *files, const unsigned int *sizes, int count) {
+    if (count <= 0) { return 0; }
     
-    char *bname = gen_basis_name(file->name);
-    for (int i = 0; i < 11; i++) {
-        fat_dirent.name[i] = bname[i];
-    }
-    fat_dirent.attributes = 0x00;
-    fat_dirent.time_milli = 0x00;
-    fat_dirent.time = 0x0000;
-    fat_dirent.date = 0x0000;
-    fat_dirent.last_accessed = 0x0000;
-    fat_dirent.high_clu = 0x00;
-    fat_dirent.mod_time = 0x0000;
-    fat_dirent.mod_date = 0x0000;
-    fat_dirent.low_clu = 0x00;
-    fat_dirent.size = 0x00000000;
-    
-    int namelen = strlen(file->name);
-    int size_req = (namelen / 13) + (namelen % 13 != 0 ? 1 : 0);
-    
-    // Look through dir table
-    fat_t *fat = &(fat_table[file->device]);
-    int cluster = current_directory; 
+    fat_t *fat = &(fat_table[files[0].device]);
     int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
-    int device = open(mount_table[file->device]->device_name, O_RDWR    );   
-    int dir_pos = -1;
-    do {
-        lseek(device, get_cluster_location(fat, cluster), SEEK_SET);
-        char buff[cluster_size];
-        read(device, buff, cluster_size);
-        
-        int num_free = 0;
-        int num_free_start = 0;
-        for (int i = 0; i < cluster_size; i += 32) {
-            if (buff[i] == 0x00) {
-                // Free from here on. use it!
-                dir_pos = i;
-                break;
-            } else if (buff[i] == 0xE5) {
-                if (num_free == 0) {num_free_start = i;}
-                ++num_free;
-                if (num_free == size_req) {
-                    dir_pos = num_free_start;
-                    break;
-                }
-            } else {
-                num_free = 0;
-                num_free_start = 0;
-            }
+    int spc = cluster_size / 32;
+    fat_commit(fat, 0);
+    int device = fat_dev_open(fat, mount_table[files[0].device]->device_name, O_RDWR);
+    char path[strlen(files[0].path) + 1];
+    strcpy(path, files[0].path);
+    char *leaf;
+    unsigned int dir_cluster = find_dir_cluster(device, fat, path, &leaf);
+    if (dir_cluster == 0) { close(device); return 0; }
+    
+    fat_dirmap_t *map = dirmap_get(device, fat, dir_cluster);
+    int old_chain = map->n_chain;
+    fat_batch_t batch = {NULL, 0, 0};
+    
+    /* Place every entry and preallocate its clusters */
+    fat_arena_mark_t mark = arena_mark(&(fat->arena));
+    batch_place_t *place = arena_alloc(&(fat->arena), count * sizeof(batch_place_t));
+    int total = 0;
+    for (int i = 0; i < count; i++) total += dir_entry_slots(files[i].name);
+    unsigned char *ents = arena_alloc(&(fat->arena), total * 32);
+    
+    int created, off = 0;
+    for (created = 0; created < count; created++) {
+        file_t *file = &(files[created]);
+        int len = dir_entry_slots(file->name);
+        int slot = dirmap_alloc(device, fat, map, len, &batch);
+        if (slot == -1) { break; }
+        
+        unsigned int first = 0, size = 0;
+        if (sizes != NULL && sizes[created] > 0) {
+            first = fat_batch_chain(device, fat, &batch, ((uint64_t)sizes[created] + cluster_size - 1) / cluster_size, NULL);
+            if (first == 0) { dirmap_release(map, slot, len); break; }
+            size = sizes[created];
         }
         
-        if (dir_pos != -1) break;
-    } while ((cluster = read_fat_table(device, fat, cluster)) < 0x0FFFFFF7);
+        fat_direntry_t dirent;
+        init_direntry(&dirent, file->name, first, size);
+        build_dir_entries(file->name, &dirent, ents + (off * 32));
+        
+        place[created].slot = slot;
+        place[created].len = len;
+        place[created].off = off;
+        off += len;
+    }
+    qsort(place, created, sizeof(batch_place_t), compare_batch_place);
     
-    if (dir_pos == -1) { return -1; }   // No more room for files!
+    /* Assemble and write each directory cluster once, in chain order */
+    unsigned char *buff = arena_alloc(&(fat->arena), cluster_size);
+    unsigned char *fresh = arena_alloc(&(fat->arena), map->n_chain - old_chain + 1);
+    memset(fresh, 0, map->n_chain - old_chain + 1);
+    int loaded = -1;
+    for (int k = 0; k < created; k++) {
+        for (int n, s = 0; s < place[k].len; s += n) {
+            int slot = place[k].slot + s;
+            int index = slot / spc;
+            if (index != loaded) {
+                if (loaded != -1) write_batch_cluster(device, fat, map, loaded, buff);
+                if (index < old_chain) {
+                    dirmap_read_cluster(device, fat, map, index, buff);
+                } else {
+                    memset(buff, 0, cluster_size);
+                    fresh[index - old_chain] = 1;
+                }
+                loaded = index;
+            }
+            n = spc - (slot % spc);
+            if (n > place[k].len - s) n = place[k].len - s;
+            memcpy(buff + ((slot % spc) * 32), ents + ((place[k].off + s) * 32), n * 32);
+        }
+    }
+    if (loaded != -1) write_batch_cluster(device, fat, map, loaded, buff);
     
-    int dir_location = get_cluster_location(fat, cluster) + dir_pos;
-
-    // Generate Long File Names
-    for (int i = size_req - 1; i >= 0; i--) {
-        int order = (i+1);
-        order |= (i == size_req - 1) ? 0x40 : 0x00;
-        fat_long_direntry_t ld_entry = build_long_entry(order, file->name, fat_dirent.name);
-        lseek(device, dir_location, SEEK_SET);
-        write(device, &ld_entry, 32);
+    /* Clusters added to the dir but left without entries still need clearing */
+    for (int index = old_chain; index < map->n_chain; index++) {
+        if (fresh[index - old_chain]) continue;
+        memset(buff, 0, cluster_size);
+        write_batch_cluster(device, fat, map, index, buff);
     }
     
-    write(device, &fat_dirent, 32);    
+    /* Directory clusters are in place, now link them and the file chains in */
+    fat_batch_flush(device, fat, &batch);
     close(device);
+    update_fsinfo(mount_table[files[0].device]->device_name, fat);
     
-    return pos;
+    arena_release(&(fat->arena), mark);
+    fat_changed(fat);
+    return created;
 }
 
 /* 
@@ -617,110 +2819,96 @@ int fat32_createfile(int pos, file_t *file) {
  * @param file      File to open
  */
 int fat32_openfile(int pos, file_t *file, int cd) {
-    fat_t fat = fat_table[file->device];
-    fat_direntry_t fat_dirent;
+    fat_t *fat = &(fat_table[file->device]);
     
     int len = strlen(file->path);
-    char *path = calloc(len+1, sizeof(char));
-    strncpy(path, file->path, len);
-    
-    dir_t dir;
-    dir.offset = 0;
-    dir.device = file->device;
-    dir.path = calloc(len+1, sizeof(char));
-    dir.path[0] = '/';
+    fat_arena_mark_t mark = arena_mark(&(fat->arena));
+    char *path = arena_alloc(&(fat->arena), len + 1);
+    strcpy(path, file->path);
     
     /* Navigate to directory */
     char *lvl = strtok(path, "/");
     
+    // Entries held back for a commit must be on the device before they are looked up
+    fat_commit(fat, 0);
     int current_cluster = current_directory;
-    
-    int device = open(mount_table[dir.device]->device_name, O_RDONLY);
-    int cluster_size = fat.bs->bytes_per_sector * fat.bs->sectors_per_cluster;
-    int cluster = (dir.offset * 4) / cluster_size;     // 4 for # of bytes in 32-bits, cluster to stop at
+    int device = fat_dev_open(fat, mount_table[file->device]->device_name, O_RDONLY);
    
-   /* Traverse FAT Table */
-    for (int i = 0; i < cluster; i++) {
-        current_cluster = read_fat_table(device, &fat, current_cluster);
-    }
-
-    int fat_offset = get_cluster_location(&fat, current_cluster);    
-    while (1) {
+    while (lvl != NULL) {
         /* Look for file */                
-        lseek(device, fat_offset, SEEK_SET);
-        unsigned char buff[cluster_size];
-        read(device, buff, cluster_size);
-        
-        dir_entry_t dirent;
-        fat_direntry_t *dirent_p; 
+        fat_dirmap_t *map = dirmap_get(device, fat, current_cluster);
+        fat_dirhit_t hit;
         
-        while ((dirent = extract_dir_entry(&dir, cluster_size, buff)).name != NULL &&
-                strcmp(dirent.name, lvl) != 0);
-
-        if (dirent.name == NULL) {
+        if (!dir_lookup(device, fat, map, lvl, &hit)) {
             pos = -1;
             break;
         }
         
-        dirent_p = (fat_direntry_t*)dirent.misc;
-        if (dirent_p == NULL) {printf("ERROR\n"); break;};
-        fat_dirent = *dirent_p;
+        fat_direntry_t *dirent_p = &(hit.ent);
         
         /* If its a directory, reload info and recurse into it */
-        if (fat_dirent.attributes == 0x10) {
-            fat_offset =  get_cluster_location(&fat, (fat_dirent.high_clu << 16) | fat_dirent.low_clu);   
-            dir.offset = 0;
+        if (dirent_p->attributes == 0x10) {
+            current_cluster = (dirent_p->high_clu << 16) | dirent_p->low_clu;
+            if (current_cluster == 0) {
+                // Reload Root Directory
+                current_cluster = fat->root_cluster;
+            }
             /* If this is a change directory command and we found the right dir,
              * then updated the current_directory and break out of the loop */
             if (cd == 1 && strcmp(file->name, lvl) == 0) {
-                current_directory = (fat_dirent.high_clu << 16) | fat_dirent.low_clu;
-                if (current_directory == 0) {
-                    // Reload Root Directory
-                    current_directory = fat.fs_type == FAT16 ? 
-                        fat.bs->reserved_sector_count + (fat.bs->table_count * fat.bs->total_sectors_16) : 
-                        ((fat_extBS_32_t*)fat.bs->extended_section)->root_cluster;   
-                }
+                current_directory = current_cluster;
                 break;
             }
             lvl = strtok(NULL, "/");
-            if (lvl == NULL) break;
         } else {
-            fat_file_table[pos].dir_ent = *dirent_p;
-            fat_file_table[pos].offset = dir.offset * 32 + fat_offset - 32;
-            fat_file_table[pos].beg_marker = get_cluster_location(&fat, (dirent_p->high_clu << 16) | dirent_p->low_clu);
-            //printf("0x%08X\n", fat_file_table[pos].beg_marker);
-            fat_file_table[pos].eof_marker = fat_file_table[pos].beg_marker + dirent_p->size;
-            //printf("0x%08X\n", fat_file_table[pos].eof_marker);
+            if (pos < 0) break;
+            if (fat_log_entry(fat, dirent_p)) { pos = -1; break; }
+            fat_file_t *f = handle_slot(&fat_file_table, pos);
+            if (f == NULL) { pos = -1; break; }
+            f->dir_ent = *dirent_p;
+            f->offset = dirmap_slot_location(fat, map, hit.slot);
+            f->beg_marker = get_cluster_location(fat, (dirent_p->high_clu << 16) | dirent_p->low_clu);
+            f->eof_marker = f->beg_marker + dirent_p->size;
+            f->pos_cluster = 0;
+            f->pos_index = 0;
+            memset(&(f->reserved), 0, sizeof(fat_batch_t));
             file->size = dirent_p->size;
             break;
         }
     }
     
+    arena_release(&(fat->arena), mark);
     close(device);
     return pos;
 }
 
-// Offset is # of 32-bit entries from the start of the cluster
+// Offset is # of 32 byte slots from the start of the directory
 dir_entry_t fat32_readdir(dir_t *dir) {
     /* Get the FAT Information from the table of open mounted FATs */
-    fat_t fat = fat_table[dir->device];
+    fat_t *fat = &(fat_table[dir->device]);
     /* Open Device */
-    int device = open(mount_table[dir->device]->device_name, O_RDWR);
-    int rootdir = current_directory;  
-        
-    int cluster_size = fat.bs->bytes_per_sector * fat.bs->sectors_per_cluster;
-    int cluster = (dir->offset * 4) / cluster_size;     // 4 for # of bytes in 32-bits
-    /* Traverse FAT Table */
-    for (int i = 0; i < cluster; i++) {
-        rootdir = read_fat_table(device, &fat, rootdir);
-    }
+    int device = fat_dev_open(fat, mount_table[dir->device]->device_name, O_RDONLY);
+    fat_dirmap_t *map = dirmap_get(device, fat, current_directory);
     
-    int fat_offset = get_cluster_location(&fat, rootdir);
-    lseek(device, fat_offset, SEEK_SET);
-    unsigned char buff[cluster_size];
-    read(device, buff, cluster_size);
+    dir_entry_t de;
+    fat_dirscan_t scan;
+    fat_dirhit_t hit;
     
-    dir_entry_t de = extract_dir_entry(dir, cluster_size, buff); 
+    dirscan_begin(&scan, device, fat, map, dir->offset);
+    int found;
+    while ((found = dirscan_next(&scan, &hit)) && (hit.ent.attributes & 0x06));     /* Hidden and system entries, like the log */
+    if (found) {
+        strcpy(dir->name, hit.name);
+        de.name = dir->name;
+        de.time = 0;
+        de.offset = hit.slot;
+        de.dir = hit.dir;
+        de.misc = NULL;
+    } else {
+        de.name = NULL;
+    }
+    dir->offset = scan.slot;
+    dirscan_end(&scan);
    
     close(device);   
     
@@ -731,139 +2919,725 @@ dir_entry_t fat32_readdir(dir_t *dir) {
  * Update the directory table with a new file 
  */
 void fat32_writedir(file_t *file, int startclu) {
-    dir_t dir;
-    dir.device = file->device;
-    dir.offset = 0;
     /* Get the FAT Information from the table of open mounted FATs */
-    fat_t fat = fat_table[dir.device];
+    fat_t *fat = &(fat_table[file->device]);
     /* Open Device */
-    int device = open(mount_table[dir.device]->device_name, O_RDWR);
-    int rootdir = current_directory; 
-        
-    int cluster_size = fat.bs->bytes_per_sector * fat.bs->sectors_per_cluster;
-    int cluster = (dir.offset * 4) / cluster_size;
-    /* Traverse FAT Table */
-    for (int i = 0; i < cluster; i++) {
-        rootdir = read_fat_table(device, &fat, rootdir);
-    }
+    int device = fat_dev_open(fat, mount_table[file->device]->device_name, O_RDWR);
     
     fat_direntry_t dirent;
-    char *filename = gen_basis_name(file->name);
-    for (int i = 0; i < 11; i++) dirent.name[i] = filename[i];
-    
-    dirent.attributes = 0x0;
-    dirent.reserved_nt = 0;
-    dirent.time_milli = 0;
-    dirent.time = 0;
-    dirent.date = 0;
-    dirent.last_accessed = 0;
-    dirent.high_clu = (startclu & 0xFFFF0000) >> 16;
-    dirent.mod_time = 0;
-    dirent.mod_date = 0;
-    dirent.low_clu = (startclu & 0x0000FFFF);
-    dirent.size = file->size;
-
-    int num_long = strlen(file->name) / 13;
-    num_long += strlen(file->name) % 13 == 0 ? 0 : 1;
-
-    int fat_offset = get_cluster_location(&fat, rootdir);
-    lseek(device, fat_offset, SEEK_SET);
-    unsigned char buff[cluster_size];
-    read(device, buff, cluster_size);
-    
-    /* Loop through dir until end is found */
-    for (int i = (dir.offset * 32); i < cluster_size / 4; i += 32) {
-        unsigned char *b = buff + i;
-        if (b[0] == 0x00) { 
-            lseek(device, fat_offset + i, SEEK_SET);
-            /* Write Long Filenames, then the directory entry */
-            for (int i = num_long; i > 0; i--) {
-                fat_long_direntry_t de = build_long_entry(i == num_long ? i | 0x40 : i, file->name, dirent.name);
-                write(device, &de, sizeof(de));
-            }
-            write(device, &dirent, sizeof(dirent));
-            break; 
-        }
-    }    
+    init_direntry(&dirent, file->name, startclu, file->size);
+
+    fat_dirmap_t *map = dirmap_get(device, fat, current_directory);
+    dir_add_entry(device, fat, map, file->name, &dirent);
    
     close(device);   
 }
 
 
 int fat32_readfile(int file, void *buffer, int count) {
-    file_t *fp = &(filetable[file]);
-    fat_file_t *f = &(fat_file_table[file]);
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
     fat_direntry_t *fat_dirent = &(f->dir_ent);
     
-    int cluster = (fat_dirent->high_clu << 16) | fat_dirent->low_clu;
-    
-    if (fat_dirent->size == 0) { return 0; }
-    int num_to_read = (fp->offset + count > fat_dirent->size) ? fat_dirent->size - fp->offset : count;
+    if (fat_dirent->size == 0 || fp->offset >= fat_dirent->size || count <= 0) { return 0; }
+    int num_to_read = ((uint32_t)count > fat_dirent->size - fp->offset) ? fat_dirent->size - fp->offset : count;
 
-    int nr = fat32_read(fp->device, cluster, fp->offset, buffer, num_to_read);
+    int nr = fat32_read(fp->device, f, fp->offset, buffer, num_to_read);
 
     fp->offset += nr;
 
     return nr;
 }
 
+/*
+ * Delete a file: mark its LFN run and 8.3 entry deleted and release its
+ * cluster chain, writing each FAT sector touched once
+ *
+ * @return  0 on success, -1 if the file does not exist
+ */
 int fat32_deletefile(file_t *file) {
     // Load file
-    fat_t fat = fat_table[file->device];
-    int pos = find_dir_cluster(&fat, file);
+    fat_t *fat = &(fat_table[file->device]);
+    fat_commit(fat, 0);
+    int device = fat_dev_open(fat, mount_table[file->device]->device_name, O_RDWR);    
     
-    int device = open(mount_table[file->device]->device_name, O_RDWR);    
-    int stop = 0;
-    int i = 0;
-    do {
-        pos -= 32;
-        lseek(device, pos, SEEK_SET);
-        char buff[32];
-        read(device, buff, 32);
-        if (buff[11] == 0x0F && (buff[0] & 0x40) == 0x40) stop = 1;
-        lseek(device, pos, SEEK_SET);
-        char del = 0xE5;
-        write(device, &del, 1);
-        lseek(device, pos, SEEK_SET);
-        ++i;
-    } while (!stop);
+    char path[strlen(file->name) + 1];
+    strcpy(path, file->name);
+    char *leaf;
+    unsigned int dir_cluster = find_dir_cluster(device, fat, path, &leaf);
+    
+    fat_dirmap_t *map = NULL;
+    fat_dirhit_t hit;
+    if (dir_cluster == 0 || !dir_lookup(device, fat, (map = dirmap_get(device, fat, dir_cluster)), leaf, &hit) || hit.dir) {
+        printf("%s: File Not found\n", file->name);
+        close(device);
+        return -1;
+    }
+    if (fat_log_entry(fat, &(hit.ent))) { close(device); return -1; }
     
+    /* Mark the whole run deleted with one write */
+    int count = hit.slot - hit.first_slot + 1;
+    unsigned char buff[count * 32];
+    memset(buff, 0, sizeof(buff));
+    for (int i = 0; i < count; i++) buff[i * 32] = 0xE5;
+    dir_write_slots(device, fat, map, hit.first_slot, buff, count);
+    dirmap_release(map, hit.first_slot, count);
+    
+    /* Then give back the clusters, once the entry is gone for good */
+    fat_barrier(fat);
+    fat_batch_t batch = {NULL, 0, 0};
+    fat_truncate_chain(device, fat, &batch, (hit.ent.high_clu << 16) | hit.ent.low_clu, 0);
+    fat_batch_flush(device, fat, &batch);
     close(device);
     
-    return -1;
+    update_fsinfo(mount_table[file->device]->device_name, fat);
+    fat_changed(fat);
+    return 0;
+}
+
+/*
+ * Make a directory: one zeroed cluster holding its "." and ".." entries,
+ * added to its parent once the cluster is in place
+ *
+ * @return  0 on success, -1 if the parent does not exist, the name is
+ *          taken or the volume is full
+ */
+int fat32_mkdir(file_t *dir) {
+    fat_t *fat = &(fat_table[dir->device]);
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned int root = fat->root_cluster;
+    fat_commit(fat, 0);
+    int device = fat_dev_open(fat, mount_table[dir->device]->device_name, O_RDWR);
+    
+    char path[strlen(dir->path) + 1];
+    strcpy(path, dir->path);
+    char *leaf;
+    unsigned int parent = find_dir_cluster(device, fat, path, &leaf);
+    
+    fat_dirmap_t *map = NULL;
+    fat_dirhit_t hit;
+    if (parent == 0 || dir_lookup(device, fat, (map = dirmap_get(device, fat, parent)), leaf, &hit)) {
+        close(device);
+        return -1;
+    }
+    
+    unsigned int cluster = next_free_cluster(device, fat, 2);
+    if (cluster == 0) { close(device); return -1; }
+    
+    /* "." names the directory itself, ".." its parent with 0 for the root */
+    fat_arena_mark_t mark = arena_mark(&(fat->arena));
+    unsigned char *buff = arena_alloc(&(fat->arena), cluster_size);
+    memset(buff, 0, cluster_size);
+    fat_direntry_t dot;
+    init_direntry(&dot, leaf, cluster, 0);
+    memset(dot.name, ' ', 11);
+    dot.name[0] = '.';
+    dot.attributes = 0x10;
+    memcpy(buff, &dot, 32);
+    
+    dot.name[1] = '.';
+    dot.high_clu = ((parent == root ? 0 : parent) >> 16);
+    dot.low_clu = ((parent == root ? 0 : parent) & 0xFFFF);
+    memcpy(buff + 32, &dot, 32);
+    
+    fat_meta_write(fat, device, get_cluster_location(fat, cluster), buff, cluster_size);
+    arena_release(&(fat->arena), mark);
+    write_fat_table(device, fat, cluster, fat->codec->eoc);
+    fat_barrier(fat);
+    
+    fat_direntry_t dirent;
+    init_direntry(&dirent, leaf, cluster, 0);
+    dirent.attributes = 0x10;
+    int slot = dir_add_entry(device, fat, map, leaf, &dirent);
+    if (slot == -1) write_fat_table(device, fat, cluster, 0x0);
+    close(device);
+    
+    update_fsinfo(mount_table[dir->device]->device_name, fat);
+    fat_changed(fat);
+    return (slot == -1) ? -1 : 0;
+}
+
+/*
+ * Map a file's data to runs of the device, one per stretch of the chain
+ * that is contiguous on disk, covering no more than the file size
+ */
+int fat32_filemap(int file, fs_extent_t **extents) {
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned char fat_buff[fat_window_bytes(fat)];
+    unsigned int fat_sector = 0;
+    
+    unsigned int cluster = (f->dir_ent.high_clu << 16) | f->dir_ent.low_clu;
+    unsigned int left = f->dir_ent.size;
+    int n = 0, cap = 0;
+    *extents = NULL;
+    
+    int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDONLY);
+    while (left > 0 && cluster >= 2 && cluster < fat->codec->bad) {
+        unsigned int next, more = (left - 1) / cluster_size;
+        more = fat->codec->run(device, fat, cluster, more, &next, &fat_sector, fat_buff);
+        uint64_t len = (uint64_t)(more + 1) * cluster_size;
+        if (len > left) len = left;
+        
+        if (n == cap) {
+            cap = cap ? cap * 2 : 8;
+            *extents = realloc(*extents, cap * sizeof(fs_extent_t));
+        }
+        (*extents)[n].offset = get_cluster_location(fat, cluster);
+        (*extents)[n].length = len;
+        n++;
+        
+        left -= len;
+        cluster = next;
+    }
+    close(device);
+    return n;
+}
+
+/*
+ * Reserve clusters for an empty open file and map them.  Only the
+ * allocation map knows of them until the file is truncated or closed,
+ * when fat_reserve_publish writes them home behind their data.
+ *
+ * @return  Number of extents, or -1 if the file is not empty or the
+ *          volume is full
+ */
+int fat32_reserve(int file, unsigned int size, fs_extent_t **extents) {
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    *extents = NULL;
+    
+    if (f->dir_ent.high_clu != 0 || f->dir_ent.low_clu != 0 || f->dir_ent.size != 0) { return -1; }
+    if (size == 0) { return 0; }
+    
+    unsigned int count = ((uint64_t)size + cluster_size - 1) / cluster_size;
+    unsigned int *chain = malloc(count * sizeof(unsigned int));
+    if (chain == NULL) { return -1; }
+    int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDONLY);
+    unsigned int first = fat_batch_chain(device, fat, &(f->reserved), count, chain);
+    close(device);
+    if (first == 0) { free(chain); return -1; }
+    
+    /* One extent per stretch of the chain that is contiguous on disk */
+    int n = 0, cap = 0;
+    unsigned int left = size;
+    for (unsigned int i = 0; i < count; ) {
+        unsigned int run = 1;
+        while (i + run < count && chain[i + run] == chain[i] + run) run++;
+        uint64_t len = (uint64_t)run * cluster_size;
+        if (len > left) len = left;
+        
+        if (n == cap) {
+            cap = cap ? cap * 2 : 8;
+            *extents = realloc(*extents, cap * sizeof(fs_extent_t));
+        }
+        (*extents)[n].offset = get_cluster_location(fat, chain[i]);
+        (*extents)[n].length = len;
+        n++;
+        
+        left -= len;
+        i += run;
+    }
+    free(chain);
+    
+    f->dir_ent.high_clu = (first >> 16);
+    f->dir_ent.low_clu = (first & 0xFFFF);
+    f->dir_ent.size = size;
+    f->beg_marker = get_cluster_location(fat, first);
+    f->eof_marker = f->beg_marker + size;
+    f->pos_cluster = 0;
+    f->pos_index = 0;
+    fp->size = size;
+    return n;
+}
+
+/*
+ * Write into an extent of an open file.  The only call that may run on
+ * many threads at once, so it keeps off the pool and the file's state and
+ * counts atomically.  An aligned write goes through O_DIRECT when the
+ * mount uses it, anything else through the page cache, since a bounce
+ * would rewrite blocks shared with clusters another thread may be writing.
+ *
+ * @return  Bytes written, or -1 if the write does not fit the extent
+ */
+int fat32_writeextent(int file, const fs_extent_t *extent, unsigned int offset, const void *buffer, int count) {
+    TRACE_BEGIN(t);
+    file_t *fp = handle_slot(&filetable, file);
+    fat_t *fat = &(fat_table[fp->device]);
+    if (count < 0 || offset > extent->length || (unsigned int)count > extent->length - offset) { return -1; }
+    
+    off_t at = extent->offset + offset;
+    size_t a = fat->direct_align;
+    int direct = fat->direct && ((uintptr_t)buffer % a) == 0 && (count % a) == 0 && (at % a) == 0;
+    const char *device_name = mount_table[fp->device]->device_name;
+    int device = direct ? fat_dev_open(fat, device_name, O_WRONLY) : open(device_name, O_WRONLY);
+    if (device < 0) { return -1; }
+    ssize_t wr = pwrite(device, buffer, count, at);
+    close(device);
+    
+    __atomic_add_fetch(&(fat->stats.dev_writes), 1, __ATOMIC_RELAXED);
+    if (wr > 0) {
+        __atomic_add_fetch(&(fat->stats.bytes_written), wr, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(fat->stats.data_written), wr, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&(fat->sync.data_dirty), 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
+    
+    TRACE_END(t, TRACE_WRITE_DATA, (at / fat->bs->bytes_per_sector - fat->data_sect) / fat->bs->sectors_per_cluster + 2, wr);
+    return wr;
 }
 
 int fat32_write(int file, const void *buffer, int count) {
     // Get the FAT/File Information
-    file_t *fp = &(filetable[file]);
-    fat_file_t *f =  &(fat_file_table[file]);
-    fat_t fat = fat_table[fp->device];    
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);    
+
+    // A file can grow no further than its 32 bit size can count
+    if (count > 0 && (uint32_t)count > 0xFFFFFFFF - fp->offset) {
+        count = 0xFFFFFFFF - fp->offset;
+        if (count == 0) { return 0; }
+    }
 
     int cluster = (f->dir_ent.high_clu << 16) | f->dir_ent.low_clu;
     if (cluster == 0) {
+        // An empty file gets no cluster until there is data to put in one
+        if (count <= 0) { return 0; }
         // Find a cluster to start in, because the current cluster in the dir entry is 0
-        cluster = find_free_cluster(mount_table[fp->device]->device_name, &fat, cluster);
+        cluster = find_free_cluster(mount_table[fp->device]->device_name, fat, cluster);
+        if (cluster == 0) { return 0; }     // Volume is full
         // reset beg/eof markers
-        f->beg_marker = get_cluster_location(&fat, cluster);
+        f->beg_marker = get_cluster_location(fat, cluster);
         f->eof_marker = f->beg_marker;
     }
+    unsigned int n_free = fat->info->num_free_clusters;
     int wrote = fat32_writedata(file, cluster, buffer, count);
     fp->offset += wrote;
+    if (fat->info->num_free_clusters != n_free) update_fsinfo(mount_table[fp->device]->device_name, fat);
+    
+    // Update Directory Entry, once the first cluster holds data and so is in the FAT
+    if (wrote > 0) {
+        f->dir_ent.high_clu = (cluster >> 16);
+        f->dir_ent.low_clu = (cluster & 0xFFFF);
+    }
     
-    // Update Directory Entry
-    f->dir_ent.high_clu = (cluster >> 16);
-    f->dir_ent.low_clu = (cluster & 0xFFFF);
+    // Writing inside the file leaves its size alone, only writing past the end grows it
+    if (fp->offset > f->dir_ent.size) f->dir_ent.size = fp->offset;
+    f->eof_marker = f->beg_marker + f->dir_ent.size;
+    fp->size = f->dir_ent.size;
     
-    int device = open(mount_table[fp->device]->device_name, O_RDWR);
-    f->dir_ent.size = f->eof_marker - f->beg_marker;
-
-    lseek(device, f->offset, SEEK_SET);
-    write(device, &(f->dir_ent), 32);
+    // The entry goes last, and is held back for the next commit on a mount with a sync policy
+    int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDWR);
+    fat_put_dirent(fat, device, f->offset, &(f->dir_ent));
     close(device);
     
+    fat_changed(fat);
     return wrote;
 }
 
-int fat32_teardown() {
+/*
+ * Write home the clusters fat32_reserve set aside for an open file, now
+ * its data is written: the data is flushed first, then the FAT links go
+ * out, and the entry last, held back for the next commit like any other.
+ * Files published together after their data share the one flush.
+ */
+static void fat_reserve_publish(int device, fat_t *fat, file_t *fp, fat_file_t *f) {
+    if ((fat->sync.policy || fat->log.up) && __atomic_load_n(&(fat->sync.data_dirty), __ATOMIC_ACQUIRE)) fat_flush(fat);
+    fat_batch_flush(device, fat, &(f->reserved));
+    update_fsinfo(mount_table[fp->device]->device_name, fat);
+    fat_put_dirent(fat, device, f->offset, &(f->dir_ent));
+}
+
+/*
+ * Shrink an open file, releasing the clusters past the new end with one
+ * write per FAT sector touched
+ *
+ * @param   file        File to truncate
+ * @param   length      New length in bytes, no larger than the current size
+ *
+ * @return  0 on success, -1 if length is larger than the file
+ */
+int fat32_truncate(int file, unsigned int length) {
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);
+    
+    if (length > f->dir_ent.size || fat_log_entry(fat, &(f->dir_ent))) { return -1; }
+    
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    unsigned int cluster = (f->dir_ent.high_clu << 16) | f->dir_ent.low_clu;
+    unsigned int keep = ((uint64_t)length + cluster_size - 1) / cluster_size;
+    int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDWR);
+    
+    /* A reservation goes home claiming only the data that made it, the rest is freed below */
+    if (f->reserved.n_ents > 0) {
+        f->dir_ent.size = length;
+        fat_reserve_publish(device, fat, fp, f);
+    }
+    fat_commit(fat, 0);
+    fat_batch_t batch = {NULL, 0, 0};
+    fat_truncate_chain(device, fat, &batch, cluster, keep);
+    
+    // An empty file owns no clusters
+    if (keep == 0) {
+        f->dir_ent.high_clu = 0;
+        f->dir_ent.low_clu = 0;
+    }
+    f->dir_ent.size = length;
+    f->eof_marker = f->beg_marker + length;
+    f->pos_cluster = 0;
+    f->pos_index = 0;
+    fp->size = length;
+    if (fp->offset > length) fp->offset = length;
+    
+    // Shrinking runs the other way round, the entry stops claiming the clusters before they are freed
+    fat_meta_write(fat, device, f->offset, &(f->dir_ent), 32);
+    fat_barrier(fat);
+    fat_batch_flush(device, fat, &batch);
+    close(device);
+    
+    update_fsinfo(mount_table[fp->device]->device_name, fat);
+    fat_changed(fat);
+    return 0;
+}
+
+/*
+ * Trim pass: discard every run queued since the last pass.  Runs are
+ * merged first, and any cluster that has been allocated again since it
+ * was freed is left alone.
+ *
+ * @param   dev         Mount to trim
+ *
+ * @return  Number of clusters discarded
+ */
+int fat32_trim(int dev) {
+    fat_t *fat = &(fat_table[dev]);
+    if (fat->n_trim_runs == 0) { return 0; }
+    
+    qsort(fat->trim_runs, fat->n_trim_runs, sizeof(fat_run_t), compare_run);
+    
+    /* Rebuild the queue as runs of clusters that are still free */
+    fat_run_t *runs = NULL;
+    int n = 0, cap = 0, discarded = 0;
+    for (int i = 0; i < fat->n_trim_runs; i++) {
+        unsigned int end = fat->trim_runs[i].start + fat->trim_runs[i].len;
+        for (unsigned int c = fat->trim_runs[i].start; c < end; c++) {
+            if (cluster_in_use(fat, c)) continue;
+            if (n > 0 && runs[n - 1].start + runs[n - 1].len == c) {
+                runs[n - 1].len++;
+            } else if (n > 0 && c < runs[n - 1].start + runs[n - 1].len) {
+                continue;   /* Queued twice */
+            } else {
+                if (n == cap) {
+                    cap = (cap == 0) ? 64 : cap * 2;
+                    runs = realloc(runs, cap * sizeof(fat_run_t));
+                }
+                runs[n].start = c;
+                runs[n].len = 1;
+                n++;
+            }
+            discarded++;
+        }
+    }
+    
+    int device = fat_dev_open(fat, mount_table[dev]->device_name, O_RDWR);
+    fat_discard_runs(device, fat, runs, n);
+    close(device);
+    
+    free(runs);
+    fat->n_trim_runs = 0;
+    return discarded;
+}
+
+/*
+ * Rewrite fragmented files into contiguous extents.  Each pass plans
+ * extents from the free cluster map, copies the data, and only then
+ * touches metadata, so a crash at any point leaves every file intact:
+ *
+ *  1. data is copied into clusters the FAT still marks free
+ *  2. the new chains are written, unreferenced (lost, not corrupt)
+ *  3. directory entries are pointed at the new chains
+ *  4. the old chains are freed
+ *
+ * Space released by one pass is used by the next.
+ *
+ * @param   dev         Mount to defragment, with no files open
+ * @param   before      Filled in with the fragmentation found
+ * @param   after       Filled in with the fragmentation left
+ *
+ * @return  -1 if a file is open on the mount, else the number of files moved
+ */
+int fat32_defrag(int dev, defrag_stats_t *before, defrag_stats_t *after) {
+    fat_t *fat = &(fat_table[dev]);
+    
+    /* Open files hold the clusters and entry locations defrag moves */
+    for (int i = 0; i < filetable.n_slots; i++) {
+        if (handle_in_use(&filetable, i) && ((file_t*)handle_slot(&filetable, i))->device == dev) { return -1; }
+    }
+    fat_commit(fat, 0);
+    
+    /* Defrag orders its own writes with flushes, so it starts from a checkpoint and bypasses the log */
+    fat_log_checkpoint(fat);
+    int logged = fat->log.up;
+    fat->log.up = 0;
+    int device = fat_dev_open(fat, mount_table[dev]->device_name, O_RDWR);
+    
+    int count;
+    fat_defrag_file_t *files = defrag_collect(device, fat, fat->root_cluster, &count);
+    defrag_measure(files, count, before);
+    qsort(files, count, sizeof(fat_defrag_file_t), compare_defrag_file);
+    
+    unsigned char *buff = malloc(DEFRAG_CHUNK);
+    int moved = 0;
+    
+    for (int pass = 0; pass < DEFRAG_PASSES; pass++) {
+        fat_batch_t chains = {NULL, 0, 0};
+        unsigned int hint = 2;
+        int planned = 0;
+        
+        for (int i = 0; i < count; i++) {
+            fat_defrag_file_t *f = &(files[i]);
+            if (f->extents <= 1) continue;
+            
+            f->target = find_free_run(fat, f->n_chain, hint);
+            if (f->target == 0) continue;
+            
+            /* Queuing the links marks the run in use, later plans go around it */
+            for (unsigned int k = 0; k < f->n_chain; k++) {
+                fat_batch_add(fat, &chains, f->target + k, (k + 1 < f->n_chain) ? f->target + k + 1 : fat->codec->eoc);
+            }
+            defrag_copy(device, fat, f, buff);
+            hint = f->target + f->n_chain;
+            planned++;
+        }
+        if (planned == 0) { free(chains.ents); break; }
+        
+        fsync(device);
+        fat_batch_flush(device, fat, &chains);
+        fsync(device);
+        
+        for (int i = 0; i < count; i++) {
+            fat_defrag_file_t *f = &(files[i]);
+            if (f->target == 0) continue;
+            fat_direntry_t dirent;
+            fat_dev_seek(fat, device, f->dirent, SEEK_SET);
+            fat_dev_read(fat, device, &dirent, sizeof(dirent));
+            dirent.high_clu = (f->target >> 16);
+            dirent.low_clu = (f->target & 0xFFFF);
+            fat_dev_seek(fat, device, f->dirent, SEEK_SET);
+            fat_dev_write(fat, device, &dirent, sizeof(dirent));
+        }
+        fsync(device);
+        
+        fat_batch_t old = {NULL, 0, 0};
+        for (int i = 0; i < count; i++) {
+            fat_defrag_file_t *f = &(files[i]);
+            if (f->target == 0) continue;
+            for (unsigned int k = 0; k < f->n_chain; k++) {
+                fat_batch_add(fat, &old, f->chain[k], 0x0);
+                f->chain[k] = f->target + k;
+            }
+            f->extents = 1;
+            f->target = 0;
+            moved++;
+        }
+        fat_batch_flush(device, fat, &old);
+        fsync(device);
+    }
+    close(device);
+    
+    update_fsinfo(mount_table[dev]->device_name, fat);
+    defrag_measure(files, count, after);
+    after->moved = moved;
+    
+    free(buff);
+    defrag_free_files(files, count);
+    fat->log.up = logged;
+    fat_changed(fat);
+    return moved;
+}
+
+/*
+ * Pack a directory's live entries together, dropping deleted slots and
+ * orphaned LFN runs, then give back the clusters no longer needed.
+ * Entries only move towards the front, and open files and directory
+ * listings are pointed at the new slots.
+ *
+ * @param   dir         Directory to compact, its name is the path from
+ *                      the current directory ("/" for the current one)
+ *
+ * @return  Number of slots reclaimed, or -1 if the directory was not found
+ */
+int fat32_compactdir(file_t *dir) {
+    fat_t *fat = &(fat_table[dir->device]);
+    int cluster_size = fat->bs->bytes_per_sector * fat->bs->sectors_per_cluster;
+    int spc = cluster_size / 32;
+    fat_commit(fat, 0);
+    int device = fat_dev_open(fat, mount_table[dir->device]->device_name, O_RDWR);
+    
+    /* Find the directory, one component at a time from the current directory */
+    char path[strlen(dir->name) + 1];
+    strcpy(path, dir->name);
+    unsigned int cluster = current_directory;
+    for (char *lvl = strtok(path, "/"); lvl != NULL; lvl = strtok(NULL, "/")) {
+        fat_dirhit_t hit;
+        if (!dir_lookup(device, fat, dirmap_get(device, fat, cluster), lvl, &hit) || !hit.dir) {
+            printf("%s: Directory Not found\n", dir->name);
+            close(device);
+            return -1;
+        }
+        cluster = (hit.ent.high_clu << 16) | hit.ent.low_clu;
+        if (cluster == 0) cluster = fat->root_cluster;
+    }
+    
+    fat_dirmap_t *map = dirmap_get(device, fat, cluster);
+    int n_slots = map->end_slot;
+    fat_arena_mark_t mark = arena_mark(&(fat->arena));
+    unsigned char *old = arena_alloc(&(fat->arena), map->n_chain * cluster_size);
+    unsigned char *packed = arena_alloc(&(fat->arena), map->n_chain * cluster_size);
+    int *moved_to = arena_alloc(&(fat->arena), (n_slots + 1) * sizeof(int));
+    memset(packed, 0, map->n_chain * cluster_size);
+    
+    for (int i = 0; i < map->n_chain; i++) dirmap_read_cluster(device, fat, map, i, old + (i * cluster_size));
+    
+    /* Copy every live group in order, an LFN run only with the 8.3 entry it belongs to */
+    int out = 0;
+    for (int slot = 0; slot < n_slots; ) {
+        unsigned char *b = old + (slot * 32);
+        int run = 1;
+        if (b[0] == 0xE5) { moved_to[slot++] = -1; continue; }
+        if (b[11] == 0x0F) {
+            int seq = b[0] & 0x1F;
+            int whole = (b[0] & 0x40) == 0x40 && seq > 0 && slot + seq < n_slots;
+            for (int k = 1; whole && k < seq; k++) {
+                whole = b[(k * 32) + 11] == 0x0F && b[k * 32] != 0xE5;
+            }
+            if (whole) whole = b[(seq * 32) + 11] != 0x0F && b[seq * 32] != 0xE5 && b[seq * 32] != 0x00;
+            if (!whole) { moved_to[slot++] = -1; continue; }
+            run = seq + 1;
+        }
+        memcpy(packed + (out * 32), b, run * 32);
+        for (int k = 0; k < run; k++) moved_to[slot + k] = out + k;
+        slot += run;
+        out += run;
+    }
+    
+    int keep = (out + spc - 1) / spc;
+    if (keep == 0) keep = 1;
+    if (map->fixed) keep = map->n_chain;    /* The FAT12/16 root keeps its whole region */
+    
+    if (out < n_slots || keep < map->n_chain) {
+        for (int i = 0; i < keep; i++) {
+            fat_meta_write(fat, device, dirmap_cluster_location(fat, map, i), packed + (i * cluster_size), dirmap_cluster_bytes(fat, map, i));
+        }
+        
+        /* Open files keep the location of their 8.3 entry, move them along */
+        for (int i = 0; i < filetable.n_slots; i++) {
+            file_t *fp = handle_slot(&filetable, i);
+            if (!handle_in_use(&filetable, i) || fp->device != dir->device) continue;
+            fat_file_t *f = handle_slot(&fat_file_table, i);
+            off_t off = f->offset;
+            for (int c = 0; c < map->n_chain; c++) {
+                off_t loc = dirmap_cluster_location(fat, map, c);
+                if (off < loc || off >= loc + cluster_size) continue;
+                int from = (c * spc) + ((off - loc) / 32);
+                if (from < n_slots && moved_to[from] >= 0) {
+                    f->offset = dirmap_slot_location(fat, map, moved_to[from]);
+                }
+                break;
+            }
+        }
+        
+        /* Listings of the current directory resume at the next live entry */
+        for (int i = 0; i < dirtable.n_slots && cluster == (unsigned int)current_directory; i++) {
+            dir_t *d = handle_slot(&dirtable, i);
+            if (!handle_in_use(&dirtable, i) || d->device != dir->device) continue;
+            int from = d->offset;
+            while (from < n_slots && moved_to[from] < 0) from++;
+            d->offset = (from < n_slots) ? moved_to[from] : out;
+        }
+        
+        if (keep < map->n_chain) {
+            fat_batch_t batch = {NULL, 0, 0};
+            fat_truncate_chain(device, fat, &batch, map->chain[0], keep);
+            fat_batch_flush(device, fat, &batch);
+            update_fsinfo(mount_table[dir->device]->device_name, fat);
+        }
+        
+        /* Everything is packed, so the only free slots are past the end */
+        map->n_chain = keep;
+        map->n_extents = 0;
+        map->end_slot = out;
+    }
+    
+    arena_release(&(fat->arena), mark);
+    close(device);
+    fat_changed(fat);
+    return n_slots - out;
+}
+
+/*
+ * Close an open file, writing home any clusters reserved for it and
+ * committing the mount when its policy is on-close
+ */
+int fat32_closefile(int file) {
+    file_t *fp = handle_slot(&filetable, file);
+    fat_file_t *f = handle_slot(&fat_file_table, file);
+    fat_t *fat = &(fat_table[fp->device]);
+    
+    if (f->reserved.n_ents > 0) {
+        int device = fat_dev_open(fat, mount_table[fp->device]->device_name, O_RDWR);
+        fat_reserve_publish(device, fat, fp, f);
+        close(device);
+        fat_changed(fat);
+    }
+    if (fat->sync.policy & MOUNT_SYNC_CLOSE) fat_commit(fat, 1);
+    return 0;
+}
+
+/*
+ * Make everything written to a mount durable, whatever its policy
+ *
+ * @param   dev         Mount to commit
+ *
+ * @return  -1 if the device cannot be flushed, else 0
+ */
+int fat32_sync(int dev) {
+    fat_t *fat = &(fat_table[dev]);
+    if (!fat->sync.up) { return -1; }
+    
+    __atomic_store_n(&(fat->sync.dirty), 1, __ATOMIC_RELEASE);
+    fat_commit(fat, 1);
+    return 0;
+}
+
+/*
+ * Counters and operation latencies of a mount, updated in place
+ */
+fs_stats_t *fat32_stats(int dev) {
+    return &(fat_table[dev].stats);
+}
+
+int fat32_teardown(int dev) {
+    fat_t *fat = &(fat_table[dev]);
+    
+    fat_log_checkpoint(fat);
+    fat_log_free(fat);
+    fat32_trim(dev);
+    fat_sync_free(fat);
+    dirmap_free_all(fat);
+    free(fat->trim_runs);
+    free(fat->cluster_map);
+    fat->trim_runs = NULL;
+    fat->n_trim_runs = 0;
+    fat->cap_trim_runs = 0;
+    fat->cluster_map = NULL;
+    fat_pool_free(fat);
+    fat->direct = 0;
+    arena_free(&(fat->arena));
     return 0;
 }
@@ -11,7 +11,9 @@
 #ifndef FAT32_XINU_HEADER
 #define FAT32_XINU_HEADER
 
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "fs_types.h"
 
 typedef struct fat_extBS_32 {
@@ -101,20 +103,302 @@ typedef struct DskSiztoSecPerClus {
     uint8_t             SecPerClusVal;
 } DskSiztoSecPerClus_t;
 
+struct fat_s;
+struct fat_batch;
+struct fat_batch_ent;
+
+/*
+ * How FAT entries of one width are packed.  A mount picks its codec once,
+ * so chain walks call straight into loops built for that width, with the
+ * entry decode inlined, instead of testing the FAT type at every entry.
+ * get and set are for single entries outside those loops.
+ */
+typedef struct fat_codec {
+    int                 type;           /* FAT12, FAT16 or FAT32 */
+    unsigned int        bits;           /* Bits in each entry */
+    unsigned int        window;         /* Sectors handled together, so no entry straddles two windows */
+    unsigned int        bad;            /* Bad cluster marker, it and every value above end a chain */
+    unsigned int        eoc;            /* End of chain marker written */
+    unsigned int        (*get)(const unsigned char *window, unsigned int index);
+    void                (*set)(unsigned char *window, unsigned int index, unsigned int value);
+    
+    /* Follow up to steps links from *cluster, stopping at the chain's last cluster, and return the links taken */
+    unsigned int        (*walk)(int device, struct fat_s *fat, unsigned int *cluster, unsigned int steps,
+                                unsigned int *sector, unsigned char *buff);
+    /* Count up to max clusters following last in its chain that also follow it on disk, *next
+     * set to the link out of the last one counted */
+    unsigned int        (*run)(int device, struct fat_s *fat, unsigned int last, unsigned int max,
+                               unsigned int *next, unsigned int *sector, unsigned char *buff);
+    /* Queue every cluster of a chain from cluster on to be freed, returning how many */
+    unsigned int        (*free_chain)(int device, struct fat_s *fat, struct fat_batch *batch, unsigned int cluster,
+                                      unsigned int *sector, unsigned char *buff);
+    /* Set n batched entries that all fall in the window held in buff */
+    void                (*apply)(struct fat_s *fat, unsigned char *window, const struct fat_batch_ent *ents, int n);
+    /* Mark the used clusters of n entries read from the FAT starting at entry base, returning how many are free */
+    unsigned int        (*scan)(struct fat_s *fat, const unsigned char *chunk, unsigned int base, unsigned int n);
+} fat_codec_t;
+
+/* A run of free (0xE5) directory slots */
+typedef struct fat_slot_extent {
+    int                 start;          /* First free slot, counted from the start of the dir */
+    int                 len;            /* Number of consecutive free slots */
+} fat_slot_extent_t;
+
+/*
+ * Cached layout of a directory: its cluster chain and where its free
+ * slots are, so new entries can be placed without rescanning the dir
+ */
+typedef struct fat_dirmap {
+    unsigned int        first_cluster;
+    int                 fixed;          /* Set for the FAT12/16 root, whose chain indexes its fixed region
+                                           and whose last cluster may be partial */
+    unsigned int        *chain;         /* Clusters of the directory, in chain order */
+    int                 n_chain;
+    int                 cap_chain;
+    fat_slot_extent_t   *extents;       /* Free runs below end_slot, sorted by start */
+    int                 n_extents;
+    int                 cap_extents;
+    int                 end_slot;       /* First 0x00 slot, every slot after it is free */
+    struct fat_dirmap   *next;
+} fat_dirmap_t;
+
+/* A run of consecutive clusters */
+typedef struct fat_run {
+    unsigned int        start;
+    unsigned int        len;
+} fat_run_t;
+
+/* Bytes in each block of a scratch arena, larger requests get a block of their own */
+#define FAT_ARENA_BLOCK     (64 * 1024)
+
+/* A block of scratch memory handed out by bumping used */
+typedef struct fat_arena_block {
+    struct fat_arena_block *next;
+    size_t              size;
+    size_t              used;
+    unsigned char       data[];
+} fat_arena_block_t;
+
+/*
+ * Scratch memory for the call in progress.  Blocks are kept once made, so
+ * a mount stops touching the heap for transient buffers after its first
+ * few calls.
+ */
+typedef struct fat_arena {
+    fat_arena_block_t   *first;
+    fat_arena_block_t   *cur;           /* Block allocations come from */
+} fat_arena_t;
+
+/* Point to roll an arena back to */
+typedef struct fat_arena_mark {
+    fat_arena_block_t   *block;
+    size_t              used;
+} fat_arena_mark_t;
+
+/* An 8.3 entry write held back until the data and FAT it points at are durable */
+typedef struct fat_pending {
+    off_t               offset;         /* Device offset of the 8.3 entry */
+    fat_direntry_t      ent;
+} fat_pending_t;
+
+/*
+ * Commit state of a mount.  Every device write marks it dirty, and a
+ * commit covers all of them with one fdatasync however many calls made
+ * them.  The flusher of a MOUNT_SYNC_PERIODIC mount runs on its own
+ * thread, so pending and the flusher fields are only touched with lock
+ * held.
+ */
+typedef struct fat_sync {
+    int                 up;             /* Set once fd, lock and cond exist */
+    int                 policy;         /* MOUNT_SYNC* flags, 0 leaves flushing to the host */
+    int                 fd;             /* Buffered descriptor commits write and flush through */
+    int                 dirty;          /* Set by device writes, cleared by the flush that covers them */
+    int                 data_dirty;     /* Likewise, but only set by extent writes */
+    fat_pending_t       *pending;
+    int                 n_pending;
+    int                 cap_pending;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;           /* Wakes the flusher early to stop */
+    pthread_t           flusher;
+    int                 flusher_up;
+    int                 stop;
+    int                 period_ms;
+} fat_sync_t;
+
+/*
+ * Intent log.  A hidden file in the root holds a header sector, then
+ * records appended since the last checkpoint.  Each record is every
+ * metadata write of one or more whole calls, so replaying the records
+ * whose checksum holds leaves the volume as some call finished it.
+ */
+#define FAT_LOG_NAME        "FATLOG.SYS"
+#define FAT_LOG_MAGIC       0x474C5446      /* "FTLG" */
+#define FAT_LOG_REC_MAGIC   0x4E585446      /* "FTXN" */
+#define FAT_LOG_ALIGN       512             /* Header and records start on sector bounds */
+#define FAT_LOG_MIN         (64 * 1024)     /* Log size made, 1/64th of the volume within these */
+#define FAT_LOG_MAX         (4 * 1024 * 1024)
+#define FAT_LOG_MAX_HELD    512             /* Held writes that force a checkpoint */
+
+/* Log bytes a record of the given bytes of entries takes */
+#define FAT_LOG_REC_BYTES(bytes)    (((sizeof(fat_log_rec_t) + (bytes) + FAT_LOG_ALIGN - 1) / FAT_LOG_ALIGN) * FAT_LOG_ALIGN)
+/* Smallest log that holds a record of one cluster, the largest write held */
+#define FAT_LOG_LEAST(cluster_size) (FAT_LOG_ALIGN + FAT_LOG_REC_BYTES(sizeof(fat_log_ent_t) + (cluster_size)))
+
+typedef struct fat_log_header {
+    uint32_t            magic;
+    uint32_t            epoch;          /* Bumped by each checkpoint, older records are stale */
+} fat_log_header_t;
+
+/* Followed by bytes of fat_log_ent_t, each trailed by its data padded to 8 bytes */
+typedef struct fat_log_rec {
+    uint32_t            magic;
+    uint32_t            epoch;
+    uint32_t            bytes;
+    uint32_t            crc;            /* CRC-32 of the bytes after the record header */
+} fat_log_rec_t;
+
+typedef struct fat_log_ent {
+    uint64_t            offset;         /* Device offset the data belongs at */
+    uint32_t            length;
+    uint32_t            reserved;
+} fat_log_ent_t;
+
+/* A metadata write held in memory until a checkpoint writes it home */
+typedef struct fat_held {
+    off_t               offset;
+    unsigned int        length;
+    int                 logged;         /* Set once a record holds it */
+    unsigned char       *data;
+} fat_held_t;
+
+/*
+ * Intent log state of a mount.  Reads of the device are overlaid with the
+ * held writes, so the engine sees its own changes before they are home.
+ * The flusher may log held writes but only the calling thread adds,
+ * replaces or drops them, always with sync.lock held.
+ */
+typedef struct fat_log {
+    int                 up;             /* Set while metadata writes are held */
+    off_t               start;          /* Device offset of the log, 0 if the volume has none */
+    unsigned int        size;
+    unsigned int        head;           /* Log bytes used this epoch */
+    uint32_t            epoch;
+    int                 busy;           /* A call is part way through its writes */
+    fat_held_t          *held;
+    int                 n_held;
+    int                 cap_held;
+    off_t               lo;             /* Span of the held writes, so most reads skip the overlay */
+    off_t               hi;
+    size_t              held_bytes;
+    unsigned int        *freed;         /* Clusters freed since the last checkpoint, kept */
+    int                 n_freed;        /* from reuse until the free is home */
+    int                 cap_freed;
+} fat_log_t;
+
 typedef struct fat_s {
     fat_BS_t *bs;
     fat_fsinfo_t *info;
     int fs_type;
     int data_sect;   
     int n_clusters;
+    int table_size;                     /* Sectors in each copy of the FAT */
+    const fat_codec_t *codec;           /* Entry format of the FAT */
+    unsigned int window_ents;           /* FAT entries in each codec window */
+    unsigned int root_cluster;          /* First cluster of the root, FAT_FIXED_ROOT on FAT12/16 */
+    int root_sect;                      /* First sector of the FAT12/16 root region */
+    fat_dirmap_t *dirmaps;
+    unsigned char *cluster_map;         /* One bit per cluster, set when in use */
+    int discard;                        /* MOUNT_DISCARD* flags, 0 when off */
+    fat_run_t *trim_runs;               /* Freed runs waiting for a trim pass */
+    int n_trim_runs;
+    int cap_trim_runs;
+    int direct;                         /* Set when the device is opened with O_DIRECT */
+    size_t direct_align;                /* Alignment O_DIRECT needs of offsets, lengths and buffers */
+    unsigned char **pool;               /* Free aligned buffers for transfers that lack it */
+    int n_pool;
+    size_t pool_size;                   /* Bytes in each pooled buffer */
+    fat_arena_t arena;                  /* Scratch memory, rolled back as each call returns */
+    fat_sync_t sync;                    /* Durability policy and held back entry writes */
+    fat_log_t log;                      /* Intent log and the metadata writes it holds */
+    fs_stats_t stats;
 } fat_t;
 
+/* A pending FAT entry update */
+typedef struct fat_batch_ent {
+    unsigned int        cluster;
+    unsigned int        value;
+    int                 seq;            /* Order added, later updates win */
+} fat_batch_ent_t;
+
+/*
+ * FAT updates collected in memory so each FAT sector touched is read
+ * and written exactly once when the batch is flushed
+ */
+typedef struct fat_batch {
+    fat_batch_ent_t     *ents;
+    int                 n_ents;
+    int                 cap_ents;
+} fat_batch_t;
+
+/*
+ * Clusters a directory scan holds at once: the one being read, and as many
+ * after it as the longest LFN run (0x1F entries) can reach into
+ */
+#define DIRSCAN_CLUSTERS(cluster_size)  (1 + ((0x1F * 32) + (cluster_size) - 1) / (cluster_size))
+
+/* State for walking the entries of a directory, one cluster at a time */
+typedef struct fat_dirscan {
+    int                 device;
+    fat_t               *fat;
+    fat_dirmap_t        *map;
+    int                 slot;           /* Next slot to examine */
+    int                 loaded;         /* Chain index held at the start of buff, -1 if none */
+    int                 n_loaded;       /* Clusters held in buff from loaded on, more while an LFN run crosses */
+    unsigned char       *buff;          /* Room for DIRSCAN_CLUSTERS clusters so LFN runs may cross */
+    fat_arena_mark_t    mark;           /* Arena position buff was taken at */
+} fat_dirscan_t;
+
+/* An entry found while scanning a directory */
+typedef struct fat_dirhit {
+    char                name[256];
+    fat_direntry_t      ent;
+    int                 first_slot;     /* First slot of the LFN run (slot if there is none) */
+    int                 slot;           /* Slot of the 8.3 entry */
+    int                 dir;
+} fat_dirhit_t;
+
+/* Bytes copied per read while moving clusters, and passes made over the volume */
+#define DEFRAG_CHUNK    (1024 * 1024)
+#define DEFRAG_PASSES   4
+
+/*
+ * Stands in for the cluster of a FAT12/16 root, which lives in a region
+ * of its own before the data.  Cluster 1 never holds data, and 0 already
+ * means the root in ".." entries and "not found" in lookups.
+ */
+#define FAT_FIXED_ROOT  1
+
+/* Clusters held by each buffer of the O_DIRECT pool */
+#define FAT_POOL_CLUSTERS   16
+
+/* A file being defragmented */
+typedef struct fat_defrag_file {
+    off_t               dirent;         /* Device offset of the 8.3 entry */
+    unsigned int        *chain;
+    unsigned int        n_chain;
+    unsigned int        extents;        /* Contiguous runs in the chain */
+    unsigned int        target;         /* First cluster of the planned extent, 0 if none */
+} fat_defrag_file_t;
+
 typedef struct fat_file {
     char            *longname;
     fat_direntry_t  dir_ent;    
-    int             offset;
-    int             beg_marker;
-    int             eof_marker;
+    off_t           offset;         /* Device offset of the 8.3 entry */
+    off_t           beg_marker;
+    off_t           eof_marker;
+    unsigned int    pos_cluster;    /* Chain cluster last used and its index, so sequential I/O */
+    int             pos_index;      /* need not walk the chain from the start again */
+    fat_batch_t     reserved;       /* FAT links of clusters reserved for the file, written once its data is */
 } fat_file_t;
 
 /* Extern Variables */
@@ -122,14 +406,115 @@ extern uint8_t              DskTableFAT16_NumEntries;
 extern uint8_t              DskTableFAT32_NumEntries;
 extern DskSiztoSecPerClus_t DskTableFAT16[];
 extern DskSiztoSecPerClus_t DskTableFAT32[];
+extern fat_t                fat_table[];
+extern handle_table_t       fat_file_table;
+extern const fat_codec_t    fat_codecs[];
+
+/* Device Access */
+int fat_dev_open(fat_t *fat, const char *device_name, int flags);
+off_t fat_dev_seek(fat_t *fat, int device, off_t offset, int whence);
+ssize_t fat_dev_read(fat_t *fat, int device, void *buff, size_t count);
+ssize_t fat_dev_write(fat_t *fat, int device, const void *buff, size_t count);
+void fat_direct_setup(fat_t *fat, const char *device_name);
+unsigned char *fat_pool_get(fat_t *fat);
+void fat_pool_put(fat_t *fat, unsigned char *buff);
+void fat_pool_free(fat_t *fat);
+
+/* Durability */
+void fat_sync_setup(fat_t *fat, const char *device_name, int policy, int period_ms);
+void fat_sync_free(fat_t *fat);
+void fat_flush(fat_t *fat);
+void fat_commit(fat_t *fat, int durable);
+void fat_put_dirent(fat_t *fat, int device, off_t offset, fat_direntry_t *ent);
+void fat_changed(fat_t *fat);
+
+/* Intent Log */
+void fat_meta_write(fat_t *fat, int device, off_t offset, const void *buff, size_t len);
+void fat_log_overlay(fat_t *fat, off_t offset, void *buff, size_t len);
+void fat_log_recover(fat_t *fat, int device, const char *device_name);
+void fat_log_setup(fat_t *fat, const char *device_name);
+void fat_log_checkpoint(fat_t *fat);
+void fat_log_free(fat_t *fat);
+int fat_log_pending(int fd, off_t start, unsigned int size);
+
+/* Scratch Arenas */
+void *arena_alloc(fat_arena_t *arena, size_t size);
+fat_arena_mark_t arena_mark(fat_arena_t *arena);
+void arena_release(fat_arena_t *arena, fat_arena_mark_t mark);
+void arena_free(fat_arena_t *arena);
+
+/* FAT Table Access */
+void update_fsinfo(const char *device_name, fat_t *fat);
+unsigned int fat_window_bytes(fat_t *fat);
+unsigned int read_fat_table(int device, fat_t* fat, int cluster);
+unsigned int write_fat_table(int device, fat_t* fat, unsigned int cluster, unsigned int value);
+
+/* Cluster Allocation */
+int cluster_in_use(fat_t *fat, unsigned int cluster);
+void mark_cluster(fat_t *fat, unsigned int cluster, int used);
+unsigned int next_free_cluster(int device, fat_t *fat, unsigned int cluster);
+unsigned int find_free_run(fat_t *fat, unsigned int count, unsigned int hint);
+unsigned int read_fat_cached(int device, fat_t *fat, unsigned int cluster, unsigned int *sector, unsigned char *buff);
+
+/* Batched FAT Updates */
+void fat_batch_add(fat_t *fat, fat_batch_t *batch, unsigned int cluster, unsigned int value);
+int fat_batch_flush(int device, fat_t *fat, fat_batch_t *batch);
+void fat_discard_runs(int device, fat_t *fat, fat_run_t *runs, int count);
+unsigned int fat_batch_chain(int device, fat_t *fat, fat_batch_t *batch, unsigned int count, unsigned int *clusters);
+unsigned int fat_truncate_chain(int device, fat_t *fat, fat_batch_t *batch, unsigned int first, unsigned int keep);
+
+/* Directory Entries */
+char *gen_basis_name(const char *input, char *shortname);
+char *process_long_entry(unsigned char *buff, int *offcount, char *name, int size);
+void format_short_name(const unsigned char *raw, char *out);
+int dir_entry_slots(const char *name);
+void init_direntry(fat_direntry_t *dirent, char *name, unsigned int cluster, unsigned int size);
+int build_dir_entries(char *name, fat_direntry_t *dirent, unsigned char *buff);
+
+/* Directory Maps */
+fat_dirmap_t *dirmap_get(int device, fat_t *fat, unsigned int first_cluster);
+int dirmap_alloc(int device, fat_t *fat, fat_dirmap_t *map, int count, fat_batch_t *batch);
+void dirmap_release(fat_dirmap_t *map, int start, int count);
+off_t dirmap_cluster_location(fat_t *fat, fat_dirmap_t *map, int index);
+off_t dirmap_slot_location(fat_t *fat, fat_dirmap_t *map, int slot);
+int dirmap_cluster_bytes(fat_t *fat, fat_dirmap_t *map, int index);
+int dirmap_slot_count(fat_t *fat, fat_dirmap_t *map);
+void dirmap_read_cluster(int device, fat_t *fat, fat_dirmap_t *map, int index, unsigned char *buff);
+void dir_write_slots(int device, fat_t *fat, fat_dirmap_t *map, int slot, const void *buffer, int count);
+int dir_add_entry(int device, fat_t *fat, fat_dirmap_t *map, char *name, fat_direntry_t *dirent);
+void dirmap_free_all(fat_t *fat);
+
+/* Directory Scans */
+void dirscan_begin(fat_dirscan_t *scan, int device, fat_t *fat, fat_dirmap_t *map, int slot);
+int dirscan_next(fat_dirscan_t *scan, fat_dirhit_t *hit);
+void dirscan_end(fat_dirscan_t *scan);
+int dir_lookup(int device, fat_t *fat, fat_dirmap_t *map, const char *name, fat_dirhit_t *hit);
+
+/* Defragmentation */
+fat_defrag_file_t *defrag_collect(int device, fat_t *fat, unsigned int root, int *count);
+void defrag_free_files(fat_defrag_file_t *files, int count);
+void defrag_measure(fat_defrag_file_t *files, int count, defrag_stats_t *stats);
+void defrag_copy(int device, fat_t *fat, fat_defrag_file_t *f, unsigned char *buff);
 
 /* Functions */
 int fat32_init(int dev);
 int fat32_createfile(int pos, file_t *file);
+int fat32_createbatch(file_t *files, const unsigned int *sizes, int count);
 int fat32_openfile(int pos, file_t *file, int cd);
 int fat32_readfile(int file, void *buffer, int count);
 int fat32_deletefile(file_t *file);
 int fat32_write(int file, const void* buffer, int count);
+int fat32_closefile(int file);
+int fat32_truncate(int file, unsigned int length);
 dir_entry_t fat32_readdir(dir_t *dir);
-int fat32_teardown();
+int fat32_trim(int dev);
+int fat32_sync(int dev);
+int fat32_defrag(int dev, defrag_stats_t *before, defrag_stats_t *after);
+int fat32_compactdir(file_t *dir);
+int fat32_mkdir(file_t *dir);
+int fat32_filemap(int file, fs_extent_t **extents);
+int fat32_reserve(int file, unsigned int size, fs_extent_t **extents);
+int fat32_writeextent(int file, const fs_extent_t *extent, unsigned int offset, const void *buffer, int count);
+fs_stats_t *fat32_stats(int dev);
+int fat32_teardown(int dev);
 #endif
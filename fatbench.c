@@ -0,0 +1,321 @@
+/*
+ * @file: fatbench.c
+ *
+ * Benchmark scenarios for the FAT32 engine.  Every scenario starts from
+ * a fresh image made with mkfs and uses a fixed random seed, so runs can
+ * be compared over time.  Results are written as JSON.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vfs.h"
+
+#define BENCH_IO_MB         64          /* Size of the file used for throughput runs */
+#define BENCH_IO_CHUNK      (1024 * 1024)
+#define BENCH_RAND_OPS      2000
+#define BENCH_RAND_SIZE     4096
+#define BENCH_MOUNT_REPS    5
+#define BENCH_BATCH         10000       /* Files created per filecreate_batch call */
+#define BENCH_DIR_WORK      20000000    /* Bounds ops * entries for the directory runs */
+
+/* One scenario being measured */
+typedef struct bench_run {
+    const char          *name;
+    char                params[160];    /* Body of the JSON params object */
+    double              *lat;           /* Seconds taken by each op */
+    int                 n;
+    int                 cap;
+    double              start;
+    unsigned long long  syscr;
+    unsigned long long  syscw;
+} bench_run_t;
+
+static FILE *out;
+static int n_results = 0;
+static unsigned long long bench_seed = 0x9E3779B97F4A7C15ULL;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+unsigned long long bench_rand(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/* Read and write syscalls made by this process so far, 0 where /proc is missing */
+void read_syscalls(unsigned long long *rd, unsigned long long *wr) {
+    char line[128];
+    FILE *fp = fopen("/proc/self/io", "r");
+    *rd = 0;
+    *wr = 0;
+    if (fp == NULL) return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        sscanf(line, "syscr: %llu", rd);
+        sscanf(line, "syscw: %llu", wr);
+    }
+    fclose(fp);
+}
+
+void run_begin(bench_run_t *r, const char *name, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(r->params, sizeof(r->params), fmt, args);
+    va_end(args);
+
+    r->name = name;
+    r->n = 0;
+    fprintf(stderr, "bench: %s {%s}\n", name, r->params);
+    read_syscalls(&r->syscr, &r->syscw);
+    r->start = now();
+}
+
+void op_done(bench_run_t *r, double t0) {
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 1024;
+        r->lat = realloc(r->lat, r->cap * sizeof(double));
+    }
+    r->lat[r->n++] = now() - t0;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Close a scenario and emit its JSON record */
+void run_end(bench_run_t *r, unsigned long long bytes) {
+    double elapsed = now() - r->start;
+    unsigned long long rd, wr;
+    read_syscalls(&rd, &wr);
+
+    qsort(r->lat, r->n, sizeof(double), compare_double);
+    double p50 = r->n ? r->lat[(r->n - 1) / 2] : 0;
+    double p99 = r->n ? r->lat[((r->n - 1) * 99) / 100] : 0;
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"params\": {%s}, \"ops\": %d, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+            "\"syscalls\": {\"read\": %llu, \"write\": %llu}}",
+            n_results++ ? "," : "", r->name, r->params, r->n, elapsed,
+            elapsed > 0 ? r->n / elapsed : 0, elapsed > 0 ? (bytes / 1048576.0) / elapsed : 0,
+            p50 * 1e6, p99 * 1e6, rd - r->syscr, wr - r->syscw);
+    fflush(out);
+}
+
+int make_image(const char *mkfs, const char *image, int size_mb) {
+    char cmd[512];
+    unlink(image);
+    snprintf(cmd, sizeof(cmd), "%s %dM %s > /dev/null", mkfs, size_mb, image);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "bench: %s failed\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/*********** Scenarios ***************/
+
+void bench_mount(bench_run_t *r, const char *mkfs, const char *image, int size_mb) {
+    if (make_image(mkfs, image, size_mb) != 0) return;
+    run_begin(r, "mount", "\"size_mb\": %d", size_mb);
+    for (int i = 0; i < BENCH_MOUNT_REPS; i++) {
+        double t0 = now();
+        mount_fs(image, "/");
+        unmount_fs("/");
+        op_done(r, t0);
+    }
+    run_end(r, 0);
+}
+
+/* Sequential and random I/O through filewrite/fileread, plus a walk of the file's chain */
+void bench_io(bench_run_t *r, const char *mkfs, const char *image) {
+    int size_mb = 1024;
+    if (make_image(mkfs, image, size_mb) != 0) return;
+    mount_fs(image, "/");
+
+    char *buff = malloc(BENCH_IO_CHUNK);
+    memset(buff, 'b', BENCH_IO_CHUNK);
+    unsigned long long bytes = (unsigned long long)BENCH_IO_MB * 1048576;
+
+    fileclose(filecreate("/bench.dat"));
+    int fd = fileopen("/bench.dat", BEGIN);
+    run_begin(r, "seq_write", "\"file_mb\": %d, \"chunk\": %d", BENCH_IO_MB, BENCH_IO_CHUNK);
+    for (int i = 0; i < BENCH_IO_MB; i++) {
+        double t0 = now();
+        filewrite(fd, buff, BENCH_IO_CHUNK);
+        op_done(r, t0);
+    }
+    run_end(r, bytes);
+    fileclose(fd);
+
+    fd = fileopen("/bench.dat", BEGIN);
+    run_begin(r, "seq_read", "\"file_mb\": %d, \"chunk\": %d", BENCH_IO_MB, BENCH_IO_CHUNK);
+    for (int i = 0; i < BENCH_IO_MB; i++) {
+        double t0 = now();
+        fileread(fd, buff, BENCH_IO_CHUNK);
+        op_done(r, t0);
+    }
+    run_end(r, bytes);
+
+    /* One op per read_fat_table call, the way the engine walks a chain */
+    file_t *fp = handle_get(&filetable, fd);
+    fat_file_t *f = handle_slot(&fat_file_table, HANDLE_INDEX(fd));
+    fat_t *fat = &(fat_table[fp->device]);
+    unsigned int cluster = (f->dir_ent.high_clu << 16) | f->dir_ent.low_clu;
+    int device = open(image, O_RDONLY);
+    run_begin(r, "chain_walk", "\"file_mb\": %d", BENCH_IO_MB);
+    while (cluster >= 2 && cluster < fat->codec->bad) {
+        double t0 = now();
+        cluster = read_fat_table(device, fat, cluster);
+        op_done(r, t0);
+    }
+    run_end(r, 0);
+    close(device);
+
+    unsigned int blocks = bytes / BENCH_RAND_SIZE;
+    run_begin(r, "rand_read", "\"file_mb\": %d, \"size\": %d", BENCH_IO_MB, BENCH_RAND_SIZE);
+    for (int i = 0; i < BENCH_RAND_OPS; i++) {
+        fp->offset = (bench_rand() % blocks) * BENCH_RAND_SIZE;
+        double t0 = now();
+        fileread(fd, buff, BENCH_RAND_SIZE);
+        op_done(r, t0);
+    }
+    run_end(r, (unsigned long long)BENCH_RAND_OPS * BENCH_RAND_SIZE);
+
+    run_begin(r, "rand_write", "\"file_mb\": %d, \"size\": %d", BENCH_IO_MB, BENCH_RAND_SIZE);
+    for (int i = 0; i < BENCH_RAND_OPS; i++) {
+        fp->offset = (bench_rand() % blocks) * BENCH_RAND_SIZE;
+        double t0 = now();
+        filewrite(fd, buff, BENCH_RAND_SIZE);
+        op_done(r, t0);
+    }
+    run_end(r, (unsigned long long)BENCH_RAND_OPS * BENCH_RAND_SIZE);
+    fileclose(fd);
+
+    free(buff);
+    unmount_fs("/");
+}
+
+/* Fill the root with entries files, in batches so the setup stays cheap */
+void populate_dir(int entries) {
+    char **names = malloc(BENCH_BATCH * sizeof(char*));
+    for (int i = 0; i < BENCH_BATCH; i++) names[i] = malloc(32);
+
+    for (int done = 0; done < entries; ) {
+        int n = (entries - done) < BENCH_BATCH ? (entries - done) : BENCH_BATCH;
+        for (int i = 0; i < n; i++) sprintf(names[i], "/f%07d.dat", done + i);
+        filecreate_batch((const char**)names, NULL, n);
+        done += n;
+    }
+
+    for (int i = 0; i < BENCH_BATCH; i++) free(names[i]);
+    free(names);
+}
+
+void bench_dir(bench_run_t *r, const char *mkfs, const char *image, int entries) {
+    if (make_image(mkfs, image, 1024) != 0) return;
+    mount_fs(image, "/");
+    populate_dir(entries);
+
+    /* Fewer ops on big directories, where each lookup scans the whole thing */
+    int ops = BENCH_DIR_WORK / entries;
+    if (ops > 200) ops = 200;
+    if (ops < 10) ops = 10;
+    char name[32];
+
+    run_begin(r, "create", "\"entries\": %d", entries);
+    for (int i = 0; i < ops; i++) {
+        sprintf(name, "/n%07d.dat", i);
+        double t0 = now();
+        fileclose(filecreate(name));
+        op_done(r, t0);
+    }
+    run_end(r, 0);
+
+    run_begin(r, "open", "\"entries\": %d", entries);
+    for (int i = 0; i < ops; i++) {
+        sprintf(name, "/f%07d.dat", (int)(bench_rand() % entries));
+        double t0 = now();
+        fileclose(fileopen(name, BEGIN));
+        op_done(r, t0);
+    }
+    run_end(r, 0);
+
+    run_begin(r, "delete", "\"entries\": %d", entries);
+    for (int i = 0; i < ops; i++) {
+        sprintf(name, "/n%07d.dat", i);
+        double t0 = now();
+        deletefile(name);
+        op_done(r, t0);
+    }
+    run_end(r, 0);
+
+    int dir = opendir("/");
+    run_begin(r, "readdir", "\"entries\": %d", entries);
+    while (1) {
+        double t0 = now();
+        dir_entry_t ent = readdir(dir);
+        op_done(r, t0);
+        if (ent.name == NULL) break;
+    }
+    run_end(r, 0);
+    closedir(dir);
+
+    unmount_fs("/");
+}
+
+int main(int argc, char **argv) {
+    const char *mkfs = "./mkfs";
+    const char *image = "bench.img";
+    const char *output = NULL;
+    int quick = 0, full = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mkfs = argv[++i];
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            full = 1;
+        } else {
+            printf("usage: fatbench [-q | -f] [-m mkfs] [-i image] [-o results.json]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* The engine reports on stdout, keep that out of the results */
+    out = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL) { perror("fatbench"); exit(EXIT_FAILURE); }
+    if (freopen("/dev/null", "w", stdout) == NULL) { perror("fatbench"); exit(EXIT_FAILURE); }
+
+    int mount_sizes[] = {1024, 4096, 16384};
+    int dir_sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    int n_mount = quick ? 1 : 3;
+    int n_dir = quick ? 3 : (full ? 6 : 5);
+
+    fprintf(out, "{\n  \"version\": 1,\n  \"results\": [");
+    bench_run_t r = {NULL, "", NULL, 0, 0, 0, 0, 0};
+
+    for (int i = 0; i < n_mount; i++) bench_mount(&r, mkfs, image, mount_sizes[i]);
+    bench_io(&r, mkfs, image);
+    for (int i = 0; i < n_dir; i++) bench_dir(&r, mkfs, image, dir_sizes[i]);
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    free(r.lat);
+    unlink(image);
+    return EXIT_SUCCESS;
+}
@@ -7,54 +7,170 @@
 #ifndef FS_TYPES_XINU_HEADER
 #define FS_TYPES_XINU_HEADER
 
+#include <stdint.h>
+#include "handle.h"
+
 #define     FAT16       0
 #define     FAT32       1
+#define     FAT12       2
  
-#define MOUNT_LIMIT     10
-#define FILE_LIMIT      255
+#define MOUNT_LIMIT     1024
+
+/* Paths shorter than this are held inside their handle, longer ones on the heap */
+#define FS_INLINE_PATH  256
+
+/* Mount Flags */
+#define MOUNT_DISCARD           0x01    /* Discard freed clusters as they are freed */
+#define MOUNT_DISCARD_DEFERRED  0x02    /* Queue freed clusters for a later trim pass */
+#define MOUNT_DIRECT            0x04    /* Open the device with O_DIRECT, bypassing the host page cache */
+#define MOUNT_SYNC_CLOSE        0x08    /* Commit a mount's changes as each file is closed */
+#define MOUNT_SYNC_PERIODIC     0x10    /* Commit them from a background flusher every sync_ms */
+#define MOUNT_SYNC              0x20    /* Commit them before every metadata change returns */
+#define MOUNT_SYNC_MASK         (MOUNT_SYNC_CLOSE | MOUNT_SYNC_PERIODIC | MOUNT_SYNC)
+#define MOUNT_LOG               0x40    /* Send metadata writes through the intent log */
+
+/* Flush interval of MOUNT_SYNC_PERIODIC when the mount names none */
+#define FS_SYNC_PERIOD_MS       1000
 
 typedef struct mount_s {
     char      *device_name;
     char      *path;
     int       fs_type;
+    int       flags;
+    int       sync_ms;                  /* Flush interval of MOUNT_SYNC_PERIODIC */
 } mount_t;
 
 typedef struct fileinfo_s {
-    char    *path;
-    char    *name;
+    char    *path;                      /* inline_path when it fits */
+    char    *name;                      /* Last component of path */
     int     device;
-    int     offset;
-    int     size;
+    uint32_t offset;                    /* FAT32 files stop short of 4GB, so */
+    uint32_t size;                      /* 32 bits cover any position in one */
+    char    inline_path[FS_INLINE_PATH];
 } file_t;
 
 typedef struct dir_info {
-    char    *path;
+    char    *path;                      /* inline_path when it fits */
     int     device;
     int     offset;
+    char    inline_path[FS_INLINE_PATH];
+    char    name[256];                  /* Name of the entry readdir returned last */
 } dir_t;
 
 typedef struct dir_entry {
     char    *name;
     int     time;
-    // Offset is # of 32-bit entries from the start of the cluster
+    // Offset is # of 32 byte slots from the start of the directory
     int     offset; 
     int     dir;
     void    *misc;
 } dir_entry_t;
 
+/* How fragmented the files on a volume are */
+typedef struct defrag_stats_s {
+    unsigned int    files;          /* Files holding at least one cluster */
+    unsigned int    fragmented;     /* Files made of more than one extent */
+    unsigned int    extents;        /* Contiguous runs across all files */
+    unsigned int    clusters;       /* Clusters across all files */
+    unsigned int    moved;          /* Files rewritten into a single extent */
+} defrag_stats_t;
+
+/* Operations timed by the VFS */
+#define FS_OP_OPEN          0
+#define FS_OP_READ          1
+#define FS_OP_WRITE         2
+#define FS_OP_READDIR       3
+#define FS_OP_CREATE        4
+#define FS_OP_DELETE        5
+#define FS_OP_COUNT         6
+
+/* Latency histogram buckets, bucket i counts ops that took under 2^i microseconds */
+#define FS_HIST_BUCKETS     32
+
+typedef struct fs_op_stats_s {
+    unsigned long long  count;
+    unsigned long long  total_ns;
+    unsigned long long  hist[FS_HIST_BUCKETS];
+} fs_op_stats_t;
+
+/* Activity on a mount since it was mounted or its stats were reset */
+typedef struct fs_stats_s {
+    unsigned long long  dev_opens;      /* Calls made on the device */
+    unsigned long long  dev_reads;
+    unsigned long long  dev_writes;
+    unsigned long long  dev_seeks;
+    unsigned long long  bytes_read;     /* Bytes moved by those calls */
+    unsigned long long  bytes_written;
+    unsigned long long  data_read;      /* Part of those bytes that was file contents */
+    unsigned long long  data_written;
+    unsigned long long  fat_reads;      /* FAT sectors read and written */
+    unsigned long long  fat_writes;
+    unsigned long long  cache_hits;     /* Directory map and FAT sector cache lookups */
+    unsigned long long  cache_misses;
+    unsigned long long  syncs;          /* fdatasync calls made by commits */
+    unsigned long long  log_records;    /* Intent log records written, and checkpoints that */
+    unsigned long long  checkpoints;    /* wrote what they held home */
+    fs_op_stats_t       ops[FS_OP_COUNT];
+} fs_stats_t;
+
+/* Calls recorded by a workload capture */
+#define CAPTURE_OPEN        0
+#define CAPTURE_READ        1
+#define CAPTURE_WRITE       2
+#define CAPTURE_CREATE      3
+#define CAPTURE_DELETE      4
+#define CAPTURE_CLOSE       5
+#define CAPTURE_OPENDIR     6
+#define CAPTURE_READDIR     7
+#define CAPTURE_CLOSEDIR    8
+#define CAPTURE_CHDIR       9
+#define CAPTURE_OP_COUNT    10
+
+/* A capture file is this magic followed by records, each trailed by path_len bytes of path */
+#define CAPTURE_MAGIC       "FATCAP01"
+
+typedef struct capture_rec_s {
+    uint64_t    ts;                     /* Nanoseconds from the start of the capture */
+    uint32_t    dur;                    /* Nanoseconds the call took */
+    uint8_t     op;
+    uint8_t     mode;                   /* Mode given to fileopen */
+    uint16_t    path_len;
+    int32_t     handle;                 /* File or dir id used, or returned by opens */
+    int32_t     arg;                    /* Bytes asked for, or the file size on open */
+    int32_t     result;
+} capture_rec_t;
+
+/* A run of a file's data that is contiguous on the device */
+typedef struct fs_extent_s {
+    long long       offset;             /* Byte offset on the device */
+    unsigned int    length;             /* Bytes of file data in the run */
+} fs_extent_t;
+
 typedef struct fs_table_s {
     int (*init)(int);
     int (*createfile)(int, file_t*);
+    int (*createbatch)(file_t*, const unsigned int*, int);
     int (*openfile)(int, file_t*, int cd);
     int (*deletefile)(file_t*);
     int (*read)(int,void*,int);
     int (*write)(int, const void*,int);
+    int (*closefile)(int);
+    int (*truncate)(int, unsigned int);
     dir_entry_t (*readdir)(dir_t*);
-    int (*teardown)();
+    int (*trim)(int);
+    int (*sync)(int);
+    int (*defrag)(int, defrag_stats_t*, defrag_stats_t*);
+    int (*compactdir)(file_t*);
+    int (*mkdir)(file_t*);
+    int (*filemap)(int, fs_extent_t**);
+    int (*reserve)(int, unsigned int, fs_extent_t**);
+    int (*writeextent)(int, const fs_extent_t*, unsigned int, const void*, int);
+    fs_stats_t* (*stats)(int);
+    int (*teardown)(int);
 } fs_table_t;
 
-extern file_t filetable[];
-extern dir_t *dirtable[];
+extern handle_table_t filetable;
+extern handle_table_t dirtable;
 extern fs_table_t fs_table[];
 extern mount_t *mount_table[];
 
@@ -0,0 +1,717 @@
+/*
+ * @file: fsck.c
+ *
+ * Consistency checker for FAT file systems.  The FAT is loaded once,
+ * the directory tree is walked by a pool of threads, and every cluster
+ * reached through a chain is claimed in a shared bitmap.  Problems are
+ * only reported unless -r is given, in which case they are repaired
+ * once the walk has finished.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fat32.h"
+
+#define FSCK_MAX_THREADS    64
+#define FSCK_READ_CHUNK     (1024 * 1024)
+#define FAT_EOC             (ck.fat.codec->eoc)
+#define FAT_BAD             (ck.fat.codec->bad)
+
+/* Exit codes, as fsck(8) uses them */
+#define FSCK_OK             0
+#define FSCK_CORRECTED      1
+#define FSCK_UNCORRECTED    4
+#define FSCK_ERROR          8
+
+enum {
+    PROB_BADLINK,       /* Chain runs into a free, reserved or out of range cluster */
+    PROB_CROSS,         /* Chain runs into a cluster another chain already owns */
+    PROB_LOOP,          /* Chain runs back into itself */
+    PROB_SIZE_LONG,     /* Chain has more clusters than the file size needs */
+    PROB_SIZE_SHORT     /* Chain has fewer clusters than the file size needs */
+};
+
+/* A directory waiting to be read */
+typedef struct fsck_job {
+    char                *path;
+    unsigned int        *chain;         /* NULL for the fixed FAT12/16 root region */
+    unsigned int        n_chain;
+} fsck_job_t;
+
+/* Each worker owns one queue, pops from its tail and steals from the head of others */
+typedef struct fsck_queue {
+    pthread_mutex_t     lock;
+    fsck_job_t          *jobs;
+    int                 head;
+    int                 tail;
+    int                 cap;
+} fsck_queue_t;
+
+typedef struct fsck_problem {
+    int                 type;
+    char                *path;
+    off_t               dirent;         /* Device offset of the 8.3 entry, -1 for the root */
+    int                 dir;
+    unsigned int        first;          /* First cluster of the chain */
+    unsigned int        last;           /* Last good cluster, 0 if the first is already bad */
+    unsigned int        length;         /* Good clusters up to and including last */
+    unsigned int        at;             /* Cluster the problem was found at */
+    uint32_t            size;           /* Size recorded in the entry */
+} fsck_problem_t;
+
+typedef struct fsck_state {
+    int                 device;
+    fat_t               fat;
+    unsigned int        cluster_size;
+    unsigned int        n_entries;      /* Clusters 0 and 1 plus every data cluster */
+    unsigned char       *raw;           /* First copy of the FAT as it is on disk */
+    unsigned int        *table;         /* Entries of raw, decoded to one word each */
+    unsigned int        *owned;         /* One bit per cluster, claimed atomically */
+    unsigned char       *dirty;         /* One byte per FAT sector that needs writing back */
+
+    fsck_queue_t        queues[FSCK_MAX_THREADS];
+    int                 n_threads;
+    int                 pending;        /* Jobs queued or running */
+
+    pthread_mutex_t     problem_lock;
+    fsck_problem_t      *problems;
+    int                 n_problems;
+    int                 cap_problems;
+    unsigned int        n_files;
+    unsigned int        n_dirs;
+    unsigned int        log_first;      /* First cluster of the intent log, 0 if there is none */
+    uint32_t            log_size;
+} fsck_state_t;
+
+static fsck_state_t ck;
+
+/*********** Device Access ***************/
+
+/* 64 bit version of get_cluster_location, volumes here can be far past 2G */
+off_t cluster_offset(unsigned int cluster) {
+    return ((off_t)ck.fat.data_sect + ((off_t)ck.fat.bs->sectors_per_cluster * (cluster - 2))) * ck.fat.bs->bytes_per_sector;
+}
+
+int read_full(off_t offset, void *buff, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t rd = pread(ck.device, (char*)buff + done, len - done, offset + done);
+        if (rd <= 0) { return -1; }
+        done += rd;
+    }
+    return 0;
+}
+
+int load_volume(const char *device_name, int writable) {
+    ck.device = open(device_name, writable ? O_RDWR : O_RDONLY);
+    if (ck.device < 0) { perror("fsck"); return -1; }
+
+    fat_t *fat = &(ck.fat);
+    fat->bs = calloc(1, sizeof(fat_BS_t));
+    fat->info = calloc(1, sizeof(fat_fsinfo_t));
+    if (read_full(0, fat->bs, 90) != 0) { printf("fsck: cannot read boot sector\n"); return -1; }
+
+    fat_extBS_32_t *ext = (fat_extBS_32_t*)fat->bs->extended_section;
+    if (fat->bs->bytes_per_sector < 512 || fat->bs->sectors_per_cluster == 0) {
+        printf("fsck: %s is not a FAT volume\n", device_name);
+        return -1;
+    }
+
+    /* Same layout rules as the engine, the type goes by the cluster count */
+    unsigned int bps = fat->bs->bytes_per_sector;
+    unsigned int root_dir_sectors = ((fat->bs->root_entry_count * 32) + (bps - 1)) / bps;
+    unsigned int total = (fat->bs->total_sectors_16 != 0) ? fat->bs->total_sectors_16 : fat->bs->total_sectors_32;
+    fat->table_size = (fat->bs->table_size_16 != 0) ? fat->bs->table_size_16 : ext->table_size_32;
+    fat->root_sect = fat->bs->reserved_sector_count + (fat->bs->table_count * fat->table_size);
+    fat->data_sect = fat->root_sect + root_dir_sectors;
+    fat->n_clusters = (total - fat->data_sect) / fat->bs->sectors_per_cluster;
+    fat->fs_type = (fat->n_clusters < 4085) ? FAT12 : (fat->n_clusters < 65525) ? FAT16 : FAT32;
+    fat->codec = &(fat_codecs[fat->fs_type]);
+    fat->window_ents = (fat->codec->window * bps * 8) / fat->codec->bits;
+    fat->root_cluster = (fat->fs_type == FAT32) ? ext->root_cluster : FAT_FIXED_ROOT;
+    ck.cluster_size = bps * fat->bs->sectors_per_cluster;
+
+    if (fat->fs_type != FAT32) {
+        fat->info->num_free_clusters = 0xFFFFFFFF;     /* No FSInfo, nothing to compare */
+    } else if (read_full(((off_t)ext->fat_info * bps) + 488, fat->info, 8) != 0) {
+        printf("fsck: cannot read FSInfo\n");
+        return -1;
+    }
+
+    /* A FAT sized too small for the data area only covers what it can */
+    uint64_t table_bytes = (uint64_t)fat->table_size * bps;
+    ck.n_entries = fat->n_clusters + 2;
+    if (ck.n_entries > (table_bytes * 8) / fat->codec->bits) ck.n_entries = (table_bytes * 8) / fat->codec->bits;
+
+    /* Load the first copy of the FAT in large reads, padded out to whole codec windows */
+    uint64_t window = (uint64_t)fat->codec->window * bps;
+    ck.raw = calloc((table_bytes + window - 1) / window, window);
+    off_t base = (off_t)fat->bs->reserved_sector_count * bps;
+    for (uint64_t done = 0; done < table_bytes; done += FSCK_READ_CHUNK) {
+        size_t amt = (table_bytes - done) < FSCK_READ_CHUNK ? (table_bytes - done) : FSCK_READ_CHUNK;
+        if (read_full(base + done, ck.raw + done, amt) != 0) {
+            printf("fsck: cannot read the FAT\n");
+            return -1;
+        }
+    }
+    ck.table = malloc((size_t)ck.n_entries * sizeof(unsigned int));
+    for (unsigned int c = 0; c < ck.n_entries; c++) {
+        ck.table[c] = fat->codec->get(ck.raw + ((c / fat->window_ents) * window), c % fat->window_ents);
+    }
+
+    ck.owned = calloc((ck.n_entries + 31) / 32, sizeof(unsigned int));
+    ck.dirty = calloc(fat->table_size, 1);
+    return 0;
+}
+
+/*
+ * Compare every other copy of the FAT against the first
+ *
+ * @return  Number of FAT sectors that differ
+ */
+unsigned int compare_mirrors(void) {
+    unsigned int bps = ck.fat.bs->bytes_per_sector;
+    unsigned int per_chunk = FSCK_READ_CHUNK / bps;
+    unsigned char *buff = malloc(FSCK_READ_CHUNK);
+    unsigned int differ = 0;
+
+    for (int t = 1; t < ck.fat.bs->table_count; t++) {
+        off_t base = ((off_t)ck.fat.bs->reserved_sector_count + ((off_t)t * ck.fat.table_size)) * bps;
+        for (unsigned int s = 0; s < (unsigned int)ck.fat.table_size; s += per_chunk) {
+            unsigned int n = (ck.fat.table_size - s) < per_chunk ? (ck.fat.table_size - s) : per_chunk;
+            if (read_full(base + ((off_t)s * bps), buff, (size_t)n * bps) != 0) break;
+            for (unsigned int i = 0; i < n; i++) {
+                if (memcmp(buff + (i * bps), ck.raw + ((size_t)(s + i) * bps), bps) != 0) {
+                    if (!ck.dirty[s + i]) differ++;
+                    ck.dirty[s + i] = 1;
+                }
+            }
+        }
+    }
+    free(buff);
+    return differ;
+}
+
+/*********** Ownership ***************/
+
+static inline unsigned int fat_entry(unsigned int cluster) {
+    return ck.table[cluster];
+}
+
+/* Claim a cluster, returns 1 if some chain already owned it */
+static inline int claim_cluster(unsigned int cluster) {
+    unsigned int bit = 1u << (cluster % 32);
+    return (__sync_fetch_and_or(&(ck.owned[cluster / 32]), bit) & bit) != 0;
+}
+
+static inline int is_owned(unsigned int cluster) {
+    return (ck.owned[cluster / 32] >> (cluster % 32)) & 1;
+}
+
+/* Update an entry in both tables, a FAT12 entry can straddle two sectors */
+static inline void set_entry(unsigned int cluster, unsigned int value) {
+    unsigned int window = ck.fat.codec->window * ck.fat.bs->bytes_per_sector;
+    ck.table[cluster] = value;
+    ck.fat.codec->set(ck.raw + ((cluster / ck.fat.window_ents) * window), cluster % ck.fat.window_ents, value);
+    uint64_t first = ((uint64_t)cluster * ck.fat.codec->bits) / 8;
+    uint64_t last = ((((uint64_t)cluster + 1) * ck.fat.codec->bits) - 1) / 8;
+    ck.dirty[first / ck.fat.bs->bytes_per_sector] = 1;
+    ck.dirty[last / ck.fat.bs->bytes_per_sector] = 1;
+}
+
+/*********** Work Queues ***************/
+
+void push_job(int id, char *path, unsigned int *chain, unsigned int n_chain) {
+    fsck_queue_t *q = &(ck.queues[id]);
+    __sync_fetch_and_add(&ck.pending, 1);
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        /* Slide the live jobs down before growing */
+        memmove(q->jobs, q->jobs + q->head, (q->tail - q->head) * sizeof(fsck_job_t));
+        q->tail -= q->head;
+        q->head = 0;
+        if (q->tail == q->cap) {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->jobs = realloc(q->jobs, q->cap * sizeof(fsck_job_t));
+        }
+    }
+    q->jobs[q->tail].path = path;
+    q->jobs[q->tail].chain = chain;
+    q->jobs[q->tail].n_chain = n_chain;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Newest job from our own queue, so a worker stays deep in its own subtree */
+int pop_job(int id, fsck_job_t *job) {
+    fsck_queue_t *q = &(ck.queues[id]);
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *job = q->jobs[--q->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Oldest job from someone else's queue, which tends to be the biggest subtree */
+int steal_job(int id, fsck_job_t *job) {
+    for (int i = 1; i < ck.n_threads; i++) {
+        fsck_queue_t *q = &(ck.queues[(id + i) % ck.n_threads]);
+        int found = 0;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) {
+            *job = q->jobs[q->head++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+/*********** Checks ***************/
+
+void add_problem(int type, const char *path, off_t dirent, int dir, unsigned int first,
+                 unsigned int last, unsigned int length, unsigned int at, uint32_t size) {
+    pthread_mutex_lock(&ck.problem_lock);
+    if (ck.n_problems == ck.cap_problems) {
+        ck.cap_problems = ck.cap_problems ? ck.cap_problems * 2 : 64;
+        ck.problems = realloc(ck.problems, ck.cap_problems * sizeof(fsck_problem_t));
+    }
+    fsck_problem_t *p = &(ck.problems[ck.n_problems++]);
+    p->type = type;
+    p->path = calloc(strlen(path) + 2, sizeof(char));
+    strcpy(p->path, path[0] ? path : "/");
+    p->dirent = dirent;
+    p->dir = dir;
+    p->first = first;
+    p->last = last;
+    p->length = length;
+    p->at = at;
+    p->size = size;
+    pthread_mutex_unlock(&ck.problem_lock);
+}
+
+/* Whether cluster shows up in the first length clusters of a chain */
+int chain_contains(unsigned int first, unsigned int length, unsigned int cluster) {
+    for (unsigned int c = first; length > 0; length--, c = fat_entry(c)) {
+        if (c == cluster) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Follow a chain, claiming every cluster on it.  The walk stops at the
+ * first bad link, loop or cluster some other chain has claimed, which is
+ * recorded as a problem together with the last good cluster.
+ *
+ * @param   chain       If not NULL, set to the clusters walked (for directories)
+ *
+ * @return  Number of good clusters in the chain
+ */
+unsigned int walk_chain(const char *path, off_t dirent, int dir, unsigned int first, uint32_t size, unsigned int **chain) {
+    unsigned int length = 0, cap = 0, prev = 0;
+    unsigned int c = first;
+    int problem = -1;
+
+    if (chain) *chain = NULL;
+    if (first == 0) {
+        if (!dir && size > 0) add_problem(PROB_SIZE_SHORT, path, dirent, dir, 0, 0, 0, 0, size);
+        return 0;
+    }
+
+    while (1) {
+        if (c < 2 || c >= ck.n_entries || fat_entry(c) == 0 || fat_entry(c) == FAT_BAD) {
+            problem = PROB_BADLINK;
+        } else if (claim_cluster(c)) {
+            problem = chain_contains(first, length, c) ? PROB_LOOP : PROB_CROSS;
+        }
+        if (problem != -1) {
+            add_problem(problem, path, dirent, dir, first, prev, length, c, size);
+            break;
+        }
+
+        if (chain) {
+            if (length == cap) {
+                cap = cap ? cap * 2 : 8;
+                *chain = realloc(*chain, cap * sizeof(unsigned int));
+            }
+            (*chain)[length] = c;
+        }
+        length++;
+
+        unsigned int next = fat_entry(c);
+        if (next > FAT_BAD) break;
+        prev = c;
+        c = next;
+    }
+
+    if (problem == -1 && !dir) {
+        unsigned int needed = ((uint64_t)size + ck.cluster_size - 1) / ck.cluster_size;
+        if (length > needed) {
+            add_problem(PROB_SIZE_LONG, path, dirent, dir, first, c, length, 0, size);
+        } else if (length < needed) {
+            add_problem(PROB_SIZE_SHORT, path, dirent, dir, first, c, length, 0, size);
+        }
+    }
+    return length;
+}
+
+/* Device offset of the cluster at a chain index of a directory */
+off_t dir_cluster_offset(fsck_job_t *job, unsigned int index) {
+    if (job->chain == NULL) {
+        return ((off_t)ck.fat.root_sect * ck.fat.bs->bytes_per_sector) + ((off_t)index * ck.cluster_size);
+    }
+    return cluster_offset(job->chain[index]);
+}
+
+/* Read every entry of a directory, walking file chains and queueing subdirectories */
+void check_dir(int id, fsck_job_t *job, unsigned char **buff, size_t *cap) {
+    /* The fixed root ends where its entries do, which may be part way into its last cluster */
+    size_t bytes = (job->chain == NULL) ? (size_t)ck.fat.bs->root_entry_count * 32 : (size_t)job->n_chain * ck.cluster_size;
+    if (bytes > *cap) {
+        *cap = bytes;
+        *buff = realloc(*buff, bytes);
+    }
+    for (unsigned int i = 0; i < job->n_chain; i++) {
+        size_t off = (size_t)i * ck.cluster_size;
+        size_t len = (bytes - off < ck.cluster_size) ? bytes - off : ck.cluster_size;
+        if (read_full(dir_cluster_offset(job, i), *buff + off, len) != 0) memset(*buff + off, 0, len);
+    }
+    __sync_fetch_and_add(&ck.n_dirs, 1);
+
+    unsigned int spc = ck.cluster_size / 32;
+    unsigned int n_slots = bytes / 32;
+    char name[256];
+
+    for (unsigned int slot = 0; slot < n_slots; slot++) {
+        unsigned char *b = *buff + (slot * 32);
+        if (b[0] == 0x00) break;
+        if (b[0] == 0xE5) continue;
+
+        name[0] = '\0';
+        if (b[11] == 0x0F) {
+            int seq = b[0] & 0x1F;
+            if ((b[0] & 0x40) != 0x40 || seq == 0 || slot + seq >= n_slots) continue;   /* Orphaned LFN */
+
+            int off = 0;
+            process_long_entry(b, &off, name, sizeof(name));
+
+            slot += off;
+            b = *buff + (slot * 32);
+            if (b[0] == 0x00) break;
+            if (b[0] == 0xE5 || b[11] == 0x0F) { slot--; continue; }
+        }
+
+        fat_direntry_t *ent = (fat_direntry_t*)b;
+        if (ent->attributes & 0x08) continue;           /* Volume label */
+        if (b[0] == 0x2E) continue;                     /* . and .. */
+        if (name[0] == '\0') format_short_name(b, name);
+
+        char *path = calloc(strlen(job->path) + strlen(name) + 2, sizeof(char));
+        sprintf(path, "%s/%s", job->path, name);
+        off_t dirent = dir_cluster_offset(job, slot / spc) + ((slot % spc) * 32);
+        unsigned int first = (ent->high_clu << 16) | ent->low_clu;
+
+        if (ent->attributes & 0x10) {
+            unsigned int *chain;
+            unsigned int n = walk_chain(path, dirent, 1, first, ent->size, &chain);
+            if (n > 0) {
+                push_job(id, path, chain, n);
+                continue;
+            }
+        } else {
+            walk_chain(path, dirent, 0, first, ent->size, NULL);
+            __sync_fetch_and_add(&ck.n_files, 1);
+            if (job->path[0] == '\0' && strcmp(name, FAT_LOG_NAME) == 0) {
+                ck.log_first = first;
+                ck.log_size = ent->size;
+            }
+        }
+        free(path);
+    }
+}
+
+void *fsck_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned char *buff = NULL;
+    size_t cap = 0;
+    fsck_job_t job;
+
+    while (1) {
+        if (pop_job(id, &job) || steal_job(id, &job)) {
+            check_dir(id, &job, &buff, &cap);
+            free(job.path);
+            free(job.chain);
+            __sync_fetch_and_sub(&ck.pending, 1);
+        } else if (__sync_fetch_and_add(&ck.pending, 0) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    free(buff);
+    return NULL;
+}
+
+/*********** Repairs ***************/
+
+void update_dirent(off_t offset, int remove, int clear_cluster, int set_size, uint32_t size) {
+    fat_direntry_t ent;
+    if (read_full(offset, &ent, sizeof(ent)) != 0) return;
+    if (remove) ent.name[0] = 0xE5;
+    if (clear_cluster) { ent.high_clu = 0; ent.low_clu = 0; }
+    if (set_size) ent.size = size;
+    pwrite(ck.device, &ent, sizeof(ent), offset);
+}
+
+/*
+ * Let go of a chain this check walked without trouble, starting at
+ * cluster.  Its entries are left alone here, the sweep of unowned
+ * clusters after the repairs frees whatever nothing took back.
+ */
+void release_chain(unsigned int cluster) {
+    while (cluster >= 2 && cluster < ck.n_entries && is_owned(cluster)) {
+        ck.owned[cluster / 32] &= ~(1u << (cluster % 32));
+        unsigned int next = fat_entry(cluster);
+        if (next > FAT_BAD) break;
+        cluster = next;
+    }
+}
+
+/*
+ * Claim the rest of a cross-linked chain if nothing owns it any more and
+ * it reaches an end of chain with the clusters the file size calls for
+ *
+ * @return  1 if the chain was taken back whole
+ */
+int reclaim_chain(fsck_problem_t *p) {
+    unsigned int length = p->length;
+    unsigned int c = p->at;
+    
+    while (1) {
+        if (c < 2 || c >= ck.n_entries || fat_entry(c) == 0 || fat_entry(c) == FAT_BAD || claim_cluster(c)) break;
+        length++;
+        unsigned int next = fat_entry(c);
+        if (next > FAT_BAD) {
+            if (p->dir || length == ((uint64_t)p->size + ck.cluster_size - 1) / ck.cluster_size) return 1;
+            break;
+        }
+        c = next;
+    }
+    
+    /* Give back what was claimed so the chain can be cut at the original spot */
+    for (unsigned int r = p->at; length > p->length; length--, r = fat_entry(r)) {
+        ck.owned[r / 32] &= ~(1u << (r % 32));
+    }
+    return 0;
+}
+
+/*
+ * Repair one problem
+ *
+ * @return  1 if it was repaired, 0 if it has to be left alone
+ */
+int repair_problem(fsck_problem_t *p) {
+    uint32_t fits = p->length * ck.cluster_size;
+
+    switch (p->type) {
+        case PROB_CROSS:
+            /* Other repairs may have released the rest of the chain, then it can stay */
+            if (p->last != 0 && reclaim_chain(p)) return 1;
+        case PROB_BADLINK:
+        case PROB_LOOP:
+            if (p->last == 0) {
+                /* Nothing of the chain is usable */
+                if (p->dirent < 0) return 0;
+                if (p->dir) update_dirent(p->dirent, 1, 0, 0, 0);
+                else update_dirent(p->dirent, 0, 1, 1, 0);
+                return 1;
+            }
+            set_entry(p->last, FAT_EOC);
+            if (!p->dir && p->size > fits) update_dirent(p->dirent, 0, 0, 1, fits);
+            return 1;
+        case PROB_SIZE_LONG: {
+            unsigned int needed = ((uint64_t)p->size + ck.cluster_size - 1) / ck.cluster_size;
+            if (needed == 0) {
+                update_dirent(p->dirent, 0, 1, 0, 0);
+                release_chain(p->first);
+                return 1;
+            }
+            unsigned int c = p->first;
+            for (unsigned int i = 1; i < needed; i++) c = fat_entry(c);
+            unsigned int tail = fat_entry(c);
+            set_entry(c, FAT_EOC);
+            release_chain(tail);
+            return 1;
+        }
+        case PROB_SIZE_SHORT:
+            update_dirent(p->dirent, 0, 0, 1, fits);
+            return 1;
+    }
+    return 0;
+}
+
+/* Write every dirty FAT sector back to all copies of the table */
+void write_fat(void) {
+    unsigned int bps = ck.fat.bs->bytes_per_sector;
+    for (unsigned int s = 0; s < (unsigned int)ck.fat.table_size; s++) {
+        if (!ck.dirty[s]) continue;
+        for (int t = 0; t < ck.fat.bs->table_count; t++) {
+            off_t loc = ((off_t)ck.fat.bs->reserved_sector_count + ((off_t)t * ck.fat.table_size) + s) * bps;
+            pwrite(ck.device, ck.raw + ((size_t)s * bps), bps, loc);
+        }
+    }
+}
+
+/*********** Main ***************/
+
+int compare_problems(const void *a, const void *b) {
+    return strcmp(((const fsck_problem_t*)a)->path, ((const fsck_problem_t*)b)->path);
+}
+
+void print_problem(fsck_problem_t *p) {
+    switch (p->type) {
+        case PROB_BADLINK:
+            printf("%s: chain runs into invalid cluster %u after %u clusters\n", p->path, p->at, p->length);
+            break;
+        case PROB_CROSS:
+            printf("%s: cross-linked at cluster %u\n", p->path, p->at);
+            break;
+        case PROB_LOOP:
+            printf("%s: chain loops back to cluster %u\n", p->path, p->at);
+            break;
+        case PROB_SIZE_LONG:
+        case PROB_SIZE_SHORT:
+            printf("%s: size %u needs %u clusters, chain has %u\n", p->path, p->size,
+                   (unsigned int)(((uint64_t)p->size + ck.cluster_size - 1) / ck.cluster_size), p->length);
+            break;
+    }
+}
+
+int main(int argc, char **argv) {
+    int repair = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int i;
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - 1) {
+            threads = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        printf("usage: fsck [-r] [-j threads] device\n");
+        exit(FSCK_ERROR);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+
+    if (load_volume(argv[argc - 1], repair) != 0) exit(FSCK_ERROR);
+
+    /* Walk the root here, the workers take it from the first queue */
+    ck.n_threads = threads;
+    pthread_mutex_init(&ck.problem_lock, NULL);
+    for (int t = 0; t < threads; t++) pthread_mutex_init(&(ck.queues[t].lock), NULL);
+
+    /* The FAT12/16 root is a fixed region with no chain to walk */
+    unsigned int root = ck.fat.root_cluster;
+    unsigned int *chain = NULL;
+    unsigned int n = ((ck.fat.bs->root_entry_count * 32) + ck.cluster_size - 1) / ck.cluster_size;
+    if (root != FAT_FIXED_ROOT) n = walk_chain("", -1, 1, root, 0, &chain);
+    if (n == 0) {
+        printf("fsck: root directory cluster %u is invalid\n", root);
+        exit(FSCK_UNCORRECTED);
+    }
+    char *root_path = calloc(1, sizeof(char));
+    push_job(0, root_path, chain, n);
+
+    pthread_t tids[FSCK_MAX_THREADS];
+    for (int t = 0; t < threads; t++) pthread_create(&tids[t], NULL, fsck_worker, (void*)(intptr_t)t);
+    for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+
+    /* Report what the walk found, in path order so runs can be compared */
+    qsort(ck.problems, ck.n_problems, sizeof(fsck_problem_t), compare_problems);
+    for (int p = 0; p < ck.n_problems; p++) print_problem(&(ck.problems[p]));
+
+    /* Lost clusters, and chain heads among them: ones no other lost cluster points to */
+    unsigned int lost = 0, lost_chains = 0;
+    unsigned int *referenced = calloc((ck.n_entries + 31) / 32, sizeof(unsigned int));
+    for (unsigned int c = 2; c < ck.n_entries; c++) {
+        unsigned int v = fat_entry(c);
+        if (v == 0 || v == FAT_BAD || is_owned(c)) continue;
+        lost++;
+        if (v < ck.n_entries) referenced[v / 32] |= 1u << (v % 32);
+    }
+    for (unsigned int c = 2; c < ck.n_entries && lost; c++) {
+        unsigned int v = fat_entry(c);
+        if (v == 0 || v == FAT_BAD || is_owned(c)) continue;
+        if (!((referenced[c / 32] >> (c % 32)) & 1)) lost_chains++;
+    }
+    free(referenced);
+    if (lost) printf("%u lost clusters in %u chains\n", lost, lost_chains);
+
+    unsigned int mirrors = compare_mirrors();
+    if (mirrors) printf("%u FAT sectors differ between copies\n", mirrors);
+
+    /* Records a mount would replay put the FAT and directories on disk behind the log, repairs would fight them */
+    int logged = (ck.log_first >= 2) ? fat_log_pending(ck.device, cluster_offset(ck.log_first), ck.log_size) : 0;
+    if (logged) printf("Intent log holds %d committed records, mount the volume to replay them first\n", logged);
+
+    int unfixed = 0;
+    if (repair && !logged) {
+        /* Cross-links last, so they can take back clusters the other repairs released */
+        for (int pass = 0; pass < 2; pass++) {
+            for (int p = 0; p < ck.n_problems; p++) {
+                if ((ck.problems[p].type == PROB_CROSS) != pass) continue;
+                if (!repair_problem(&(ck.problems[p]))) unfixed++;
+            }
+        }
+        for (unsigned int c = 2; c < ck.n_entries; c++) {
+            unsigned int v = fat_entry(c);
+            if (v != 0 && v != FAT_BAD && !is_owned(c)) set_entry(c, 0);
+        }
+        write_fat();
+    }
+
+    /* The free count is only a hint, 0xFFFFFFFF means it was never computed */
+    unsigned int n_free = 0;
+    for (unsigned int c = 2; c < ck.n_entries; c++) {
+        if (fat_entry(c) == 0) n_free++;
+    }
+    int fsinfo_off = ck.fat.info->num_free_clusters != 0xFFFFFFFF && ck.fat.info->num_free_clusters != n_free;
+    if (fsinfo_off) {
+        printf("FSInfo free count %u, actual %u\n", ck.fat.info->num_free_clusters, n_free);
+        if (repair && !logged) {
+            off_t loc = ((off_t)((fat_extBS_32_t*)ck.fat.bs->extended_section)->fat_info * ck.fat.bs->bytes_per_sector) + 488;
+            pwrite(ck.device, &n_free, sizeof(n_free), loc);
+        }
+    }
+
+    printf("%u files, %u directories, %u/%u clusters used\n", ck.n_files, ck.n_dirs,
+           (ck.n_entries - 2) - n_free, ck.n_entries - 2);
+
+    int found = ck.n_problems + (lost > 0) + (mirrors > 0) + fsinfo_off + (logged > 0);
+    if (repair && logged) unfixed = found;
+    if (repair && found) printf("%d problems repaired, %d left\n", found - unfixed, unfixed);
+    close(ck.device);
+
+    if (found == 0) return FSCK_OK;
+    if (!repair || unfixed) return FSCK_UNCORRECTED;
+    return FSCK_CORRECTED;
+}
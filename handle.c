@@ -0,0 +1,89 @@
+/*
+ * @file: handle.c
+ *
+ * Growable handle tables with a free list and generation tags
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle.h"
+
+/*
+ * Make sure pages and slot bookkeeping exist up to index
+ */
+static int handle_grow(handle_table_t *table, int index) {
+    int page = index >> HANDLE_PAGE_BITS;
+    if (page < table->n_pages) { return 0; }
+
+    int n_pages = table->n_pages ? table->n_pages : 1;
+    while (n_pages <= page) n_pages *= 2;
+
+    unsigned char **pages = realloc(table->pages, n_pages * sizeof(unsigned char*));
+    if (pages == NULL) { return -1; }
+    table->pages = pages;
+
+    uint16_t *gens = realloc(table->gens, (size_t)n_pages * HANDLE_PAGE_SIZE * sizeof(uint16_t));
+    if (gens == NULL) { return -1; }
+    table->gens = gens;
+
+    int *next_free = realloc(table->next_free, (size_t)n_pages * HANDLE_PAGE_SIZE * sizeof(int));
+    if (next_free == NULL) { return -1; }
+    table->next_free = next_free;
+
+    for (int i = table->n_pages; i < n_pages; i++) table->pages[i] = NULL;
+    memset(table->gens + (size_t)table->n_pages * HANDLE_PAGE_SIZE, 0, (size_t)(n_pages - table->n_pages) * HANDLE_PAGE_SIZE * sizeof(uint16_t));
+    table->n_pages = n_pages;
+    return 0;
+}
+
+void *handle_slot(handle_table_t *table, int index) {
+    if (index < 0 || index >= HANDLE_LIMIT) { return NULL; }
+    if (handle_grow(table, index) < 0) { return NULL; }
+
+    int page = index >> HANDLE_PAGE_BITS;
+    if (table->pages[page] == NULL) {
+        table->pages[page] = calloc(HANDLE_PAGE_SIZE, table->entry_size);
+        if (table->pages[page] == NULL) { return NULL; }
+    }
+    return table->pages[page] + (size_t)(index & (HANDLE_PAGE_SIZE - 1)) * table->entry_size;
+}
+
+int handle_alloc(handle_table_t *table) {
+    int index = table->free_head;
+    if (index == -1) {
+        /* Nothing to reuse, hand out a slot never used before */
+        if (table->n_slots >= HANDLE_LIMIT) { return -1; }
+        index = table->n_slots;
+        if (handle_slot(table, index) == NULL) { return -1; }
+        table->n_slots++;
+    } else {
+        table->free_head = table->next_free[index];
+    }
+    table->next_free[index] = HANDLE_IN_USE;
+
+    memset(handle_slot(table, index), 0, table->entry_size);
+    return (table->gens[index] << HANDLE_INDEX_BITS) | index;
+}
+
+void handle_free(handle_table_t *table, int handle) {
+    if (handle_get(table, handle) == NULL) { return; }
+    int index = HANDLE_INDEX(handle);
+
+    table->gens[index] = (table->gens[index] + 1) & HANDLE_GEN_MASK;
+    table->next_free[index] = table->free_head;
+    table->free_head = index;
+}
+
+void *handle_get(handle_table_t *table, int handle) {
+    if (handle < 0) { return NULL; }
+    int index = HANDLE_INDEX(handle);
+    if (index >= table->n_slots || table->next_free[index] != HANDLE_IN_USE) { return NULL; }
+    if (table->gens[index] != (handle >> HANDLE_INDEX_BITS)) { return NULL; }
+
+    return table->pages[index >> HANDLE_PAGE_BITS] + (size_t)(index & (HANDLE_PAGE_SIZE - 1)) * table->entry_size;
+}
+
+int handle_in_use(handle_table_t *table, int index) {
+    return index >= 0 && index < table->n_slots && table->next_free[index] == HANDLE_IN_USE;
+}
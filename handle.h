@@ -0,0 +1,78 @@
+/*
+ * @file: handle.h
+ *
+ * Growable tables of open file and directory handles.  Entries live in
+ * fixed size pages that never move, free slots are kept on a list so
+ * opens and closes take constant time, and each handle carries the
+ * generation of its slot so one used after it was closed is caught.
+ */
+
+#ifndef HANDLE_XINU_HEADER
+#define HANDLE_XINU_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Entries per page of a table */
+#define HANDLE_PAGE_BITS    10
+#define HANDLE_PAGE_SIZE    (1 << HANDLE_PAGE_BITS)
+
+/* Low bits of a handle are the slot, the bits above them its generation */
+#define HANDLE_INDEX_BITS   20
+#define HANDLE_LIMIT        (1 << HANDLE_INDEX_BITS)    /* Most handles open at once */
+#define HANDLE_GEN_MASK     0x7FF                       /* Keeps handles positive */
+#define HANDLE_INDEX(h)     ((h) & (HANDLE_LIMIT - 1))
+
+/* next_free value of a slot that is in use */
+#define HANDLE_IN_USE       -2
+
+typedef struct handle_table_s {
+    size_t          entry_size;
+    unsigned char   **pages;            /* HANDLE_PAGE_SIZE entries each, made as needed */
+    int             n_pages;
+    uint16_t        *gens;              /* Generation of each slot, bumped as it is freed */
+    int             *next_free;         /* Next slot on the free list, or HANDLE_IN_USE */
+    int             free_head;          /* First free slot, -1 when none is free */
+    int             n_slots;            /* Slots handed out so far */
+} handle_table_t;
+
+/* Initializer for a table of entries of the given type */
+#define HANDLE_TABLE_INIT(type)     { sizeof(type), NULL, 0, NULL, NULL, -1, 0 }
+
+/*
+ * Take a free slot and zero its entry
+ *
+ * @param   table       Table to take it from
+ *
+ * @return  -1 if the table is full, else the handle of the slot
+ */
+int handle_alloc(handle_table_t *table);
+
+/*
+ * Return a slot to the free list.  Its generation moves on, so the
+ * handle given stops working.
+ */
+void handle_free(handle_table_t *table, int handle);
+
+/*
+ * Entry a handle refers to
+ *
+ * @return  NULL if the handle is not open, else its entry
+ */
+void *handle_get(handle_table_t *table, int handle);
+
+/*
+ * Entry at a slot index, whether or not it is in use.  Pages up to it
+ * are made if they do not exist yet, so tables kept alongside another
+ * one can be indexed the same way.
+ *
+ * @return  NULL if out of memory, else the entry
+ */
+void *handle_slot(handle_table_t *table, int index);
+
+/*
+ * Whether the slot at an index holds an open handle
+ */
+int handle_in_use(handle_table_t *table, int index);
+
+#endif
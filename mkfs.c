@@ -6,20 +6,52 @@
  * Utility to create FAT file systems
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "fat32.h"
 
+/* Sectors zeroed per write when a block device has to be cleared */
+#define ZERO_CHUNK_SECTORS 32
+
+/* Bytes copied per read when populating an image from the host */
+#define COPY_CHUNK (1024 * 1024)
+
 typedef struct cmd_options {
     unsigned int sector_size;            /* In Bytes */
     unsigned int clusters;               /* In clusters_per_sector */
     unsigned long long size;             /* In Bytes */
     char *device;
     unsigned char *label;                         /* Volume Label */
+    char *source;                        /* Host directory to copy in, or NULL */
 } cmd_options_t;
 
+/* A file or directory laid out in the image, kept in breadth-first order */
+typedef struct host_node {
+    char                *path;          /* Path on the host, NULL for an empty root */
+    char                *name;          /* Long name inside the image */
+    int                 dir;
+    uint32_t            size;           /* Bytes of file data */
+    int                 parent;         /* Index of the parent directory */
+    int                 first_child;    /* Children are stored next to each other */
+    int                 n_children;
+    uint32_t            cluster;        /* First cluster of the extent, 0 if none */
+    uint32_t            n_clusters;
+} host_node_t;
+
+typedef struct host_tree {
+    host_node_t         *nodes;
+    int                 count;
+    int                 cap;
+} host_tree_t;
+
 /* Code to display a not-bootable partition message */
 unsigned char bootcode[420] = {0x0E, 0x1F, 0xBE, 0x77, 0x7C, 0xAC, 0x22, 0xC0, 0x74, 0x0B, 0x56, 0xB4,
     0x0E, 0xBB, 0x07, 0x00, 0xCD, 0x10, 0x5E, 0xEB, 0xF0, 0x32, 0xE4, 0xCD, 0x16, 0xCD, 0x19,
@@ -34,89 +66,330 @@ unsigned char bootcode[420] = {0x0E, 0x1F, 0xBE, 0x77, 0x7C, 0xAC, 0x22, 0xC0, 0
 unsigned char bootsig[2] = {0x55, 0xAA};
 unsigned char no_name[11] = {'N', 'O', ' ', 'N', 'A', 'M', 'E', ' ', ' ', ' ', ' '};
 
-void create_file(char *fname, uint64_t size) {
-    FILE *fp = fopen(fname, "w");
-    if (fp == NULL) {
+/*
+ * Open the target and size it.  A regular file is emptied and extended
+ * with ftruncate, so every region mkfs does not write stays a hole and
+ * reads back as zeros.
+ *
+ * @return  Open descriptor, with *sparse set if the target is a regular file
+ */
+int create_file(char *fname, uint64_t size, int *sparse) {
+    int fd = open(fname, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error Creating Device\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    *sparse = S_ISREG(st.st_mode);
+    if (*sparse && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
         printf("Error Creating Device\n");
         exit(EXIT_FAILURE);
-    } 
-    fseek(fp, size, SEEK_SET);
-    fwrite("", 1, 1, fp);
-    fclose(fp);
+    }
+    return fd;
 }
 
-void write_bs_to_file(char *fname, int offset, fat_BS_t *boot) {
-    
-    /* Create FILE-based FAT instead of Disk-based */
-    FILE *fp = fopen(fname, "r+");
-    if (fp == NULL) {
-        printf("[FAT32]: Error Opening Device -> Write BS\n");
+void write_at(int fd, off_t offset, const void *buff, size_t len) {
+    if (lseek(fd, offset, SEEK_SET) < 0 || write(fd, buff, len) != (ssize_t)len) {
+        perror("[FAT32]: Error Writing Device");
         exit(EXIT_FAILURE);
-    } 
-    fseek(fp, offset, SEEK_SET);
-        
-    fwrite(boot, sizeof(*boot), 1, fp);
-    fwrite(bootcode, sizeof(bootcode), 1, fp);
-    fwrite(bootsig, sizeof(bootsig), 1, fp);
-    
-    fclose(fp);
+    }
+}
+
+/* Zero a range of a device, one small chunk at a time */
+void zero_range(int fd, off_t offset, uint64_t len, const unsigned char *zeros, size_t zlen) {
+    while (len > 0) {
+        size_t amt = len < zlen ? len : zlen;
+        write_at(fd, offset, zeros, amt);
+        offset += amt;
+        len -= amt;
+    }
 }
 
-void write_fsinfo_to_file(char *fname, int offset, fat_fsinfo_t *fsinfo) {
-    /* Create FILE-based FAT instead of Disk-based */
+void write_bs_to_file(int fd, off_t offset, fat_BS_t *boot) {
+    unsigned char sector[512] = {0x00};
+    
+    memcpy(sector, boot, sizeof(*boot));
+    memcpy(sector + sizeof(*boot), bootcode, sizeof(bootcode));
+    memcpy(sector + 510, bootsig, sizeof(bootsig));
     
+    write_at(fd, offset, sector, sizeof(sector));
+}
+
+void write_fsinfo_to_file(int fd, off_t offset, fat_fsinfo_t *fsinfo) {
+    unsigned char sector[512] = {0x00};
     unsigned char sig1[4] = {0x52, 0x52, 0x61, 0x41};
-    unsigned char reserved_0[480] = {0x00};
     unsigned char sig2[4] = {0x72, 0x72, 0x41, 0x61};
-    unsigned char reserved_1[12] = {0x00};
     unsigned char sig3[4] = {0x00, 0x00, 0x55, 0xAA};
     
-    FILE *fp = fopen(fname, "r+");
-    if (fp == NULL) {
-       printf("[FAT32]: Error Opening Device -> Write FSInfo\n");
-        exit(EXIT_FAILURE);
-    } 
+    memcpy(sector, sig1, sizeof(sig1));
+    memcpy(sector + 484, sig2, sizeof(sig2));
+    memcpy(sector + 488, &(fsinfo->num_free_clusters), sizeof(unsigned int));
+    memcpy(sector + 492, &(fsinfo->last_alloc), sizeof(unsigned int));
+    memcpy(sector + 508, sig3, sizeof(sig3));
     
-    fseek(fp, offset, SEEK_SET);
+    write_at(fd, offset, sector, sizeof(sector));
+}
+
+int add_node(host_tree_t *tree, char *path, char *name, int dir, uint32_t size, int parent) {
+    if (tree->count == tree->cap) {
+        tree->cap = tree->cap ? tree->cap * 2 : 64;
+        tree->nodes = realloc(tree->nodes, tree->cap * sizeof(host_node_t));
+    }
+    host_node_t *node = &(tree->nodes[tree->count]);
+    node->path = path;
+    node->name = name;
+    node->dir = dir;
+    node->size = size;
+    node->parent = parent;
+    node->first_child = 0;
+    node->n_children = 0;
+    node->cluster = 0;
+    node->n_clusters = 0;
+    return tree->count++;
+}
+
+int skip_dots(const struct dirent *ent) {
+    return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+/*
+ * Read a host directory tree breadth first.  The node array doubles as
+ * the queue, so every directory's children end up next to each other and
+ * each level of the tree follows the one above it.
+ *
+ * @param   tree        Tree to fill, its root node must already be added
+ */
+void scan_host_tree(host_tree_t *tree) {
+    for (int i = 0; i < tree->count; i++) {
+        if (!tree->nodes[i].dir || tree->nodes[i].path == NULL) continue;
+        
+        struct dirent **list;
+        int n = scandir(tree->nodes[i].path, &list, skip_dots, alphasort);
+        if (n < 0) {
+            printf("mkfs: cannot read %s\n", tree->nodes[i].path);
+            exit(EXIT_FAILURE);
+        }
+        
+        tree->nodes[i].first_child = tree->count;
+        for (int j = 0; j < n; j++) {
+            char *path = calloc(strlen(tree->nodes[i].path) + strlen(list[j]->d_name) + 2, sizeof(char));
+            sprintf(path, "%s/%s", tree->nodes[i].path, list[j]->d_name);
+            
+            struct stat st;
+            if (stat(path, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+                free(path);
+            } else if (strlen(list[j]->d_name) > 255 || (S_ISREG(st.st_mode) && st.st_size > 0xFFFFFFFF)) {
+                printf("mkfs: skipping %s, too large for FAT32\n", path);
+                free(path);
+            } else {
+                char *name = calloc(strlen(list[j]->d_name) + 1, sizeof(char));
+                strcpy(name, list[j]->d_name);
+                add_node(tree, path, name, S_ISDIR(st.st_mode), S_ISREG(st.st_mode) ? st.st_size : 0, i);
+                tree->nodes[i].n_children++;
+            }
+            free(list[j]);
+        }
+        free(list);
+    }
+}
+
+/*
+ * Size every directory from the entries it will hold, then hand out
+ * clusters in tree order so each file and directory is one contiguous
+ * extent.  On FAT32 the root directory starts at cluster 2, on FAT12/16
+ * it has a fixed region of its own and takes no clusters.
+ *
+ * @param   root_entries    Slots in the fixed root region, 0 on FAT32
+ *
+ * @return  One past the last cluster used
+ */
+uint32_t layout_host_tree(host_tree_t *tree, uint32_t cluster_size, uint32_t root_entries) {
+    uint32_t next = 2;
+    for (int i = 0; i < tree->count; i++) {
+        host_node_t *node = &(tree->nodes[i]);
+        uint64_t bytes = node->size;
+        if (node->dir) {
+            /* Root holds the volume label, every other directory . and .. */
+            uint64_t slots = (i == 0) ? 1 : 2;
+            for (int c = 0; c < node->n_children; c++) {
+                slots += dir_entry_slots(tree->nodes[node->first_child + c].name);
+            }
+            bytes = slots * 32;
+            if (i == 0 && root_entries > 0) {
+                if (slots > root_entries) {
+                    printf("mkfs: %s needs %llu root entries, the root only has %u\n",
+                           node->path, (unsigned long long)slots, root_entries);
+                    exit(EXIT_FAILURE);
+                }
+                continue;
+            }
+        }
+        node->n_clusters = (bytes + cluster_size - 1) / cluster_size;
+        if (node->n_clusters > 0) {
+            node->cluster = next;
+            next += node->n_clusters;
+        }
+    }
+    return next;
+}
+
+/*
+ * Write the FAT windows covering clusters 0 up to end to every table
+ * copy.  Since each extent is contiguous, a chain is just a count up to
+ * an end of chain marker.
+ *
+ * @param   table_size  Sectors in each copy of the FAT
+ * @param   codec       Entry format of the FAT
+ *
+ * @return  Number of FAT sectors written per copy
+ */
+uint32_t write_fat_extents(int fd, fat_BS_t *boot, uint32_t table_size, const fat_codec_t *codec, host_tree_t *tree, uint32_t end) {
+    uint32_t bps = boot->bytes_per_sector;
+    uint32_t window = codec->window * bps;
+    uint32_t per_window = (window * 8) / codec->bits;
+    uint32_t n_windows = (end + per_window - 1) / per_window;
+    unsigned char *entries = malloc(window);
+    uint32_t written = 0;
+    int node = 0;
     
-    fwrite(sig1, sizeof(sig1), 1, fp);
-    fwrite(reserved_0, sizeof(reserved_0), 1, fp);
-    fwrite(sig2, sizeof(sig2), 1, fp);
-    fwrite(&(fsinfo->num_free_clusters), sizeof(unsigned int), 1, fp);
-    fwrite(&(fsinfo->last_alloc), sizeof(unsigned int), 1, fp);
-    fwrite(reserved_1, sizeof(reserved_1), 1, fp);
-    fwrite(sig3, sizeof(sig2), 1, fp);
+    for (uint32_t w = 0; w < n_windows; w++) {
+        memset(entries, 0, window);
+        for (uint32_t i = 0; i < per_window; i++) {
+            uint32_t cluster = w * per_window + i;
+            while (node < tree->count && (tree->nodes[node].n_clusters == 0 ||
+                   cluster >= tree->nodes[node].cluster + tree->nodes[node].n_clusters)) node++;
+            
+            if (cluster == 0) {
+                codec->set(entries, i, 0x0FFFFF00 | boot->media_type);
+            } else if (cluster == 1) {
+                codec->set(entries, i, codec->eoc);
+            } else if (node < tree->count && cluster >= tree->nodes[node].cluster) {
+                host_node_t *n = &(tree->nodes[node]);
+                codec->set(entries, i, (cluster + 1 < n->cluster + n->n_clusters) ? cluster + 1 : codec->eoc);
+            }
+        }
+        
+        /* The last FAT12 window can run past the end of the table */
+        uint32_t sectors = table_size - (w * codec->window);
+        if (sectors > codec->window) sectors = codec->window;
+        for (int t = 0; t < boot->table_count; t++) {
+            write_at(fd, ((off_t)boot->reserved_sector_count + (t * table_size) + (w * codec->window)) * bps, entries, sectors * bps);
+        }
+        written += sectors;
+    }
+    free(entries);
+    return written;
+}
+
+void init_dot_entry(fat_direntry_t *dirent, const char *name, uint32_t cluster) {
+    memset(dirent, 0, sizeof(fat_direntry_t));
+    memset(dirent->name, ' ', 11);
+    memcpy(dirent->name, name, strlen(name));
+    dirent->attributes = 0x10;
+    dirent->high_clu = (cluster & 0xFFFF0000) >> 16;
+    dirent->low_clu = (cluster & 0x0000FFFF);
+}
+
+/*
+ * Write every directory and copy every file into its extent, in cluster
+ * order so the device is written front to back
+ *
+ * @param   rootsect    First sector of the fixed FAT12/16 root region
+ * @param   label       Volume label entry placed first in the root
+ */
+void write_host_tree(int fd, fat_BS_t *boot, uint32_t rootsect, uint32_t datasect, host_tree_t *tree, fat_direntry_t *label) {
+    uint32_t bps = boot->bytes_per_sector;
+    uint32_t cluster_size = bps * boot->sectors_per_cluster;
+    unsigned char *buff = malloc(COPY_CHUNK);
     
-    fclose(fp);
+    for (int i = 0; i < tree->count; i++) {
+        host_node_t *node = &(tree->nodes[i]);
+        off_t loc = ((off_t)datasect * bps) + ((off_t)(node->cluster - 2) * cluster_size);
+        size_t bytes = (size_t)node->n_clusters * cluster_size;
+        if (i == 0 && boot->root_entry_count > 0) {
+            loc = (off_t)rootsect * bps;
+            bytes = boot->root_entry_count * 32;
+        }
+        if (bytes == 0) continue;
+        
+        if (node->dir) {
+            unsigned char *entries = calloc(1, bytes);
+            int slot = 0;
+            if (i == 0) {
+                memcpy(entries, label, 32);
+                slot = 1;
+            } else {
+                /* .. of a directory in the root points at cluster 0 */
+                init_dot_entry((fat_direntry_t*)entries, ".", node->cluster);
+                init_dot_entry((fat_direntry_t*)(entries + 32), "..", node->parent == 0 ? 0 : tree->nodes[node->parent].cluster);
+                slot = 2;
+            }
+            for (int c = 0; c < node->n_children; c++) {
+                host_node_t *child = &(tree->nodes[node->first_child + c]);
+                fat_direntry_t dirent;
+                init_direntry(&dirent, child->name, child->cluster, child->size);
+                if (child->dir) dirent.attributes = 0x10;
+                slot += build_dir_entries(child->name, &dirent, entries + (slot * 32));
+            }
+            write_at(fd, loc, entries, bytes);
+            free(entries);
+        } else {
+            int src = open(node->path, O_RDONLY);
+            if (src < 0) {
+                printf("mkfs: cannot read %s\n", node->path);
+                exit(EXIT_FAILURE);
+            }
+            uint32_t left = node->size;
+            ssize_t rd;
+            while (left > 0 && (rd = read(src, buff, left < COPY_CHUNK ? left : COPY_CHUNK)) > 0) {
+                write_at(fd, loc, buff, rd);
+                loc += rd;
+                left -= rd;
+            }
+            close(src);
+        }
+    }
+    free(buff);
 }
 
 /* Parse the Size of the FS given on the command line */
-unsigned long parse_size(char *size) {
+unsigned long long parse_size(char *size) {
     unsigned long long sz = 0;
     int len = strlen(size);
     switch (size[len-1]) {
         case 'K':
             size[len-1] = '\0';
-            sz = atol(size) * 1024;
+            sz = atoll(size) * 1024;
             break;
         case 'M':
             size[len-1] = '\0';
-            sz = atol(size) * 1024 * 1024;
+            sz = atoll(size) * 1024 * 1024;
             break;
         case 'G':
             size[len-1] = '\0';
-            sz = atol(size) * 1024 * 1024 * 1024;
+            sz = atoll(size) * 1024 * 1024 * 1024;
             break;            
+        case 'T':
+            size[len-1] = '\0';
+            sz = atoll(size) * 1024 * 1024 * 1024 * 1024;
+            break;
         default:
-            sz = atol(size);
+            sz = atoll(size);
     }
     return sz;
 }
 
 uint8_t get_cluster_size(uint64_t size, uint32_t sector_size, uint8_t fattype) {
     size = size / sector_size;
+    if (size > 0xFFFFFFFF) size = 0xFFFFFFFF;   /* Largest volume FAT32 can describe */
     
-    if (fattype == FAT16) {
+    if (fattype == FAT12) {
+        /* Smallest cluster that keeps the count under the FAT12 limit */
+        uint8_t spc = 1;
+        while (spc < 128 && size / spc >= 4085) spc *= 2;
+        return spc;
+    } else if (fattype == FAT16) {
         for (int i = 0; i< DskTableFAT16_NumEntries; i++) {
             if (size <= DskTableFAT16[i].DiskSize) {
                 return DskTableFAT16[i].SecPerClusVal;
@@ -132,22 +405,25 @@ uint8_t get_cluster_size(uint64_t size, uint32_t sector_size, uint8_t fattype) {
     return 0;
 }
 
-inline uint8_t determine_fat_type(uint64_t size) {
-    /* Less than 512MB -> FAT16, else FAT32 */
+static inline uint8_t determine_fat_type(uint64_t size) {
+    /* Up to the smallest FAT16 volume -> FAT12, less than 512MB -> FAT16, else FAT32 */
+    if (size <= 8400 * 512) return FAT12;
     return (size < 536870912) ? FAT16 : FAT32;   
 }
 
-/*inline uint8_t determine_fat_type(uint32_t cluster_count) {
+/* The type a mounting driver will see, which only goes by the cluster count */
+static inline uint8_t fat_type_of(uint32_t cluster_count) {
+    if (cluster_count < 4085) return FAT12;
     return (cluster_count < 65525) ? FAT16 : FAT32;   
-} */
+}
 
 int main(int argc, char **argv) {
-    if (argc < 2 || argc > 7) {
-        printf("usage: mkfs [-s sector_size] [-c clusters_per_sector] [-n label] fs_size device\n");
+    if (argc < 2 || argc > 9) {
+        printf("usage: mkfs [-s sector_size] [-c clusters_per_sector] [-n label] [-d directory] fs_size device\n");
         exit(EXIT_FAILURE);
     }
 
-    cmd_options_t opts;    
+    cmd_options_t opts = {0, 0, 0, NULL, NULL, NULL};    
 
     
     // Parse Arguments
@@ -158,20 +434,23 @@ int main(int argc, char **argv) {
             opts.clusters = (++i < argc - 2) ? atoi(argv[i]) : 0;
         } else if (strcmp(argv[i], "-n") == 0) {
             opts.label = (++i < argc - 2) ? (unsigned char*)argv[i] : NULL;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            opts.source = (++i < argc - 2) ? argv[i] : NULL;
         }
     }
     
     opts.size = parse_size(argv[argc - 2]);
-    int fattype = (opts.size < 536870912) ? FAT16 : FAT32;
+    int fattype = determine_fat_type(opts.size);
     opts.device = argv[argc - 1];
     opts.sector_size = (opts.sector_size) == 0 ? 512 : opts.sector_size;
     opts.label = (opts.label == NULL) ? no_name : opts.label;    
-    opts.clusters = (opts.clusters == 0) ? get_cluster_size(opts.size, opts.sector_size, fattype) : opts.sector_size;
+    opts.clusters = (opts.clusters == 0) ? get_cluster_size(opts.size, opts.sector_size, fattype) : opts.clusters;
         
     printf("Sector Size: %d Bytes\nClusters Size: %d Bytes\nSize: %llu Bytes\n", opts.sector_size, opts.clusters * opts.sector_size, opts.size);
     
     /* Create File */
-    create_file(opts.device, opts.size);
+    int sparse;
+    int fd = create_file(opts.device, opts.size, &sparse);
     
     fat_BS_t *boot_sector = calloc(1, sizeof(fat_BS_t));
     boot_sector->bootjmp[0] = 0xEB; boot_sector->bootjmp[1] = 0x58; boot_sector->bootjmp[2] = 0x90;
@@ -181,83 +460,119 @@ int main(int argc, char **argv) {
     boot_sector->oem_name[6] = 's'; boot_sector->oem_name[7] = ' ';
     boot_sector->bytes_per_sector = opts.sector_size;
     boot_sector->sectors_per_cluster = opts.clusters;
-    boot_sector->reserved_sector_count = 32;
+    /* FAT12/16 keep the boot sector alone in front of the FAT and the root in a fixed
+     * region, sized in whole clusters so the engine can address it like a directory */
+    uint32_t cluster_size = opts.sector_size * opts.clusters;
+    boot_sector->reserved_sector_count = (fattype == FAT32) ? 32 : 1;
     boot_sector->table_count = 2;
-    boot_sector->root_entry_count = 0;
-    boot_sector->total_sectors_16 = 0;      /* 0 -- See Total_Sectors_32 */
+    boot_sector->root_entry_count = (fattype == FAT32) ? 0 : ((cluster_size / 32 > 512) ? cluster_size / 32 : 512);
     boot_sector->media_type = 0xF8;
-    boot_sector->table_size_16 = 0;         /* 0 for Fat32 */
     boot_sector->sectors_per_track = 32;
     boot_sector->head_side_count = 64;
     boot_sector->hidden_sector_count = 0;   /* No Hidden Sectors */
-    boot_sector->total_sectors_32 = opts.size / boot_sector->bytes_per_sector;;
+    /* A FAT32 volume can only count 2^32 - 1 sectors, anything past that goes unused */
+    uint64_t total_sectors = opts.size / boot_sector->bytes_per_sector;
+    if (total_sectors > 0xFFFFFFFF) total_sectors = 0xFFFFFFFF;
+    if (fattype != FAT32 && total_sectors < 0x10000) {
+        boot_sector->total_sectors_16 = total_sectors;
+        boot_sector->total_sectors_32 = 0;
+    } else {
+        boot_sector->total_sectors_16 = 0;      /* 0 -- See Total_Sectors_32 */
+        boot_sector->total_sectors_32 = total_sectors;
+    }
     
     /* Compute # Sectors in FAT -- Algorithm according to MS FAT Specification 1.03 */
-    int root_dir_sectors = ((boot_sector->root_entry_count * 32) + (boot_sector->bytes_per_sector - 1)) / boot_sector->bytes_per_sector;
-    int tmpval1 = boot_sector->total_sectors_32 - (boot_sector->reserved_sector_count + root_dir_sectors);
-    int tmpval2 = (256 * boot_sector->sectors_per_cluster) + boot_sector->table_count;
+    uint32_t root_dir_sectors = ((boot_sector->root_entry_count * 32) + (boot_sector->bytes_per_sector - 1)) / boot_sector->bytes_per_sector;
+    uint32_t tmpval1 = total_sectors - (boot_sector->reserved_sector_count + root_dir_sectors);
+    uint32_t tmpval2 = (256 * boot_sector->sectors_per_cluster) + boot_sector->table_count;
     if (fattype == FAT32) {
         tmpval2 = tmpval2 / 2;
     }
-    int tbl_size = (tmpval1 + (tmpval2 - 1)) / tmpval2;
+    uint32_t tbl_size = ((uint64_t)tmpval1 + (tmpval2 - 1)) / tmpval2;
+    if (fattype == FAT12) {
+        /* The specification leaves FAT12 out, size it for every cluster that could fit at 1.5 bytes each */
+        uint32_t max_clusters = tmpval1 / boot_sector->sectors_per_cluster;
+        tbl_size = ((((max_clusters + 2) * 3) + 1) / 2 + boot_sector->bytes_per_sector - 1) / boot_sector->bytes_per_sector;
+    }
+    boot_sector->table_size_16 = (fattype == FAT32) ? 0 : tbl_size;    /* 0 for Fat32 */
     
     /* Extended Boot Record */
     fat_extBS_32_t *ext = (fat_extBS_32_t*)boot_sector->extended_section;
-    ext->table_size_32 = tbl_size;    
-    ext->extended_flags = 0;
-    ext->fat_version = 0;                   /* Version Should Be 0.0, hence the 0 input */
-    ext->root_cluster = 2;
-    ext->fat_info = 1;
-    ext->backup_BS_sector = 6;
-    ext->reserved_0[0] = 0; ext->reserved_0[1] = 0; ext->reserved_0[2] = 0;
-    ext->reserved_0[3] = 0; ext->reserved_0[4] = 0; ext->reserved_0[5] = 0;
-    ext->reserved_0[6] = 0; ext->reserved_0[7] = 0; ext->reserved_0[8] = 0;
-    ext->reserved_0[9] = 0; ext->reserved_0[10] = 0; ext->reserved_0[11] = 0;
-    ext->drive_number = 0;
-    ext->reserved_1 = 0;
-    ext->boot_signature = 0x29;
-    ext->volume_id = 892301;
+    fat_extBS_16_t *ext16 = (fat_extBS_16_t*)boot_sector->extended_section;
+    unsigned char *volume_label, *type_label;
+    if (fattype == FAT32) {
+        ext->table_size_32 = tbl_size;    
+        ext->extended_flags = 0;
+        ext->fat_version = 0;                   /* Version Should Be 0.0, hence the 0 input */
+        ext->root_cluster = 2;
+        ext->fat_info = 1;
+        ext->backup_BS_sector = 6;
+        memset(ext->reserved_0, 0, sizeof(ext->reserved_0));
+        ext->drive_number = 0;
+        ext->reserved_1 = 0;
+        ext->boot_signature = 0x29;
+        ext->volume_id = 892301;
+        volume_label = ext->volume_label;
+        type_label = ext->fat_type_label;
+    } else {
+        ext16->bios_drive_num = 0x80;
+        ext16->reserved1 = 0;
+        ext16->boot_signature = 0x29;
+        ext16->volume_id = 892301;
+        volume_label = ext16->volume_label;
+        type_label = ext16->fat_type_label;
+    }
     
-    ext->volume_label[0] = 'R'; ext->volume_label[1] = 'A'; ext->volume_label[2] = 'S';
-    ext->volume_label[3] = 'P'; ext->volume_label[4] = 'X'; ext->volume_label[5] = 'I';
-    ext->volume_label[6] = 'N'; ext->volume_label[7] = 'N'; ext->volume_label[8] = 'U';
-    ext->volume_label[9] = ' '; ext->volume_label[10] = ' ';
+    memcpy(volume_label, "RASPXINNU  ", 11);
+    memcpy(type_label, (fattype == FAT12) ? "FAT12   " : (fattype == FAT16) ? "FAT16   " : "FAT32   ", 8);
     
-    ext->fat_type_label[0] = 'F'; ext->fat_type_label[1] = 'A'; ext->fat_type_label[2] = 'T';
-    ext->fat_type_label[3] = '3'; ext->fat_type_label[4] = '2'; ext->fat_type_label[5] = ' ';
-    ext->fat_type_label[6] = ' '; ext->fat_type_label[7] = ' ';
+    uint32_t bps = boot_sector->bytes_per_sector;
+    uint32_t rootsect = boot_sector->reserved_sector_count + (boot_sector->table_count * tbl_size);
+    uint32_t datasect = rootsect + root_dir_sectors;
+    uint32_t num_clusters = (total_sectors - datasect) / boot_sector->sectors_per_cluster;
     
-    write_bs_to_file(opts.device, 0, boot_sector);
-    write_bs_to_file(opts.device, ext->backup_BS_sector * boot_sector->bytes_per_sector, boot_sector);
+    /* Drivers tell the type apart by cluster count alone, so it has to agree with the layout */
+    if (fat_type_of(num_clusters) != fattype) {
+        printf("mkfs: %u clusters of %u bytes do not make a FAT%d volume, pick another cluster size\n",
+               num_clusters, cluster_size, fat_codecs[fattype].bits);
+        exit(EXIT_FAILURE);
+    }
     
-    int num_clusters = (boot_sector->total_sectors_32 - (boot_sector->reserved_sector_count + (boot_sector->table_count * ext->table_size_32) + root_dir_sectors)) / boot_sector->sectors_per_cluster;
+    /* One small zero buffer is reused for every region that has to be cleared */
+    size_t zlen = ZERO_CHUNK_SECTORS * bps;
+    unsigned char *zeros = calloc(1, zlen);
     
-    /* Create FS Info Structure */
-    fat_fsinfo_t *fsinfo = calloc(1, sizeof(fat_fsinfo_t));
-    fsinfo->num_free_clusters = 0xFFFFFFFF;
-    fsinfo->last_alloc = 0xFFFFFFFF;
-    write_fsinfo_to_file(opts.device, ext->fat_info * boot_sector->bytes_per_sector, fsinfo);   
+    /* A reused block device still holds old data, clear the reserved sectors */
+    if (!sparse) zero_range(fd, 0, (uint64_t)boot_sector->reserved_sector_count * bps, zeros, zlen);
     
-        /* Create FAT Table */
-
-    unsigned int fat_table[num_clusters];
+    write_bs_to_file(fd, 0, boot_sector);
+    if (fattype == FAT32) write_bs_to_file(fd, (off_t)ext->backup_BS_sector * bps, boot_sector);
     
-    fat_table[0] = 0x0FFFFF00 | boot_sector->media_type;
-    fat_table[1] = 0x0FFFFFFF;
-    fat_table[2] = 0x0FFFFF00 | boot_sector->media_type;
-        
-    FILE *fp = fopen(opts.device, "r+");
-    if (fp == NULL) {
-       printf("[FAT32]: Error Opening Device -> Write FSInfo\n");
+    /* Lay out the root, plus the host tree if one was given */
+    host_tree_t tree = {NULL, 0, 0};
+    add_node(&tree, opts.source, "", 1, 0, 0);
+    scan_host_tree(&tree);
+    uint32_t end = layout_host_tree(&tree, cluster_size, boot_sector->root_entry_count);
+    if (end - 2 > num_clusters) {
+        printf("mkfs: %s needs %u clusters, the volume only has %u\n", opts.source, end - 2, num_clusters);
         exit(EXIT_FAILURE);
-    } 
+    }
+    
+    /* Create FS Info Structure, which only FAT32 has */
+    fat_fsinfo_t *fsinfo = calloc(1, sizeof(fat_fsinfo_t));
+    fsinfo->num_free_clusters = num_clusters - (end - 2);
+    fsinfo->last_alloc = end - 1;
+    if (fattype == FAT32) write_fsinfo_to_file(fd, (off_t)ext->fat_info * bps, fsinfo);   
     
-    printf("Writing FAT Table #1 at Sector: %d\n", boot_sector->reserved_sector_count);
-    fseek(fp, boot_sector->reserved_sector_count * boot_sector->bytes_per_sector, SEEK_SET);
-    printf("Writing FAT Table #2 at Sector: %d\n", boot_sector->reserved_sector_count + ext->table_size_32);
-    fwrite(fat_table, ext->table_size_32, 1, fp);
-    fseek(fp, (boot_sector->reserved_sector_count * boot_sector->bytes_per_sector) + (ext->table_size_32 * boot_sector->bytes_per_sector), SEEK_SET);
-    fwrite(fat_table, ext->table_size_32, 1, fp);
+    /* Create FAT Table -- only the sectors covering used clusters hold anything */
+    for (int i = 0; i < boot_sector->table_count; i++) {
+        printf("Writing FAT Table #%d at Sector: %d\n", i + 1, boot_sector->reserved_sector_count + (i * tbl_size));
+    }
+    uint32_t fat_used = write_fat_extents(fd, boot_sector, tbl_size, &(fat_codecs[fattype]), &tree, end);
+    for (int i = 0; i < boot_sector->table_count && !sparse; i++) {
+        off_t table = (off_t)(boot_sector->reserved_sector_count + (i * tbl_size) + fat_used) * bps;
+        zero_range(fd, table, (uint64_t)(tbl_size - fat_used) * bps, zeros, zlen);
+    }
     
     /* Write Dir Structure */
     fat_direntry_t *root = calloc(1, sizeof(fat_direntry_t));
@@ -277,15 +592,18 @@ int main(int argc, char **argv) {
     root->low_clu = 0x0000;
     root->size = 0x00000000;
     
-    // Start location of the data Sector
-    int datasect = boot_sector->reserved_sector_count + (boot_sector->table_count * ext->table_size_32) + root_dir_sectors;
-    printf("Writing Root Dir at Sector: %d\n", datasect);
-    fseek(fp, datasect * boot_sector->bytes_per_sector, SEEK_SET);
-    fwrite(root, sizeof(fat_direntry_t), 1, fp);    
-    fclose(fp);   
+    printf("Writing Root Dir at Sector: %d\n", (fattype == FAT32) ? datasect : rootsect);
+    write_host_tree(fd, boot_sector, rootsect, datasect, &tree, root);
+    close(fd);   
     
     free(boot_sector);
     free(fsinfo);
+    free(zeros);
     free(root);
+    for (int i = 1; i < tree.count; i++) {
+        free(tree.nodes[i].path);
+        free(tree.nodes[i].name);
+    }
+    free(tree.nodes);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,361 @@
+/*
+ * @file: replay.c
+ *
+ * Runs a workload captured with capture_start against a fresh image.
+ * Files the workload opened or deleted without creating them are made
+ * first, at the size they had when captured.  Calls are split between
+ * threads by the file id they use and can be issued as fast as possible
+ * or at the pacing they were captured with.  The engine's tables are shared, so
+ * the calls themselves are made one at a time, in the order they were
+ * captured whichever thread makes them, so every run does the same thing.
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vfs.h"
+
+#define REPLAY_MAX_THREADS  64
+#define REPLAY_HASH_SIZE    4096
+#define REPLAY_BATCH        1000        /* Files made per filecreate_batch call */
+
+/* A path seen in the capture */
+typedef struct replay_path_s {
+    const char              *path;
+    struct replay_path_s    *next;
+} replay_path_t;
+
+typedef struct replay_thread_s {
+    int                 id;
+    pthread_t           thread;
+    pthread_cond_t      turn;           /* Signalled when one of its records is next */
+    unsigned long long  count[CAPTURE_OP_COUNT];
+    unsigned long long  errors[CAPTURE_OP_COUNT];  /* Calls that failed when they had not, or the reverse */
+    unsigned long long  ns[CAPTURE_OP_COUNT];
+    unsigned long long  captured_ns[CAPTURE_OP_COUNT];
+} replay_thread_t;
+
+static const char *op_names[CAPTURE_OP_COUNT] = {
+    "open", "read", "write", "create", "delete",
+    "close", "opendir", "readdir", "closedir", "chdir"
+};
+
+static capture_rec_t *recs = NULL;
+static char **paths = NULL;
+static int n_recs = 0;
+static int n_threads = 1;
+static int paced = 0;
+static unsigned long long replay_start = 0;
+
+/* Capture ids mapped to the ids handed out during replay, by slot index */
+static int *file_map = NULL;
+static int *dir_map = NULL;
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static replay_thread_t *threads = NULL;
+static int next_rec = 0;                /* Record to replay next, guarded by engine_lock */
+
+unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Read a whole capture file into recs and paths
+ *
+ * @return  -1 if the file could not be read, else the number of records
+ */
+int load_capture(const char *file) {
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL) { return -1; }
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "replay: %s: Not a capture file\n", file);
+        fclose(fp);
+        return -1;
+    }
+
+    int cap = 0;
+    capture_rec_t rec;
+    while (fread(&rec, sizeof(capture_rec_t), 1, fp) == 1) {
+        if (n_recs == cap) {
+            cap = cap ? cap * 2 : 1024;
+            recs = realloc(recs, cap * sizeof(capture_rec_t));
+            paths = realloc(paths, cap * sizeof(char*));
+        }
+        paths[n_recs] = NULL;
+        if (rec.path_len > 0) {
+            paths[n_recs] = calloc(rec.path_len + 1, sizeof(char));
+            if (fread(paths[n_recs], 1, rec.path_len, fp) != rec.path_len) { free(paths[n_recs]); break; }
+        }
+        recs[n_recs++] = rec;
+    }
+    fclose(fp);
+    return n_recs;
+}
+
+unsigned int hash_path(const char *path) {
+    unsigned int h = 5381;
+    while (*path) h = (h * 33) ^ (unsigned char)*path++;
+    return h % REPLAY_HASH_SIZE;
+}
+
+/*
+ * Add a path to the set
+ *
+ * @return  1 if it was new, 0 if it was already there
+ */
+int add_path(replay_path_t **set, const char *path) {
+    unsigned int h = hash_path(path);
+    for (replay_path_t *p = set[h]; p != NULL; p = p->next) {
+        if (strcmp(p->path, path) == 0) return 0;
+    }
+    replay_path_t *p = malloc(sizeof(replay_path_t));
+    p->path = path;
+    p->next = set[h];
+    set[h] = p;
+    return 1;
+}
+
+/*
+ * Make every file the workload found already there, at its captured size
+ *
+ * @return  Number of files made
+ */
+int prepare_files(void) {
+    replay_path_t **known = calloc(REPLAY_HASH_SIZE, sizeof(replay_path_t*));
+    const char **names = malloc(REPLAY_BATCH * sizeof(char*));
+    unsigned int *sizes = malloc(REPLAY_BATCH * sizeof(unsigned int));
+    int n = 0, made = 0, skipped = 0;
+
+    for (int i = 0; i < n_recs; i++) {
+        if (paths[i] == NULL) continue;
+        if (recs[i].op == CAPTURE_CREATE) {
+            add_path(known, paths[i]);
+        } else if ((recs[i].op == CAPTURE_OPEN || recs[i].op == CAPTURE_DELETE) &&
+                   recs[i].result >= 0 && add_path(known, paths[i])) {
+            /* Only files in the root can be made without a mkdir */
+            if (strchr(paths[i][0] == '/' ? paths[i] + 1 : paths[i], '/') != NULL) { skipped++; continue; }
+            names[n] = paths[i];
+            sizes[n] = (recs[i].op == CAPTURE_OPEN) ? recs[i].arg : 0;
+            if (++n == REPLAY_BATCH) { made += filecreate_batch(names, sizes, n); n = 0; }
+        }
+    }
+    if (n > 0) made += filecreate_batch(names, sizes, n);
+    if (skipped > 0) fprintf(stderr, "replay: %d files outside the root were not made\n", skipped);
+
+    for (int h = 0; h < REPLAY_HASH_SIZE; h++) {
+        while (known[h] != NULL) {
+            replay_path_t *next = known[h]->next;
+            free(known[h]);
+            known[h] = next;
+        }
+    }
+    free(known);
+    free(names);
+    free(sizes);
+    return made;
+}
+
+/*
+ * Thread a record is replayed on.  Everything done through one file slot
+ * stays on one thread, calls that only name a path and records of unknown
+ * calls, which are only stepped over, go to the first.
+ */
+int replay_owner(capture_rec_t *rec) {
+    return (rec->op >= CAPTURE_OP_COUNT || rec->handle < 0) ? 0 : HANDLE_INDEX(rec->handle) % n_threads;
+}
+
+/*
+ * Make one captured call again
+ *
+ * @return  1 if it succeeded where the captured call failed or the
+ *          reverse, else 0
+ */
+int replay_call(capture_rec_t *rec, char *path, char **buff, int *buff_size) {
+    int h = (rec->handle >= 0) ? HANDLE_INDEX(rec->handle) : -1;
+    int rc;
+
+    if ((rec->op == CAPTURE_READ || rec->op == CAPTURE_WRITE) && rec->arg + 1 > *buff_size) {
+        *buff_size = rec->arg + 1;
+        *buff = realloc(*buff, *buff_size);
+        memset(*buff, 'r', *buff_size);
+    }
+
+    switch (rec->op) {
+        case CAPTURE_OPEN:
+            rc = fileopen(path, rec->mode);
+            if (h >= 0) file_map[h] = rc;
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_CREATE:
+            rc = filecreate(path);
+            if (h >= 0) file_map[h] = rc;
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_READ:
+            if (h < 0 || file_map[h] < 0) { return 1; }
+            rc = fileread(file_map[h], *buff, rec->arg);
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_WRITE:
+            if (h < 0 || file_map[h] < 0) { return 1; }
+            rc = filewrite(file_map[h], *buff, rec->arg);
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_CLOSE:
+            if (h < 0 || file_map[h] < 0) { return 1; }
+            fileclose(file_map[h]);
+            file_map[h] = -1;
+            return 0;
+        case CAPTURE_DELETE:
+            rc = deletefile(path);
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_OPENDIR:
+            rc = opendir(path);
+            if (h >= 0) dir_map[h] = rc;
+            return (rc < 0) != (rec->result < 0);
+        case CAPTURE_READDIR: {
+            if (h < 0 || dir_map[h] < 0) { return 1; }
+            dir_entry_t ent = readdir(dir_map[h]);
+            rc = (ent.name != NULL);
+            return rc != rec->result;
+        }
+        case CAPTURE_CLOSEDIR:
+            if (h < 0 || dir_map[h] < 0) { return 1; }
+            closedir(dir_map[h]);
+            dir_map[h] = -1;
+            return 0;
+        case CAPTURE_CHDIR:
+            changedir(path);
+            return 0;
+    }
+    return 1;
+}
+
+void *replay_thread(void *arg) {
+    replay_thread_t *t = (replay_thread_t*)arg;
+    char *buff = NULL;
+    int buff_size = 0;
+
+    for (int i = 0; i < n_recs; i++) {
+        capture_rec_t *rec = &(recs[i]);
+        if (replay_owner(rec) != t->id) continue;
+
+        if (paced && rec->op < CAPTURE_OP_COUNT) {
+            unsigned long long due = replay_start + rec->ts;
+            struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        /* Wait for every earlier record, then hand the turn to the owner of the next */
+        pthread_mutex_lock(&engine_lock);
+        while (next_rec != i) pthread_cond_wait(&(t->turn), &engine_lock);
+        unsigned long long start = now_ns();
+        int err = (rec->op < CAPTURE_OP_COUNT) ? replay_call(rec, paths[i], &buff, &buff_size) : 0;
+        unsigned long long took = now_ns() - start;
+        next_rec = i + 1;
+        if (next_rec < n_recs) pthread_cond_signal(&(threads[replay_owner(&(recs[next_rec]))].turn));
+        pthread_mutex_unlock(&engine_lock);
+        if (rec->op >= CAPTURE_OP_COUNT) continue;
+
+        t->ns[rec->op] += took;
+        t->count[rec->op]++;
+        t->errors[rec->op] += err;
+        t->captured_ns[rec->op] += rec->dur;
+    }
+    free(buff);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *mkfs = "./mkfs";
+    const char *fs_size = "1G";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pt:s:m:")) != -1) {
+        switch (opt) {
+            case 'p': paced = 1; break;
+            case 't': n_threads = atoi(optarg); break;
+            case 's': fs_size = optarg; break;
+            case 'm': mkfs = optarg; break;
+            default: n_threads = -1; break;
+        }
+    }
+    if (argc - optind != 2 || n_threads < 1 || n_threads > REPLAY_MAX_THREADS) {
+        printf("usage: replay [-p] [-t threads] [-s fs_size] [-m mkfs] capture image\n");
+        exit(EXIT_FAILURE);
+    }
+    const char *capture = argv[optind], *image = argv[optind + 1];
+
+    if (load_capture(capture) < 0) { perror(capture); exit(EXIT_FAILURE); }
+
+    char cmd[512];
+    unlink(image);
+    snprintf(cmd, sizeof(cmd), "%s %s %s > /dev/null", mkfs, fs_size, image);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "replay: %s failed\n", cmd);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The engine reports on stdout while mounting */
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    mount_fs(image, "/");
+    int made = prepare_files();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(null);
+    close(saved);
+
+    file_map = malloc(HANDLE_LIMIT * sizeof(int));
+    dir_map = malloc(HANDLE_LIMIT * sizeof(int));
+    for (int i = 0; i < HANDLE_LIMIT; i++) {
+        file_map[i] = -1;
+        dir_map[i] = -1;
+    }
+
+    threads = calloc(n_threads, sizeof(replay_thread_t));
+    for (int i = 0; i < n_threads; i++) {
+        threads[i].id = i;
+        pthread_cond_init(&(threads[i].turn), NULL);
+    }
+    replay_start = now_ns();
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&(threads[i].thread), NULL, replay_thread, &(threads[i]));
+    }
+    for (int i = 0; i < n_threads; i++) pthread_join(threads[i].thread, NULL);
+    double elapsed = (now_ns() - replay_start) / 1e9;
+
+    for (int i = 1; i < n_threads; i++) {
+        for (int op = 0; op < CAPTURE_OP_COUNT; op++) {
+            threads[0].count[op] += threads[i].count[op];
+            threads[0].errors[op] += threads[i].errors[op];
+            threads[0].ns[op] += threads[i].ns[op];
+            threads[0].captured_ns[op] += threads[i].captured_ns[op];
+        }
+    }
+
+    printf("%d calls replayed in %.3fs (%.0f calls/s), %d threads, %s, %d files made first\n",
+           n_recs, elapsed, elapsed > 0 ? n_recs / elapsed : 0, n_threads, paced ? "paced" : "unpaced", made);
+    printf("%-9s %10s %8s %14s %14s\n", "op", "count", "errors", "captured(us)", "replayed(us)");
+    for (int op = 0; op < CAPTURE_OP_COUNT; op++) {
+        unsigned long long n = threads[0].count[op];
+        if (n == 0) continue;
+        printf("%-9s %10llu %8llu %14.2f %14.2f\n", op_names[op], n, threads[0].errors[op],
+               (threads[0].captured_ns[op] / (double)n) / 1000.0, (threads[0].ns[op] / (double)n) / 1000.0);
+    }
+
+    unmount_fs("/");
+    for (int i = 0; i < n_threads; i++) pthread_cond_destroy(&(threads[i].turn));
+    free(threads);
+    free(file_map);
+    free(dir_map);
+    for (int i = 0; i < n_recs; i++) free(paths[i]);
+    free(paths);
+    free(recs);
+    return EXIT_SUCCESS;
+}
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
+
 /* Generic C Headers */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vfs.h"
+#include "trace.h"
+#include "copy.h"
 
 #define KNRM    "\x1B[0m"
 #define KRED    "\x1B[31m"
@@ -22,20 +28,32 @@ typedef struct arg_info_s {
 static char *current_dir = "/";
 static int is_mount = 0;
 
+/* Batch mode runs a script or piped commands without prompts, -t times each command */
+static int batch = 0;
+static int timing = 0;
+static unsigned long long n_commands = 0;
+
 arg_info_t tokenize(char *input) {
-    int num_cmds = 2;
-    for (int i = 0; i < strlen(input); i++) {
-        if (input[i] == ' ') ++num_cmds;
-    }
+    /* Reused between commands, so running a script does not allocate per line */
+    static char **argv = NULL;
+    static int num_cmds = 0;
     
     arg_info_t arg_info;
     char *token;
-    arg_info.argv = calloc(num_cmds+1, sizeof(char*));
-    for (arg_info.argc = 0; (token = strtok(NULL, " ")) != NULL; arg_info.argc++) {
-        arg_info.argv[arg_info.argc] = token;
+    if (argv == NULL) {
+        num_cmds = 8;
+        argv = calloc(num_cmds + 1, sizeof(char*));
+    }
+    for (arg_info.argc = 0; (token = strtok(NULL, " \t")) != NULL; arg_info.argc++) {
+        if (arg_info.argc + 1 >= num_cmds) {
+            num_cmds *= 2;
+            argv = realloc(argv, (num_cmds + 1) * sizeof(char*));
+        }
+        argv[arg_info.argc] = token;
     }
     
-    arg_info.argv[num_cmds] = (char*)'\0';
+    argv[arg_info.argc] = NULL;
+    arg_info.argv = argv;
     return arg_info;
 }
 
@@ -61,17 +79,106 @@ void mount(arg_info_t args) {
         }
         return;
     } else if (args.argc < 2) {
-        printf("usage: mount device mount-point\n");
+        printf("usage: mount [-o discard|discard=deferred|direct|sync=none|close|periodic|always|commit=ms|log] device mount-point\n");
         return;
     }
     
     char *device_name = args.argv[args.argc - 2];
     char *path = args.argv[args.argc - 1];
     
-    mount_fs(device_name, path);
+    /* Options: -o discard | discard=deferred | direct | sync=policy | commit=ms | log */
+    int flags = 0, sync_ms = 0;
+    for (int i = 0; i < args.argc - 2; i++) {
+        if (strcmp(args.argv[i], "-o") != 0 || i + 1 >= args.argc - 2) continue;
+        for (char *opt = strtok(args.argv[++i], ","); opt != NULL; opt = strtok(NULL, ",")) {
+            if (strcmp(opt, "discard") == 0) flags |= MOUNT_DISCARD;
+            else if (strcmp(opt, "discard=deferred") == 0) flags |= MOUNT_DISCARD_DEFERRED;
+            else if (strcmp(opt, "direct") == 0) flags |= MOUNT_DIRECT;
+            else if (strcmp(opt, "sync=none") == 0) flags &= ~MOUNT_SYNC_MASK;
+            else if (strcmp(opt, "sync=close") == 0) flags = (flags & ~MOUNT_SYNC_MASK) | MOUNT_SYNC_CLOSE;
+            else if (strcmp(opt, "sync=periodic") == 0) flags = (flags & ~MOUNT_SYNC_MASK) | MOUNT_SYNC_PERIODIC;
+            else if (strcmp(opt, "sync=always") == 0) flags = (flags & ~MOUNT_SYNC_MASK) | MOUNT_SYNC;
+            else if (strncmp(opt, "commit=", 7) == 0 && atoi(opt + 7) > 0) sync_ms = atoi(opt + 7);
+            else if (strcmp(opt, "log") == 0) flags |= MOUNT_LOG;
+            else printf("mount: unknown option %s\n", opt);
+        }
+    }
+    
+    mount_fs_opts(device_name, path, flags, sync_ms);
     is_mount = 1;
 }
 
+void trim(arg_info_t args) {
+    if (args.argc != 1) {
+        printf("usage: trim mount-point\n");
+        return;
+    }
+    int n = trim_fs(args.argv[0]);
+    if (n < 0) printf("trim: %s: Not Mounted\n", args.argv[0]);
+    else printf("%d clusters discarded\n", n);
+}
+
+void sync_mount(arg_info_t args) {
+    if (args.argc != 1) {
+        printf("usage: sync mount-point\n");
+        return;
+    }
+    if (sync_fs(args.argv[0]) < 0) printf("sync: %s: Could not sync\n", args.argv[0]);
+}
+
+void stats(arg_info_t args) {
+    int reset = (args.argc > 0 && strcmp(args.argv[0], "reset") == 0);
+    if (args.argc > reset + 1) {
+        printf("usage: stats [reset] [mount-point]\n");
+        return;
+    }
+    char *path = (args.argc > reset) ? args.argv[reset] : "/";
+    
+    if (reset) {
+        if (reset_stats_fs(path) < 0) printf("stats: %s: Not Mounted\n", path);
+        return;
+    }
+    
+    fs_stats_t st;
+    if (stats_fs(path, &st) < 0) { printf("stats: %s: Not Mounted\n", path); return; }
+    
+    printf("device   opens %llu  reads %llu  writes %llu  seeks %llu\n", st.dev_opens, st.dev_reads, st.dev_writes, st.dev_seeks);
+    printf("bytes    read %llu (data %llu)  written %llu (data %llu)\n", st.bytes_read, st.data_read, st.bytes_written, st.data_written);
+    printf("fat      sectors read %llu  written %llu\n", st.fat_reads, st.fat_writes);
+    printf("cache    hits %llu  misses %llu\n", st.cache_hits, st.cache_misses);
+    printf("sync     fdatasyncs %llu  log records %llu  checkpoints %llu\n", st.syncs, st.log_records, st.checkpoints);
+    
+    const char *names[FS_OP_COUNT] = {"open", "read", "write", "readdir", "create", "delete"};
+    printf("%-8s %10s %10s %10s %10s\n", "op", "count", "avg(us)", "p50(us)", "p99(us)");
+    for (int i = 0; i < FS_OP_COUNT; i++) {
+        fs_op_stats_t *op = &(st.ops[i]);
+        printf("%-8s %10llu %10llu %10llu %10llu\n", names[i], op->count,
+               op->count ? (op->total_ns / op->count) / 1000 : 0,
+               stats_percentile(op, 50), stats_percentile(op, 99));
+    }
+}
+
+void trace(arg_info_t args) {
+    if (args.argc != 1) {
+        printf("usage: trace file | reset\n");
+        return;
+    }
+    if (strcmp(args.argv[0], "reset") == 0) { trace_reset(); return; }
+    
+    int n = trace_dump(args.argv[0]);
+    if (n < 0) printf("trace: %s: Could not write trace (built without FAT_TRACE?)\n", args.argv[0]);
+    else printf("%d events written\n", n);
+}
+
+void capture(arg_info_t args) {
+    if (args.argc != 1) {
+        printf("usage: capture file | stop\n");
+        return;
+    }
+    if (strcmp(args.argv[0], "stop") == 0) { capture_stop(); return; }
+    if (capture_start(args.argv[0]) < 0) printf("capture: %s: Could not create file\n", args.argv[0]);
+}
+
 void umount(arg_info_t args) {
     if (args.argc != 1) {
         printf("usage: umount mount-point\n");
@@ -101,8 +208,10 @@ void touch(arg_info_t args) {
         return;
     }
     
-    int fp = filecreate(prepend_path(args.argv[0]));
+    char *path = prepend_path(args.argv[0]);
+    int fp = filecreate(path);
     fileclose(fp);
+    if (path != args.argv[0]) free(path);
 }
 
 void cat(arg_info_t args) {
@@ -111,13 +220,16 @@ void cat(arg_info_t args) {
         return;
     }
     
-    int fp = fileopen(prepend_path(args.argv[0]), BEGIN);
+    char *path = prepend_path(args.argv[0]);
+    int fp = fileopen(path, BEGIN);
+    if (path != args.argv[0]) free(path);
     if (fp == -1) { printf("cat: %s: No Such File or Directory\n", args.argv[0]); return; }
     int nr = 0;
-    char buffer[512];
-    while ((nr = fileread(fp, buffer, 512)) > 0) {
-        printf("%s", buffer);
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    while ((nr = fileread(fp, buffer, COPY_BUFFER_SIZE)) > 0) {
+        fwrite(buffer, 1, nr, stdout);
     }
+    free(buffer);
     fileclose(fp);
 }
 
@@ -139,80 +251,350 @@ void rm(arg_info_t args) {
     deletefile(args.argv[0]);
 }
 
+void compact(arg_info_t args) {
+    if (args.argc > 1) {
+        printf("usage: compact [directory]\n");
+        return;
+    }
+    int n = compactdir(args.argc == 1 ? args.argv[0] : "/");
+    if (n >= 0) printf("%d slots reclaimed\n", n);
+}
+
 void echo(arg_info_t args) {
     if (args.argc != 2) {
         printf("usage: echo word file\n");
         return;
     }     
     
-    int fp = fileopen(prepend_path(args.argv[1]), BEGIN);
+    char *path = prepend_path(args.argv[1]);
+    int fp = fileopen(path, TRUNCATE);
+    if (path != args.argv[1]) free(path);
     if (fp == -1) { printf("Error\n"); }
     filewrite(fp, args.argv[0], strlen(args.argv[0]));
     fileclose(fp);    
 }
 
+void truncate_file(arg_info_t args) {
+    if (args.argc != 2) {
+        printf("usage: truncate file length\n");
+        return;
+    }
+    
+    char *path = prepend_path(args.argv[0]);
+    int fp = fileopen(path, BEGIN);
+    if (path != args.argv[0]) free(path);
+    if (fp == -1) { printf("truncate: %s: No Such File or Directory\n", args.argv[0]); return; }
+    if (filetruncate(fp, atoi(args.argv[1])) == -1) printf("truncate: %s: File is shorter than %s\n", args.argv[0], args.argv[1]);
+    fileclose(fp);
+}
+
 void echoa(arg_info_t args) {
     if (args.argc != 2) {
         printf("usage: echo word file\n");
         return;
     }     
     
-    int fp = fileopen(prepend_path(args.argv[1]), APPEND);
+    char *path = prepend_path(args.argv[1]);
+    int fp = fileopen(path, APPEND);
+    if (path != args.argv[1]) free(path);
     if (fp == -1) { printf("Error\n"); }
     filewrite(fp, args.argv[0], strlen(args.argv[0]));
     fileclose(fp);    
 }
 
-int main(int argc, char **argv) {
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+void makedirectory(arg_info_t args) {
+    if (args.argc != 1) {
+        printf("usage: mkdir directory\n");
+        return;
+    }
+    
+    char *path = prepend_path(args.argv[0]);
+    if (makedir(path) == -1) printf("mkdir: %s: Could not make directory\n", args.argv[0]);
+    if (path != args.argv[0]) free(path);
+}
 
-    char *input;
+/*
+ * Copy host files in: put [-r] host-path [image-path], with cp as the
+ * same command needing both paths
+ */
+void put(arg_info_t args, int need_dest) {
+    int recurse = (args.argc > 0 && strcmp(args.argv[0], "-r") == 0);
+    char **argv = args.argv + recurse;
+    int argc = args.argc - recurse;
+    if (argc < 1 + need_dest || argc > 2) {
+        printf(need_dest ? "usage: cp [-r] host-path image-path\n" : "usage: put [-r] host-path [image-path]\n");
+        return;
+    }
+    
+    /* Without a destination the file keeps its host name */
+    char *dest = argv[argc - 1];
+    if (argc == 1) {
+        char *slash = strrchr(argv[0], '/');
+        dest = (slash != NULL && slash[1] != '\0') ? slash + 1 : argv[0];
+    }
+    char *path = prepend_path(dest);
+    
+    double start = now();
+    long long bytes = 0;
+    int files = 1;
+    if (recurse) {
+        files = copy_tree_in(argv[0], path, 0, &bytes);
+    } else {
+        bytes = copy_in(argv[0], path);
+        if (bytes == -1) files = -1;
+    }
+    double elapsed = now() - start;
+    if (files >= 0) {
+        printf("%d files, %lld bytes in %.3f s (%.1f MB/s)\n", files, bytes, elapsed,
+               elapsed > 0 ? (bytes / 1048576.0) / elapsed : 0.0);
+    }
+    if (path != dest) free(path);
+}
+
+void get(arg_info_t args) {
+    if (args.argc != 2) {
+        printf("usage: get image-path host-path\n");
+        return;
+    }
+    
+    char *path = prepend_path(args.argv[0]);
+    double start = now();
+    long long bytes = copy_out(path, args.argv[1]);
+    double elapsed = now() - start;
+    if (bytes >= 0) {
+        printf("%lld bytes in %.3f s (%.1f MB/s)\n", bytes, elapsed,
+               elapsed > 0 ? (bytes / 1048576.0) / elapsed : 0.0);
+    }
+    if (path != args.argv[0]) free(path);
+}
 
+/*
+ * Run one command line
+ *
+ * @return  1 if the shell should exit, else 0
+ */
+int run_command(char *input) {
+    char *cmd = strtok(input, " \t");
+    if (cmd != NULL) {
+        if (strcmp(cmd, "exit") == 0) {
+            return 1;
+        } else if(strcmp(cmd, "mount") == 0) {
+            mount(tokenize(input));
+        } else if(strcmp(cmd, "umount") == 0) {
+            umount(tokenize(input));
+        } else if (is_mount == 1) {
+            if (strcmp(cmd, "ls") == 0) {
+                ls(tokenize(input));
+            } else if (strcmp(cmd, "touch") == 0) {
+                touch(tokenize(input));
+            } else if (strcmp(cmd, "cat") == 0) {
+                cat(tokenize(input));
+            } else if (strcmp(cmd, "cd") == 0) {
+                cd(tokenize(input));
+            } else if (strcmp(cmd, "pwd") == 0) {
+            
+            } else if (strcmp(cmd, "rm") == 0) {
+                rm(tokenize(input));
+            } else if (strcmp(cmd, "echo") == 0) {
+                echo(tokenize(input));
+            } else if (strcmp(cmd, "echoa") == 0) {
+                echoa(tokenize(input));
+            } else if (strcmp(cmd, "truncate") == 0) {
+                truncate_file(tokenize(input));
+            } else if (strcmp(cmd, "trim") == 0) {
+                trim(tokenize(input));
+            } else if (strcmp(cmd, "sync") == 0) {
+                sync_mount(tokenize(input));
+            } else if (strcmp(cmd, "compact") == 0) {
+                compact(tokenize(input));
+            } else if (strcmp(cmd, "mkdir") == 0) {
+                makedirectory(tokenize(input));
+            } else if (strcmp(cmd, "put") == 0) {
+                put(tokenize(input), 0);
+            } else if (strcmp(cmd, "cp") == 0) {
+                put(tokenize(input), 1);
+            } else if (strcmp(cmd, "get") == 0) {
+                get(tokenize(input));
+            } else if (strcmp(cmd, "stats") == 0) {
+                stats(tokenize(input));
+            } else if (strcmp(cmd, "trace") == 0) {
+                trace(tokenize(input));
+            } else if (strcmp(cmd, "capture") == 0) {
+                capture(tokenize(input));
+            } else {
+                printf("%s: Command Not Found\n", input);
+            }
+        } else {
+            printf("No File Systems Mounted!\n");
+        }
+    }
+    return 0;
+}
+
+void strip_newline(char *line) {
+    int len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+}
+
+int is_end(const char *line) {
+    while (*line == ' ' || *line == '\t') line++;
+    return strncmp(line, "end", 3) == 0 && (line[3] == '\0' || line[3] == ' ' || line[3] == '\t');
+}
+
+/*
+ * Run a script line: a command, or repeat N followed by a command.
+ * Every $i in it becomes the iteration of the innermost loop.
+ *
+ * @return  1 if the shell should exit, else 0
+ */
+int run_line(const char *line, int iter) {
+    static char *buff = NULL, *shown = NULL;
+    static size_t cap = 0;
+    
+    while (*line == ' ' || *line == '\t') line++;
+    if (*line == '\0' || *line == '#') { return 0; }
+    
+    int reps, used;
+    if (sscanf(line, "repeat %d %n", &reps, &used) == 1 && used > 0) {
+        for (int k = 0; k < reps; k++) {
+            if (run_line(line + used, k)) return 1;
+        }
+        return 0;
+    }
+    
+    /* Expand $i into a buffer strtok is free to cut up */
+    size_t need = strlen(line) + 1;
+    for (const char *c = line; (c = strstr(c, "$i")) != NULL; c += 2) need += 10;
+    if (need > cap) {
+        cap = need;
+        buff = realloc(buff, cap);
+        shown = realloc(shown, cap);
+    }
+    char *out = buff;
+    for (const char *c = line; *c != '\0'; ) {
+        if (c[0] == '$' && c[1] == 'i') {
+            out += sprintf(out, "%d", iter);
+            c += 2;
+        } else {
+            *out++ = *c++;
+        }
+    }
+    *out = '\0';
+    
+    if (timing) strcpy(shown, buff);
+    double start = timing ? now() : 0;
+    int done = run_command(buff);
+    n_commands++;
+    if (timing) fprintf(stderr, "%10.3f ms  %s\n", (now() - start) * 1000.0, shown);
+    return done;
+}
+
+/*
+ * Run count passes over a block of script lines.  loop N ... end blocks
+ * inside it are run as nested loops.
+ *
+ * @return  1 if the shell should exit, else 0
+ */
+int run_block(char **lines, int n, int count) {
+    for (int iter = 0; iter < count; iter++) {
+        for (int i = 0; i < n; i++) {
+            int reps;
+            if (sscanf(lines[i], " loop %d", &reps) == 1) {
+                int end, depth = 1;
+                for (end = i + 1; end < n; end++) {
+                    if (sscanf(lines[end], " loop %d", &reps) == 1) depth++;
+                    else if (is_end(lines[end]) && --depth == 0) break;
+                }
+                sscanf(lines[i], " loop %d", &reps);
+                if (run_block(lines + i + 1, end - i - 1, reps)) return 1;
+                i = end;
+            } else if (run_line(lines[i], iter)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    FILE *in = stdin;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "bt")) != -1) {
+        switch (opt) {
+            case 'b': batch = 1; break;
+            case 't': timing = 1; break;
+            default:
+                printf("usage: shell [-b] [-t] [script]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) { perror(argv[optind]); exit(EXIT_FAILURE); }
+        batch = 1;
+    }
+    
     /* Temporarily auto mount hello */
     //mount_fs("hello", "/");
     //mount_fs("/dev/sde1", "/");
-
-    while (1) {
-        printf("> ");
-        input = calloc(80, sizeof(char));
-        input = fgets(input, 80, stdin);
-        input[strlen(input)-1] = '\0';  // Strip New Line
+    
+    char *input = NULL;
+    size_t cap = 0;
+    double start = now();
+    int done = 0;
+    
+    while (!done) {
+        if (!batch) { printf("> "); fflush(stdout); }
+        if (getline(&input, &cap, in) < 0) break;
+        strip_newline(input);
         
-        char *cmd = strtok(input, " ");
-        if (cmd != NULL) {
-            if (strcmp(cmd, "exit") == 0) {
-                free(input);
-                break;
-            } else if(strcmp(cmd, "mount") == 0) {
-                mount(tokenize(input));
-            } else if(strcmp(cmd, "umount") == 0) {
-                umount(tokenize(input));
-            } else if (is_mount == 1) {
-                if (strcmp(cmd, "ls") == 0) {
-                    ls(tokenize(input));
-                } else if (strcmp(cmd, "touch") == 0) {
-                    touch(tokenize(input));
-                } else if (strcmp(cmd, "cat") == 0) {
-                    cat(tokenize(input));
-                } else if (strcmp(cmd, "cd") == 0) {
-                    cd(tokenize(input));
-                } else if (strcmp(cmd, "pwd") == 0) {
-                
-                } else if (strcmp(cmd, "rm") == 0) {
-                    rm(tokenize(input));
-                } else if (strcmp(cmd, "echo") == 0) {
-                    echo(tokenize(input));
-                } else if (strcmp(cmd, "echoa") == 0) {
-                    echoa(tokenize(input));
-                } else {
-                    printf("%s: Command Not Found\n", input);
-                }
-            } else {
-                printf("No File Systems Mounted!\n");
+        int reps;
+        if (sscanf(input, " loop %d", &reps) != 1) {
+            done = run_line(input, 0);
+            continue;
+        }
+        
+        /* Gather the body up to the matching end before running any of it */
+        char **body = NULL;
+        int n = 0, n_cap = 0, depth = 1, inner;
+        char *line = NULL;
+        size_t line_cap = 0;
+        while (getline(&line, &line_cap, in) >= 0) {
+            strip_newline(line);
+            if (sscanf(line, " loop %d", &inner) == 1) depth++;
+            else if (is_end(line) && --depth == 0) break;
+            if (n == n_cap) {
+                n_cap = n_cap ? n_cap * 2 : 16;
+                body = realloc(body, n_cap * sizeof(char*));
             }
+            body[n++] = strdup(line);
         }
+        done = run_block(body, n, reps);
         
-        free(input);
+        for (int i = 0; i < n; i++) free(body[i]);
+        free(body);
+        free(line);
+    }
+    
+    if (timing) {
+        double elapsed = now() - start;
+        fprintf(stderr, "%llu commands in %.3f s (%.0f commands/s)\n", n_commands, elapsed,
+                elapsed > 0 ? n_commands / elapsed : 0);
+    }
+    
+    /* Unmount whatever is left, so entries held back by a sync policy are committed */
+    for (int i = 0; i < MOUNT_LIMIT; i++) {
+        if (mount_table[i] != NULL) unmount_fs(mount_table[i]->path);
     }
     
+    free(input);
+    if (in != stdin) fclose(in);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,136 @@
+/*
+ * @file: trace.c
+ *
+ * Per-thread event rings for the FAT32 engine and their Chrome trace dump
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC
+#endif
+
+#include "trace.h"
+
+#ifdef FAT_TRACE
+static const char *trace_names[TRACE_OP_COUNT] = {
+    "read_fat_table", "write_fat_table", "extract_dir_entry",
+    "fat32_writedata", "next_free_cluster", "find_free_run"
+};
+#endif
+
+/* Every ring ever made, pushed with compare and swap so threads never wait */
+static trace_ring_t *trace_rings = NULL;
+static int trace_next_tid = 1;
+
+/* Clock reading and nanoseconds when the first ring was made, to scale ticks at dump time */
+static uint64_t trace_base_ticks = 0;
+static uint64_t trace_base_ns = 0;
+
+static __thread trace_ring_t *trace_ring = NULL;
+
+uint64_t trace_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Ticks of the cheapest clock around.  On x86 that is the TSC, which
+ * costs a fraction of clock_gettime, elsewhere it is nanoseconds.
+ */
+uint64_t trace_clock(void) {
+#ifdef TRACE_TSC
+    return __rdtsc();
+#else
+    return trace_monotonic_ns();
+#endif
+}
+
+/*
+ * Ring of the calling thread, made and registered on first use
+ */
+trace_ring_t *trace_thread_ring(void) {
+    if (trace_ring != NULL) { return trace_ring; }
+
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) { return NULL; }
+    ring->tid = __sync_fetch_and_add(&trace_next_tid, 1);
+    if (ring->tid == 1) {
+        trace_base_ns = trace_monotonic_ns();
+        trace_base_ticks = trace_clock();
+    }
+    do {
+        ring->next = trace_rings;
+    } while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+
+    trace_ring = ring;
+    return ring;
+}
+
+/*
+ * Record an operation that began at start and ends now
+ */
+void trace_event(int op, uint64_t start, uint32_t cluster, uint32_t bytes) {
+    uint64_t end = trace_clock();
+    trace_ring_t *ring = trace_thread_ring();
+    if (ring == NULL) { return; }
+
+    trace_event_t *ev = &(ring->events[ring->head & (TRACE_RING_SIZE - 1)]);
+    ev->ts = start;
+    ev->dur = (end - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(end - start);
+    ev->cluster = cluster;
+    ev->bytes = bytes;
+    ev->op = op;
+
+    /* Publish the event before the head moves past it */
+    __atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *path) {
+#ifdef FAT_TRACE
+    FILE *out = fopen(path, "w");
+    if (out == NULL) { return -1; }
+
+    /* Scale ticks to nanoseconds by how far both clocks moved since the first ring */
+    double ns_per_tick = 1.0;
+    if (trace_monotonic_ns() - trace_base_ns < 10000000) usleep(10000);    /* Too short to scale well */
+    uint64_t now_ticks = trace_clock(), now_ns = trace_monotonic_ns();
+    if (now_ticks > trace_base_ticks) ns_per_tick = (double)(now_ns - trace_base_ns) / (now_ticks - trace_base_ticks);
+    
+    int written = 0, pid = getpid();
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+        for (uint64_t i = first; i < head; i++) {
+            trace_event_t *ev = &(ring->events[i & (TRACE_RING_SIZE - 1)]);
+            if (ev->op >= TRACE_OP_COUNT) continue;
+            fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"fat32\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"cluster\": %u, \"bytes\": %u}}",
+                    written++ ? "," : "", trace_names[ev->op], pid, ring->tid,
+                    (trace_base_ns + ((double)ev->ts - trace_base_ticks) * ns_per_tick) / 1000.0,
+                    (ev->dur * ns_per_tick) / 1000.0, ev->cluster, ev->bytes);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return written;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+void trace_reset(void) {
+    for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next) {
+        ring->head = 0;
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * @file: trace.h
+ *
+ * Event tracing for the hot paths of the FAT32 engine.  Trace points
+ * cost nothing unless the engine is built with -DFAT_TRACE, in which
+ * case each thread records into its own ring buffer.
+ */
+
+#ifndef TRACE_XINU_HEADER
+#define TRACE_XINU_HEADER
+
+#include <stdint.h>
+
+/* Traced Operations */
+#define TRACE_READ_FAT      0
+#define TRACE_WRITE_FAT     1
+#define TRACE_DIR_ENTRY     2
+#define TRACE_WRITE_DATA    3
+#define TRACE_ALLOC         4
+#define TRACE_ALLOC_RUN     5
+#define TRACE_OP_COUNT      6
+
+/* Events kept per thread, older events are overwritten.  Must be a power of two */
+#define TRACE_RING_SIZE     65536
+
+typedef struct trace_event_s {
+    uint64_t            ts;             /* Start, in trace_clock ticks */
+    uint32_t            dur;            /* Ticks taken */
+    uint32_t            cluster;
+    uint32_t            bytes;
+    uint16_t            op;
+} trace_event_t;
+
+/*
+ * Ring of one thread.  Only the owning thread writes to it, so recording
+ * an event needs no locks.
+ */
+typedef struct trace_ring_s {
+    trace_event_t       events[TRACE_RING_SIZE];
+    uint64_t            head;           /* Events recorded so far */
+    int                 tid;
+    struct trace_ring_s *next;
+} trace_ring_t;
+
+#ifdef FAT_TRACE
+#define TRACE_BEGIN(t)                      uint64_t t = trace_clock()
+#define TRACE_END(t, op, cluster, bytes)    trace_event((op), (t), (cluster), (bytes))
+#else
+#define TRACE_BEGIN(t)
+#define TRACE_END(t, op, cluster, bytes)
+#endif
+
+uint64_t trace_clock(void);
+void trace_event(int op, uint64_t start, uint32_t cluster, uint32_t bytes);
+
+/*
+ * Write every recorded event as Chrome trace JSON, which Perfetto and
+ * chrome://tracing load.  Events recorded while the dump runs may be
+ * torn, so dump once the traced work has stopped.
+ *
+ * @param   path        File to write
+ *
+ * @return  -1 for Error or when tracing is not compiled in, else the
+ *          number of events written
+ */
+int trace_dump(const char *path);
+
+/*
+ * Drop every recorded event.  Like trace_dump it expects the traced work
+ * to have stopped.
+ */
+void trace_reset(void);
+
+#endif
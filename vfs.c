@@ -6,21 +6,137 @@
  * Utility Program for FAT32 Filesystems
  */
 
+#define _GNU_SOURCE
+
+#include <time.h>
+
 #include "vfs.h"
 
-file_t filetable[FILE_LIMIT];
-dir_t *dirtable[FILE_LIMIT];
+/* Open files and directories, each with handles of its own */
+handle_table_t filetable = HANDLE_TABLE_INIT(file_t);
+handle_table_t dirtable = HANDLE_TABLE_INIT(dir_t);
 
 int next_file_pos = 0;
 
+/* Workload capture in progress, NULL when calls are not being recorded */
+FILE *capture_fp = NULL;
+unsigned long long capture_base = 0;
+
 fs_table_t fs_table[] = {
-    {fat32_init, fat32_createfile, fat32_openfile, fat32_deletefile, fat32_readfile, fat32_write, fat32_readdir, fat32_teardown},
-    {fat32_init, fat32_createfile, fat32_openfile, fat32_deletefile, fat32_readfile, fat32_write, fat32_readdir, fat32_teardown}
+    {fat32_init, fat32_createfile, fat32_createbatch, fat32_openfile, fat32_deletefile, fat32_readfile, fat32_write, fat32_closefile, fat32_truncate, fat32_readdir, fat32_trim, fat32_sync, fat32_defrag, fat32_compactdir, fat32_mkdir, fat32_filemap, fat32_reserve, fat32_writeextent, fat32_stats, fat32_teardown},
+    {fat32_init, fat32_createfile, fat32_createbatch, fat32_openfile, fat32_deletefile, fat32_readfile, fat32_write, fat32_closefile, fat32_truncate, fat32_readdir, fat32_trim, fat32_sync, fat32_defrag, fat32_compactdir, fat32_mkdir, fat32_filemap, fat32_reserve, fat32_writeextent, fat32_stats, fat32_teardown}
 };
 
 mount_t *mount_table[MOUNT_LIMIT];
 
+/*
+ * A path component in the mount trie.  Paths resolve by walking their
+ * components down from the root, so the deepest mount passed on the way
+ * is the longest prefix.
+ */
+typedef struct mount_node_s {
+    char                *name;          /* Component leading here from the parent */
+    int                 mount;          /* Position in mount_table, -1 if nothing is mounted here */
+    struct mount_node_s **children;     /* Sorted by name */
+    int                 n_children;
+    int                 cap_children;
+} mount_node_t;
+
+static mount_node_t mount_root = {NULL, -1, NULL, 0, 0};
+
+/*
+ * Compare a component of len bytes, not NUL terminated, with a name
+ */
+static int component_cmp(const char *comp, int len, const char *name) {
+    int c = strncmp(comp, name, len);
+    if (c != 0) { return c; }
+    return (name[len] == '\0') ? 0 : -1;
+}
+
+/*
+ * Find the child of a node for a component, adding it if make is set
+ *
+ * @return  NULL if there is no such child, else the child
+ */
+static mount_node_t *mount_child(mount_node_t *node, const char *comp, int len, int make) {
+    int lo = 0, hi = node->n_children;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = component_cmp(comp, len, node->children[mid]->name);
+        if (c == 0) { return node->children[mid]; }
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    if (!make) { return NULL; }
+    
+    if (node->n_children == node->cap_children) {
+        node->cap_children = node->cap_children ? node->cap_children * 2 : 4;
+        node->children = realloc(node->children, node->cap_children * sizeof(mount_node_t*));
+    }
+    mount_node_t *child = calloc(1, sizeof(mount_node_t));
+    child->name = strndup(comp, len);
+    child->mount = -1;
+    memmove(&(node->children[lo + 1]), &(node->children[lo]), (node->n_children - lo) * sizeof(mount_node_t*));
+    node->children[lo] = child;
+    node->n_children++;
+    return child;
+}
+
+/*
+ * Node a mount point names exactly, made along the way if make is set
+ */
+static mount_node_t *mount_node(const char *path, int make) {
+    mount_node_t *node = &mount_root;
+    while (node != NULL) {
+        while (*path == '/') path++;
+        int len = strcspn(path, "/");
+        if (len == 0) { break; }
+        node = mount_child(node, path, len, make);
+        path += len;
+    }
+    return node;
+}
+
+/*
+ * Free the nodes along path that no longer lead to a mount, deepest first
+ *
+ * @return  1 if node itself is left with no mount and no children
+ */
+static int mount_prune(mount_node_t *node, const char *path) {
+    while (*path == '/') path++;
+    int len = strcspn(path, "/");
+    mount_node_t *child = (len > 0) ? mount_child(node, path, len, 0) : NULL;
+    if (child != NULL && mount_prune(child, path + len)) {
+        int i = 0;
+        while (node->children[i] != child) i++;
+        node->n_children--;
+        memmove(&(node->children[i]), &(node->children[i + 1]), (node->n_children - i) * sizeof(mount_node_t*));
+        free(child->children);
+        free(child->name);
+        free(child);
+    }
+    return node->mount == -1 && node->n_children == 0;
+}
+
+/*
+ * Position in mount_table of the mount made exactly at mount_point
+ */
+static int mount_at(const char *mount_point) {
+    mount_node_t *node = mount_node(mount_point, 0);
+    return (node != NULL) ? node->mount : -1;
+}
+
 void mount_fs(const char *device_name, const char *path) {
+    mount_fs_flags(device_name, path, 0);
+}
+
+void mount_fs_flags(const char *device_name, const char *path, int flags) {
+    mount_fs_opts(device_name, path, flags, 0);
+}
+
+void mount_fs_opts(const char *device_name, const char *path, int flags, int sync_ms) {
+    if (mount_at(path) != -1) { fprintf(stderr, "Could not mount device.  %s is already a mount point\n", path); return; }
+    
     int mount_pos;
     for (mount_pos = 0; mount_pos < MOUNT_LIMIT; mount_pos++) {
         if (mount_table[mount_pos] == NULL) { break; }
@@ -33,169 +149,355 @@ void mount_fs(const char *device_name, const char *path) {
     newmount->path = calloc(strlen(path)+1, sizeof(char));
     strncpy(newmount->path, path, strlen(path));
     newmount->fs_type = FAT32;
+    newmount->flags = flags;
+    newmount->sync_ms = sync_ms;
     mount_table[mount_pos] = newmount;
+    mount_node(path, 1)->mount = mount_pos;
     
     fs_table[newmount->fs_type].init(mount_pos);
 }
 
 void unmount_fs(const char *mount_point) {
-    int mount_pos;
-    for (mount_pos = 0; mount_pos < MOUNT_LIMIT; mount_pos++) {
-        if (mount_table[mount_pos] != NULL) {
-            if (strcmp(mount_table[mount_pos]->path, mount_point) == 0) {
-                
-                fs_table[mount_table[mount_pos]->fs_type].teardown();
-                
-                free(mount_table[mount_pos]->device_name);
-                free(mount_table[mount_pos]->path);
-                free(mount_table[mount_pos]);
-                mount_table[mount_pos] = NULL;
-                break;
-            }
-        }
+    mount_node_t *node = mount_node(mount_point, 0);
+    if (node == NULL || node->mount == -1) { return; }
+    int mount_pos = node->mount;
+    node->mount = -1;
+    mount_prune(&mount_root, mount_point);
+    
+    fs_table[mount_table[mount_pos]->fs_type].teardown(mount_pos);
+    
+    free(mount_table[mount_pos]->device_name);
+    free(mount_table[mount_pos]->path);
+    free(mount_table[mount_pos]);
+    mount_table[mount_pos] = NULL;
+}
+
+int trim_fs(const char *mount_point) {
+    int mount_pos = mount_at(mount_point);
+    if (mount_pos == -1) { return -1; }
+    return fs_table[mount_table[mount_pos]->fs_type].trim(mount_pos);
+}
+
+int sync_fs(const char *mount_point) {
+    int mount_pos = mount_at(mount_point);
+    if (mount_pos == -1) { return -1; }
+    return fs_table[mount_table[mount_pos]->fs_type].sync(mount_pos);
+}
+
+int defrag_fs(const char *mount_point, defrag_stats_t *before, defrag_stats_t *after) {
+    int mount_pos = mount_at(mount_point);
+    if (mount_pos == -1) { return -1; }
+    return fs_table[mount_table[mount_pos]->fs_type].defrag(mount_pos, before, after);
+}
+
+int stats_fs(const char *mount_point, fs_stats_t *stats) {
+    int mount_pos = mount_at(mount_point);
+    if (mount_pos == -1) { return -1; }
+    *stats = *fs_table[mount_table[mount_pos]->fs_type].stats(mount_pos);
+    return 0;
+}
+
+int reset_stats_fs(const char *mount_point) {
+    int mount_pos = mount_at(mount_point);
+    if (mount_pos == -1) { return -1; }
+    memset(fs_table[mount_table[mount_pos]->fs_type].stats(mount_pos), 0, sizeof(fs_stats_t));
+    return 0;
+}
+
+unsigned long long stats_percentile(const fs_op_stats_t *op, int pct) {
+    unsigned long long seen = 0, want = (op->count * pct + 99) / 100;
+    if (op->count == 0) { return 0; }
+    for (int i = 0; i < FS_HIST_BUCKETS; i++) {
+        seen += op->hist[i];
+        if (seen >= want) return 1ULL << i;
     }
+    return 1ULL << (FS_HIST_BUCKETS - 1);
+}
+
+/*
+ * Nanoseconds on the monotonic clock, for timing operations
+ */
+unsigned long long op_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
 }
 
 /*
- * Matches the path name to the actual mount point
+ * Add an operation that began at start to the latency histogram of a mount
+ */
+void record_op(int dev, int op, unsigned long long start) {
+    if (dev < 0 || mount_table[dev] == NULL) { return; }
+    fs_op_stats_t *s = &(fs_table[mount_table[dev]->fs_type].stats(dev)->ops[op]);
+    unsigned long long ns = op_clock() - start;
+    
+    int bucket = 0;
+    for (unsigned long long us = ns / 1000; us > 0 && bucket < FS_HIST_BUCKETS - 1; us >>= 1) bucket++;
+    s->count++;
+    s->total_ns += ns;
+    s->hist[bucket]++;
+}
+
+int capture_start(const char *path) {
+    capture_stop();
+    capture_fp = fopen(path, "wb");
+    if (capture_fp == NULL) { return -1; }
+    
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_fp);
+    capture_base = op_clock();
+    return 0;
+}
+
+void capture_stop(void) {
+    if (capture_fp == NULL) { return; }
+    fclose(capture_fp);
+    capture_fp = NULL;
+}
+
+/*
+ * Append a call that began at start to the capture, if one is running
+ */
+void capture_call(int op, unsigned long long start, int handle, int arg, int result, int mode, const char *path) {
+    if (capture_fp == NULL) { return; }
+    unsigned long long dur = op_clock() - start;
+    
+    capture_rec_t rec;
+    memset(&rec, 0, sizeof(capture_rec_t));
+    rec.ts = start - capture_base;
+    rec.dur = (dur > UINT32_MAX) ? UINT32_MAX : dur;
+    rec.op = op;
+    rec.mode = mode;
+    rec.path_len = (path != NULL) ? strlen(path) : 0;
+    rec.handle = handle;
+    rec.arg = arg;
+    rec.result = result;
+    
+    fwrite(&rec, sizeof(capture_rec_t), 1, capture_fp);
+    if (rec.path_len > 0) fwrite(path, 1, rec.path_len, capture_fp);
+}
+
+/*
+ * Matches the path name to the mount whose mount point is its longest
+ * prefix, compared a whole component at a time
  *
  * @param   path        Absolute path to the file
+ * @param   rest        If not NULL, set to the part of path inside the
+ *                      mount, which starts with a '/' or is empty
  * 
- * @return  Integer cooresponding to the position in the 
+ * @return  -1 if no mount holds the path, else the position in the
  *          file mount table
  */
-int get_device(const char *path) {
-    int best_match = -1;
-    int highest_char_match = -1;
-    for (int i = 0; i < MOUNT_LIMIT; i++) {
-        if (mount_table[i] != NULL) {
-            int match_count = 0;
-            for (int j = 0; j < strlen(mount_table[i]->path); j++) {
-                if (mount_table[i]->path[j] == path[j]) ++match_count;
-            }
-            if (match_count > highest_char_match) {highest_char_match = match_count; best_match = i;};
+int resolve_mount(const char *path, const char **rest) {
+    mount_node_t *node = &mount_root;
+    int best_match = node->mount;
+    if (rest != NULL) *rest = path;
+    
+    while (node != NULL) {
+        while (*path == '/') path++;
+        int len = strcspn(path, "/");
+        if (len == 0) { break; }
+        node = mount_child(node, path, len, 0);
+        path += len;
+        if (node != NULL && node->mount != -1) {
+            best_match = node->mount;
+            if (rest != NULL) *rest = path;
         }
     }
     return best_match;
 }
 
-/* 
- * Insert a file/directory entry into the filetable
- */
-int get_next_table_pos(void *table, int limit) {
-    for (int fpos = 0; fpos < FILE_LIMIT; fpos++) {
-        if (filetable[fpos].name == NULL) return fpos;
-    }
-    return -1;
+int get_device(const char *path) {
+    return resolve_mount(path, NULL);
 }
 
+/*
+ * Fill in a handle for the file at name.  The path inside its mount is
+ * kept in the handle unless it is too long, and the name points into it.
+ */
 void init_file(file_t *file, const char *name) {
+    file->device = resolve_mount(name, &name);
+    int len = strlen(name);
+    file->path = (len < FS_INLINE_PATH) ? file->inline_path : malloc(len + 1);
+    memcpy(file->path, name, len + 1);
     
-    char *npos = strrchr(name, '/'); int sz = strlen(++npos);    
-    file->name = calloc(sz, sizeof(char));
-    strncpy(file->name, npos, sz);
-    
-    file->path = calloc(strlen(name), sizeof(char));
-    strncpy(file->path, name, strlen(name));
-    
-    file->device = get_device(name);
+    char *npos = strrchr(file->path, '/');
+    file->name = (npos == NULL) ? file->path : npos + 1;
     
     // byte offset in file
     file->offset = 0;
     file->size = 0;
 }
 
-void close_file(int pos) {
-    free(filetable[pos].name);
-    free(filetable[pos].path);
-    filetable[pos].device = 0;
-    filetable[pos].offset = 0;
-    filetable[pos].size = 0;
+void release_file(file_t *file) {
+    if (file->path != file->inline_path) free(file->path);
+    file->path = NULL;
+    file->name = NULL;
+}
+
+void close_file(int file) {
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return; }
+    release_file(fp);
+    handle_free(&filetable, file);
 }
 
 int opendir(const char *path) {    
-    dir_t *dir = calloc(1, sizeof(dir_t));
-    
-    dir->path = calloc(strlen(path), sizeof(char));
-    strncpy(dir->path, path, strlen(path));
-    dir->device = get_device(path);
-    dir->offset = 0;
-    
-    int pos = get_next_table_pos(dirtable, FILE_LIMIT);
-    //printf("pos: %d\n", pos);
-    if (pos != -1) dirtable[pos] = dir;
+    unsigned long long start = op_clock();
+    int pos = handle_alloc(&dirtable);
+    if (pos != -1) {
+        dir_t *dir = handle_get(&dirtable, pos);
+        int len = strlen(path);
+        dir->path = (len < FS_INLINE_PATH) ? dir->inline_path : malloc(len + 1);
+        memcpy(dir->path, path, len + 1);
+        dir->device = get_device(path);
+        dir->offset = 0;
+        dir->name[0] = '\0';
+        if (dir->device == -1) {
+            if (dir->path != dir->inline_path) free(dir->path);
+            handle_free(&dirtable, pos);
+            pos = -1;
+        }
+    }
     
+    capture_call(CAPTURE_OPENDIR, start, pos, 0, pos, 0, path);
     return pos;
 }
 
 dir_entry_t readdir(int dir) {
-    dir_t *dir_info = dirtable[dir];
-    return fs_table[mount_table[dir_info->device]->fs_type].readdir(dir_info);
+    dir_t *dir_info = handle_get(&dirtable, dir);
+    if (dir_info == NULL) {
+        dir_entry_t none = {NULL, 0, 0, 0, NULL};
+        return none;
+    }
+    unsigned long long start = op_clock();
+    dir_entry_t ent = fs_table[mount_table[dir_info->device]->fs_type].readdir(dir_info);
+    record_op(dir_info->device, FS_OP_READDIR, start);
+    capture_call(CAPTURE_READDIR, start, dir, 0, ent.name != NULL, 0, NULL);
+    return ent;
 }
 
 void changedir(char *dirname) {
+    unsigned long long start = op_clock();
 
     file_t file;
     file.name = strrchr(dirname, '/');
     if (file.name == NULL) file.name = dirname;
     else file.name++; // Increase 1 past the last /
 
-    file.path = dirname;
-    file.device = get_device(dirname);
+    file.device = resolve_mount(dirname, (const char**)&file.path);
     file.offset = 0;
     file.size = 0;
+    if (file.device == -1) { return; }
 
     fs_table[mount_table[file.device]->fs_type].openfile(-1, &file, 1);
+    capture_call(CAPTURE_CHDIR, start, -1, 0, 0, 0, dirname);
 }
 
 void closedir(int dir) {
-    if (dir > FILE_LIMIT) { return; }
+    dir_t *directory = handle_get(&dirtable, dir);
+    if (directory == NULL) { return; }
+    capture_call(CAPTURE_CLOSEDIR, op_clock(), dir, 0, 0, 0, NULL);
     
     // Flush All Changes Here
     
-    dir_t *directory = dirtable[dir];
-    dirtable[dir] = NULL;
-    
-    if (directory->path != NULL) free(directory->path);
-    if (directory != NULL) free(directory);
+    if (directory->path != directory->inline_path) free(directory->path);
+    handle_free(&dirtable, dir);
 }
 
 int filecreate(const char *name) {
-    int pos = get_next_table_pos(filetable, FILE_LIMIT);
-    init_file(&filetable[pos], name);
+    int handle = handle_alloc(&filetable);
+    if (handle == -1) { return -1; }
+    file_t *fp = handle_get(&filetable, handle);
+    init_file(fp, name);
+    if (fp->device == -1) { close_file(handle); return -1; }
     
-    mount_t *mp = mount_table[filetable[pos].device];
-    fs_table[mp->fs_type].createfile(pos, &filetable[pos]);
-    return 0;
+    mount_t *mp = mount_table[fp->device];
+    unsigned long long start = op_clock();
+    int npos = fs_table[mp->fs_type].createfile(HANDLE_INDEX(handle), fp);
+    record_op(fp->device, FS_OP_CREATE, start);
+    
+    if (npos == -1) { close_file(handle); handle = -1; }
+    capture_call(CAPTURE_CREATE, start, handle, 0, handle, 0, name);
+    return handle;
+}
+
+int filecreate_batch(const char **names, const unsigned int *sizes, int count) {
+    if (count <= 0) { return 0; }
+    
+    file_t *files = calloc(count, sizeof(file_t));
+    for (int i = 0; i < count; i++) init_file(&files[i], names[i]);
+    
+    /* The engine creates every file in the directory of the first, so the rest must share it */
+    int same = (files[0].device != -1);
+    size_t dir_len = files[0].name - files[0].path;
+    for (int i = 1; i < count && same; i++) {
+        same = files[i].device == files[0].device && (size_t)(files[i].name - files[i].path) == dir_len &&
+               memcmp(files[i].path, files[0].path, dir_len) == 0;
+    }
+    if (!same && files[0].device != -1) fprintf(stderr, "%s: Batch names are not all in one directory\n", names[0]);
+    
+    int created = 0;
+    if (same) {
+        mount_t *mp = mount_table[files[0].device];
+        created = fs_table[mp->fs_type].createbatch(files, sizes, count);
+    }
+    
+    for (int i = 0; i < count; i++) release_file(&files[i]);
+    free(files);
+    return created;
 }
 
 int fileopen(const char *fname, int mode) {
-    int pos = get_next_table_pos(filetable, FILE_LIMIT);
-    init_file(&filetable[pos], fname);
+    int handle = handle_alloc(&filetable);
+    if (handle == -1) { return -1; }
+    int pos = HANDLE_INDEX(handle);
+    file_t *fp = handle_get(&filetable, handle);
+    init_file(fp, fname);
+    if (fp->device == -1) { close_file(handle); return -1; }
         
-    mount_t *mp = mount_table[filetable[pos].device];
-    int npos = fs_table[mp->fs_type].openfile(pos, &filetable[pos], 0);
+    mount_t *mp = mount_table[fp->device];
+    unsigned long long start = op_clock();
+    int npos = fs_table[mp->fs_type].openfile(pos, fp, 0);
+    record_op(fp->device, FS_OP_OPEN, start);
     
-    if (npos == -1) close_file(pos);    
-    if (mode == APPEND) filetable[pos].offset += filetable[pos].size;
+    if (npos == -1) { close_file(handle); capture_call(CAPTURE_OPEN, start, -1, 0, -1, mode, fname); return npos; }
+    int size = fp->size;
+    if (mode == APPEND) fp->offset += fp->size;
+    if (mode == TRUNCATE) fs_table[mp->fs_type].truncate(pos, 0);
     
-    return npos;
+    capture_call(CAPTURE_OPEN, start, handle, size, handle, mode, fname);
+    return handle;
 }
 
 int filewrite(int file, const char *buffer, int count) {
-    if (file > FILE_LIMIT) { return -1; }
-    file_t *fp = &(filetable[file]);
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
+    mount_t *mp = mount_table[fp->device];
+    
+    unsigned long long start = op_clock();
+    int num_written = fs_table[mp->fs_type].write(HANDLE_INDEX(file), buffer, count);
+    record_op(fp->device, FS_OP_WRITE, start);
+    capture_call(CAPTURE_WRITE, start, file, count, num_written, 0, NULL);
+    return num_written;
+}
+
+int filetruncate(int file, unsigned int length) {
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
     mount_t *mp = mount_table[fp->device];
     
-    return fs_table[mp->fs_type].write(file, buffer, count);
+    return fs_table[mp->fs_type].truncate(HANDLE_INDEX(file), length);
 }
 
 int fileread(int file, char *buffer, int count) {
-    if (file > FILE_LIMIT) { return -1; }
-    file_t *fp = &(filetable[file]);
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
     mount_t *mp = mount_table[fp->device];
     
-    int num_read = fs_table[mp->fs_type].read(file, buffer, count);
+    unsigned long long start = op_clock();
+    int num_read = fs_table[mp->fs_type].read(HANDLE_INDEX(file), buffer, count);
+    record_op(fp->device, FS_OP_READ, start);
+    capture_call(CAPTURE_READ, start, file, count, num_read, 0, NULL);
 
     if (num_read < count) buffer[num_read] = '\0';
 
@@ -203,23 +505,56 @@ int fileread(int file, char *buffer, int count) {
 }
 
 int deletefile(char *file) {
-    /* Find file, set dir entry to 0xE5 */
-    /* Do NOT clear data/cluster */
+    /* Find file, set dir entry to 0xE5 and free its clusters */
     file_t f;
-    f.name = file;
-    f.device = get_device(file);
-    fs_table[mount_table[f.device]->fs_type].deletefile(&f);
-    
-    return 0;
+    f.device = resolve_mount(file, (const char**)&f.name);
+    if (f.device == -1) { return -1; }
+    unsigned long long start = op_clock();
+    int rc = fs_table[mount_table[f.device]->fs_type].deletefile(&f);
+    record_op(f.device, FS_OP_DELETE, start);
+    capture_call(CAPTURE_DELETE, start, -1, 0, rc, 0, file);
+    return rc;
+}
+
+int compactdir(const char *path) {
+    file_t d;
+    d.device = resolve_mount(path, (const char**)&d.name);
+    if (d.device == -1) { return -1; }
+    return fs_table[mount_table[d.device]->fs_type].compactdir(&d);
+}
+
+int makedir(const char *path) {
+    file_t d;
+    init_file(&d, path);
+    int rc = (d.device == -1) ? -1 : fs_table[mount_table[d.device]->fs_type].mkdir(&d);
+    release_file(&d);
+    return rc;
+}
+
+int filemap(int file, fs_extent_t **extents) {
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
+    return fs_table[mount_table[fp->device]->fs_type].filemap(HANDLE_INDEX(file), extents);
+}
+
+int filereserve(int file, unsigned int size, fs_extent_t **extents) {
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
+    return fs_table[mount_table[fp->device]->fs_type].reserve(HANDLE_INDEX(file), size, extents);
+}
+
+int filewrite_extent(int file, const fs_extent_t *extent, unsigned int offset, const char *buffer, int count) {
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return -1; }
+    return fs_table[mount_table[fp->device]->fs_type].writeextent(HANDLE_INDEX(file), extent, offset, buffer, count);
 }
 
 void fileclose(int file) {
-    if (file > FILE_LIMIT) { return; }
-    
-    // Flush All Changes Here
-    
-    file_t *fp = &(filetable[file]);
-    //filetable[file] = NULL;
+    file_t *fp = handle_get(&filetable, file);
+    if (fp == NULL) { return; }
     
-    if (fp->name != NULL) free(fp->name);
+    // Flush All Changes Here, as far as the mount's sync policy asks
+    fs_table[mount_table[fp->device]->fs_type].closefile(HANDLE_INDEX(file));
+    capture_call(CAPTURE_CLOSE, op_clock(), file, 0, 0, 0, NULL);
+    close_file(file);
 }
@@ -20,20 +20,193 @@
 
 #define BEGIN       0
 #define APPEND      1
+#define TRUNCATE    2
 
 void mount_fs(const char *device_name, const char *path);
+void mount_fs_flags(const char *device_name, const char *path, int flags);
+
+/*
+ * Mount with flags and the flush interval of a MOUNT_SYNC_PERIODIC mount
+ *
+ * @param   sync_ms     Milliseconds between commits, 0 for FS_SYNC_PERIOD_MS
+ */
+void mount_fs_opts(const char *device_name, const char *path, int flags, int sync_ms);
 void unmount_fs(const char *mount_point);
 
+/*
+ * Discard every freed cluster run queued on a mount made with
+ * MOUNT_DISCARD_DEFERRED
+ *
+ * @param   mount_point     Path the device is mounted on
+ *
+ * @return  -1 for Error, else the number of clusters discarded
+ */
+int trim_fs(const char *mount_point);
+
+/*
+ * Make everything written to a mount durable, whatever its sync policy
+ *
+ * @param   mount_point     Path the device is mounted on
+ *
+ * @return  -1 for Error, else 0
+ */
+int sync_fs(const char *mount_point);
+
+/*
+ * Rewrite every fragmented file on a mount into one contiguous extent.
+ * Nothing on the mount may be open, or it fails without moving anything.
+ *
+ * @param   mount_point     Path the device is mounted on
+ * @param   before          Filled in with the fragmentation found
+ * @param   after           Filled in with the fragmentation left
+ *
+ * @return  -1 for Error, else the number of files moved
+ */
+int defrag_fs(const char *mount_point, defrag_stats_t *before, defrag_stats_t *after);
+
+/*
+ * Copy the device I/O counters and operation latencies of a mount
+ *
+ * @param   mount_point     Path the device is mounted on
+ * @param   stats           Filled in with a snapshot of the counters
+ *
+ * @return  -1 for Error, else 0
+ */
+int stats_fs(const char *mount_point, fs_stats_t *stats);
+
+/*
+ * Zero the counters and latencies of a mount
+ *
+ * @return  -1 for Error, else 0
+ */
+int reset_stats_fs(const char *mount_point);
+
+/*
+ * Estimate a latency percentile from an operation's histogram
+ *
+ * @param   op          Operation stats taken from stats_fs
+ * @param   pct         Percentile wanted, 0 to 100
+ *
+ * @return  Upper bound of the bucket holding the percentile, in microseconds
+ */
+unsigned long long stats_percentile(const fs_op_stats_t *op, int pct);
+
+/*
+ * Record every call made through this interface to a capture file that
+ * the replay tool can run again.  Only sizes and timing are kept, not
+ * the data read or written.
+ *
+ * @param   path        Capture file to create
+ *
+ * @return  -1 for Error, else 0
+ */
+int capture_start(const char *path);
+void capture_stop(void);
+
 int opendir(const char *path);
+
+/*
+ * Returns the next entry of an open directory, or one whose name is NULL
+ * at the end.  The name is held in the directory handle, so it is only
+ * good until the next readdir or closedir on it.
+ */
 dir_entry_t readdir(int dir);
 void changedir(char *dirname);
 void closedir(int dir);
 
 int filecreate(const char *name);
+
+/*
+ * Create many files in one directory with one pass over the directory
+ * and the FAT
+ *
+ * @param   names       Paths of the files to create, all in the same directory
+ * @param   sizes       Bytes to preallocate for each file as one contiguous
+ *                      run where possible, or NULL to create empty files
+ * @param   count       Number of names
+ *
+ * @return  Number of files created, 0 if the names are not all in one directory
+ */
+int filecreate_batch(const char **names, const unsigned int *sizes, int count);
 int fileopen(const char *fname, int mode);
 int filewrite(int file, const char *buffer, int count);
+
+/*
+ * Shrink a file opened with fileopen, freeing the clusters past the new end
+ *
+ * @param   file        File id to truncate
+ * @param   length      New length in bytes, no larger than the file
+ *
+ * @return  -1 for Error, else 0
+ */
+int filetruncate(int file, unsigned int length);
 int deletefile(char *file);
 
+/*
+ * Rewrite a directory with its live entries packed together and release
+ * the clusters it no longer needs.  Open files in it stay valid.
+ *
+ * @param   path        Directory to compact
+ *
+ * @return  -1 for Error, else the number of slots reclaimed
+ */
+int compactdir(const char *path);
+
+/*
+ * Make an empty directory.  Every component of path but the last must
+ * already exist.
+ *
+ * @param   path        Directory to make
+ *
+ * @return  -1 for Error, else 0
+ */
+int makedir(const char *path);
+
+/*
+ * Find where the data of a file opened with fileopen lives on its device,
+ * so it can be read or written there directly.  Only valid while the
+ * file's clusters stay put, that is until it is truncated, written past
+ * its end, deleted or defragmented.
+ *
+ * @param   file        File id to map
+ * @param   extents     Set to the runs of the file in order, to be
+ *                      released with free
+ *
+ * @return  -1 for Error, else the number of runs
+ */
+int filemap(int file, fs_extent_t **extents);
+
+/*
+ * Set clusters aside for an empty file opened with fileopen and map them
+ * like filemap.  The file takes the size straight away, but its entry
+ * only claims the clusters once it is truncated or closed, after the data
+ * written into them, so a crash never leaves it claiming unwritten data.
+ *
+ * @param   file        File id of an empty file
+ * @param   size        Bytes to reserve
+ * @param   extents     Set to the runs reserved, to be released with free
+ *
+ * @return  -1 if the file is not empty or there is no room, else the
+ *          number of runs
+ */
+int filereserve(int file, unsigned int size, fs_extent_t **extents);
+
+/*
+ * Write into a run returned by filemap or filereserve, through the mount
+ * and counted against it.  Unlike every other call it may be made from
+ * many threads at once, as long as no two write the same run and the
+ * file stays open.  The file's size and position are left alone.
+ *
+ * @param   file        File id the run belongs to
+ * @param   extent      Run to write into
+ * @param   offset      Byte offset into the run
+ * @param   buffer      Data to write
+ * @param   count       Bytes to write, which must fit in the run
+ *
+ * @return  -1 for Error, else the number of bytes written
+ */
+int filewrite_extent(int file, const fs_extent_t *extent, unsigned int offset, const char *buffer, int count);
+
 /*
  * Read a file opened with fileopen, placing the contents into buffer
  * 